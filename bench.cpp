@@ -0,0 +1,610 @@
+#include "uid.cpp"
+#include "terragen.h"
+#include <iomanip>
+#include <thread>
+
+// Microbenchmarks for the core containers and allocators.
+// Prints one JSON document to stdout so results can be saved and compared across versions on the same machine,
+// and a human readable summary to stderr.
+//
+// usage: ./bench [filter]
+// only benchmarks whose name contains filter are run
+
+// nonstd::vector moves its elements with realloc so the name is stored inline
+struct bench_result {
+    char name[96];
+    uint64_t items; // operations per run
+    uint64_t runs;
+    double best_ns; // fastest run
+    double mean_ns;
+};
+
+nonstd::vector<bench_result> results;
+const char *bench_filter = nil;
+
+template <typename T>
+inline void do_not_optimize(T const& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// runs f until at least min_seconds have passed (and at least 3 times) and records the fastest and mean run.
+// f must do `items` operations per call.
+template <typename F>
+void bench(std::string name, uint64_t items, F&& f, double min_seconds = 0.2) {
+    if(bench_filter && name.find(bench_filter) == std::string::npos) {
+        return;
+    }
+    f(); // warm up caches, page in memory, grow tables
+    double best = 1e300;
+    double total = 0.0;
+    uint64_t runs = 0;
+    while(runs < 3 || total < min_seconds * 1e9) {
+        auto begin = now();
+        f();
+        double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now() - begin).count();
+        best = glm::min(best, ns);
+        total += ns;
+        runs++;
+    }
+    bench_result& r = results.emplace_back();
+    snprintf(r.name, sizeof(r.name), "%s", name.c_str());
+    r.items = items;
+    r.runs = runs;
+    r.best_ns = best;
+    r.mean_ns = total / runs;
+    std::cerr << std::left << std::setw(48) << name << std::right << std::setw(12) << std::fixed << std::setprecision(3)
+        << best / items << " ns/op " << std::setw(12) << std::setprecision(2) << items / best * 1e3 << " Mop/s\n";
+}
+
+void bench_vector() {
+    for(uint64_t n : {1000ULL, 1000000ULL}) {
+        bench(fstr("vector/push_back/%llu", n), n, [n]() {
+            nonstd::vector<uint64_t> v;
+            for(uint64_t i = 0; i < n; i++) {
+                v.push_back(i);
+            }
+            do_not_optimize(v.data);
+            v.destroy();
+        });
+        bench(fstr("vector/push_back_reserved/%llu", n), n, [n]() {
+            nonstd::vector<uint64_t> v;
+            v.reserve(n);
+            for(uint64_t i = 0; i < n; i++) {
+                v.push_back(i);
+            }
+            do_not_optimize(v.data);
+            v.destroy();
+        });
+        bench(fstr("vector/emplace_back_dTri/%llu", n), n, [n]() {
+            nonstd::vector<dTri> v;
+            for(uint64_t i = 0; i < n; i++) {
+                v.emplace_back();
+            }
+            do_not_optimize(v.data);
+            v.destroy();
+        });
+    }
+}
+
+// a frame's worth of temporaries: a few vectors built up and thrown away
+void bench_frame_arena() {
+    const uint64_t n = 100000;
+    bench("frame_temporaries/heap", n, [n]() {
+        nonstd::vector<uint64_t> a;
+        nonstd::vector<dTri> b;
+        for(uint64_t i = 0; i < n; i++) {
+            a.push_back(i);
+            if(i % 4 == 0) b.emplace_back();
+        }
+        do_not_optimize(a.data);
+        do_not_optimize(b.data);
+        a.destroy();
+        b.destroy();
+    });
+    frame_arena arena;
+    arena.init(1 << 16);
+    bench("frame_temporaries/arena", n, [&arena, n]() {
+        arena.reset();
+        nonstd::arena_vector<uint64_t> a(arena_alloc{&arena});
+        nonstd::arena_vector<dTri> b(arena_alloc{&arena});
+        for(uint64_t i = 0; i < n; i++) {
+            a.push_back(i);
+            if(i % 4 == 0) b.emplace_back();
+        }
+        do_not_optimize(a.data);
+        do_not_optimize(b.data);
+    });
+    arena.destroy();
+}
+
+void bench_mempool() {
+    for(uint64_t n : {1000ULL, 100000ULL}) {
+        mempool pool;
+        bzero(&pool, sizeof(pool));
+        cacheline **lines = (cacheline**)malloc(n * sizeof(cacheline*));
+        bench(fstr("mempool/alloc_free/%llu", n), n, [&pool, lines, n]() {
+            for(uint64_t i = 0; i < n; i++) {
+                lines[i] = pool.alloc();
+                lines[i]->ptr[0] = lines[i];
+            }
+            for(uint64_t i = 0; i < n; i++) {
+                pool.free(lines[n - 1 - i]);
+            }
+        });
+        free(lines);
+    }
+}
+
+// allocs per second with every thread spawning and destroying its own objects, concurrent_mempool against the
+// plain mempool behind a mutex
+template <typename F>
+void run_threads(int num_threads, F&& f) {
+    std::vector<std::thread> threads;
+    for(int t = 0; t < num_threads; t++) {
+        threads.emplace_back(f);
+    }
+    for(auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void bench_mempool_scaling() {
+    const uint64_t n = 1 << 16;
+    int max_threads = std::max(1U, std::thread::hardware_concurrency());
+    for(int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        mempool locked_pool;
+        bzero(&locked_pool, sizeof(locked_pool));
+        mutex pool_lock;
+        bench(fstr("mempool_locked/threads/%d", num_threads), n * num_threads, [&locked_pool, &pool_lock, num_threads, n]() {
+            run_threads(num_threads, [&locked_pool, &pool_lock, n]() {
+                cacheline *lines[64];
+                for(uint64_t i = 0; i < n; i += 64) {
+                    for(int j = 0; j < 64; j++) {
+                        std::lock_guard<mutex> guard(pool_lock);
+                        lines[j] = locked_pool.alloc();
+                    }
+                    for(int j = 0; j < 64; j++) {
+                        std::lock_guard<mutex> guard(pool_lock);
+                        locked_pool.free(lines[j]);
+                    }
+                }
+            });
+        });
+        concurrent_mempool pool;
+        bench(fstr("concurrent_mempool/threads/%d", num_threads), n * num_threads, [&pool, num_threads, n]() {
+            run_threads(num_threads, [&pool, n]() {
+                cacheline *lines[64];
+                for(uint64_t i = 0; i < n; i += 64) {
+                    for(int j = 0; j < 64; j++) {
+                        lines[j] = pool.alloc();
+                    }
+                    for(int j = 0; j < 64; j++) {
+                        pool.free(lines[j]);
+                    }
+                }
+            });
+        });
+    }
+}
+
+// alloc/free of mixed small sizes, the kind of traffic dMesh and vegetation vectors produce
+void bench_slab() {
+    const uint64_t n = 4096;
+    void **blocks = (void**)malloc(n * sizeof(void*));
+    size_t *sizes = (size_t*)malloc(n * sizeof(size_t));
+    Prng_xoshiro rng;
+    rng.init(3, 4);
+    for(uint64_t i = 0; i < n; i++) {
+        sizes[i] = 16 + rng.get() % 4000;
+    }
+    bench("malloc/alloc_free_mixed", n, [blocks, sizes, n]() {
+        for(uint64_t i = 0; i < n; i++) {
+            blocks[i] = malloc(sizes[i]);
+            *(uint64_t*)blocks[i] = i;
+        }
+        for(uint64_t i = 0; i < n; i += 2) {
+            free(blocks[i]);
+        }
+        for(uint64_t i = 1; i < n; i += 2) {
+            free(blocks[i]);
+        }
+    });
+    slab_allocator slab;
+    bench("slab_allocator/alloc_free_mixed", n, [&slab, blocks, sizes, n]() {
+        for(uint64_t i = 0; i < n; i++) {
+            blocks[i] = slab.alloc_bytes(sizes[i]);
+            *(uint64_t*)blocks[i] = i;
+        }
+        for(uint64_t i = 0; i < n; i += 2) {
+            slab.free_bytes(blocks[i], sizes[i]);
+        }
+        for(uint64_t i = 1; i < n; i += 2) {
+            slab.free_bytes(blocks[i], sizes[i]);
+        }
+    });
+    slab.destroy();
+    free(blocks);
+    free(sizes);
+}
+
+// load factor is relative to the capacity the table is reserved at. UIDHashTable grows at 0.5 and
+// UIDSwissTable at 0.875.
+template <typename Table>
+void bench_table(const char *name, uint64_t capacity, double load_factor) {
+    uint64_t n = capacity * load_factor - 1;
+    UID *keys = (UID*)malloc(n * sizeof(UID));
+    UID *queries = (UID*)malloc(n * sizeof(UID));
+    uint32_t *out = (uint32_t*)malloc(n * sizeof(uint32_t));
+    Prng_xoshiro rng;
+    rng.init(capacity, n);
+    for(uint64_t i = 0; i < n; i++) {
+        keys[i] = UID{0ULL, 0ULL};
+        keys[i].setPID(1 + rng.get() % 0x0000FFFFFFFFFFFF);
+        keys[i].setOID(rng.get() % 0x0000FFFFFFFFFFFF);
+        keys[i].setIdx(i);
+    }
+    for(uint64_t i = 0; i < n; i++) {
+        queries[i] = keys[rng.get() % n];
+    }
+    Table table;
+    table.init(16);
+    table.reserve(capacity);
+    std::string prefix = fstr("%s/%llu/lf%.2f", name, capacity, load_factor);
+    bench(prefix + "/insert_remove", n, [&table, keys, n]() {
+        for(uint64_t i = 0; i < n; i++) {
+            table.insert(keys[i]);
+        }
+        for(uint64_t i = 0; i < n; i++) {
+            table.remove(keys[i]);
+        }
+    });
+    for(uint64_t i = 0; i < n; i++) {
+        table.insert(keys[i]);
+    }
+    bench(prefix + "/lookup", n, [&table, queries, n]() {
+        uint64_t sum = 0;
+        for(uint64_t i = 0; i < n; i++) {
+            sum += table[queries[i]];
+        }
+        do_not_optimize(sum);
+    });
+    bench(prefix + "/lookup_many", n, [&table, queries, out, n]() {
+        table.lookup_many(queries, n, out);
+        do_not_optimize(out[0]);
+    });
+    table.destroy();
+    free(keys);
+    free(queries);
+    free(out);
+}
+
+void bench_tables() {
+    for(uint64_t capacity : {1ULL << 12, 1ULL << 16, 1ULL << 22}) {
+        for(double load_factor : {0.25, 0.49}) {
+            bench_table<UIDHashTable>("UIDHashTable", capacity, load_factor);
+        }
+        for(double load_factor : {0.5, 0.85}) {
+            bench_table<UIDSwissTable>("UIDSwissTable", capacity, load_factor);
+        }
+    }
+}
+
+void bench_hvec3() {
+    const uint64_t n = 4096;
+    hvec3 *a = (hvec3*)malloc(n * sizeof(hvec3));
+    hvec3 *b = (hvec3*)malloc(n * sizeof(hvec3));
+    ctleaf *leaves = (ctleaf*)malloc(n * sizeof(ctleaf));
+    Prng_xoshiro rng;
+    rng.init(1, 2);
+    for(uint64_t i = 0; i < n; i++) {
+        a[i] = hvec3((int16_t)(rng.get() % 2000 - 1000), (int16_t)(rng.get() % 2000 - 1000), (int16_t)(rng.get() % 2000 - 1000));
+        b[i] = hvec3((int16_t)(rng.get() % 100), (int16_t)(rng.get() % 100), (int16_t)(rng.get() % 100));
+        leaves[i].object = nil;
+        leaves[i].lo = a[i];
+        leaves[i].hi = a[i] + b[i];
+    }
+    bench("hvec3/add_sub_minmax", n, [a, b, n]() {
+        hvec3 acc(0);
+        for(uint64_t i = 0; i < n; i++) {
+            hvec3 sum = a[i] + b[i];
+            hvec3 diff = a[i] - b[i];
+            acc = hvec3::max(acc, sum) + hvec3::min(diff, b[i]) / 4;
+        }
+        do_not_optimize(acc);
+    });
+    bench("hvec3/from_dvec3", n, [n]() {
+        hvec3 acc(0);
+        for(uint64_t i = 0; i < n; i++) {
+            acc = hvec3::max(acc, hvec3(dvec3(i * 0.25, i * -0.5, i * 0.125)));
+        }
+        do_not_optimize(acc);
+    });
+    bench("calculateBounds/4096", n, [leaves, n]() {
+        AABB bounds = calculateBounds(leaves, 0, n - 1);
+        do_not_optimize(bounds);
+    });
+    free(a);
+    free(b);
+    free(leaves);
+}
+
+void bench_prng() {
+    const uint64_t n = 1 << 16;
+    bench("Prng_xoshiro/get", n, [n]() {
+        Prng_xoshiro rng;
+        rng.init(1, 2);
+        uint64_t acc = 0;
+        for(uint64_t i = 0; i < n; i++) {
+            acc ^= rng.get();
+        }
+        do_not_optimize(acc);
+    });
+    bench("Prng_xoshiro/uniform", n, [n]() {
+        Prng_xoshiro rng;
+        rng.init(1, 2);
+        double acc = 0.0;
+        for(uint64_t i = 0; i < n; i++) {
+            acc += rng.uniform();
+        }
+        do_not_optimize(acc);
+    });
+    bench("Prng_sha256/get", n, [n]() {
+        Prng_sha256 rng;
+        rng.init(1, 2);
+        uint64_t acc = 0;
+        for(uint64_t i = 0; i < n; i++) {
+            acc ^= rng.get();
+        }
+        do_not_optimize(acc);
+    });
+    bench("Prng_sha256/uniform", n, [n]() {
+        Prng_sha256 rng;
+        rng.init(1, 2);
+        double acc = 0.0;
+        for(uint64_t i = 0; i < n; i++) {
+            acc += rng.uniform();
+        }
+        do_not_optimize(acc);
+    });
+    bench("sha256_hash", n, [n]() {
+        uint64_t acc = 0;
+        for(uint64_t i = 0; i < n; i++) {
+            acc ^= sha256_hash(i, acc);
+        }
+        do_not_optimize(acc);
+    });
+    uint64_t *bits = (uint64_t*)malloc(n * sizeof(uint64_t));
+    bench("Prng_xoshiro/fill", n, [bits, n]() {
+        Prng_xoshiro rng;
+        rng.init(1, 2);
+        rng.fill(bits, n);
+        do_not_optimize(bits[n - 1]);
+    });
+    bench("Prng_xoshiro/fill_uniform_double", n, [bits, n]() {
+        Prng_xoshiro rng;
+        rng.init(1, 2);
+        rng.fill_uniform((double*)bits, n);
+        do_not_optimize(bits[n - 1]);
+    });
+    bench("Prng_xoshiro/fill_uniform_float", 2 * n, [bits, n]() {
+        Prng_xoshiro rng;
+        rng.init(1, 2);
+        rng.fill_uniform((float*)bits, 2 * n);
+        do_not_optimize(bits[n - 1]);
+    });
+    bench("Prng_sha256/fill", n, [bits, n]() {
+        Prng_sha256 rng;
+        rng.init(1, 2);
+        rng.fill(bits, n);
+        do_not_optimize(bits[n - 1]);
+    });
+    uint64_t *seeds = (uint64_t*)malloc(n * sizeof(uint64_t));
+    for(uint64_t i = 0; i < n; i++) {
+        seeds[i] = i;
+    }
+    bench("sha256_hash_many", n, [bits, seeds, n]() {
+        sha256_hash_many(bits, seeds, seeds, n);
+        do_not_optimize(bits[n - 1]);
+    });
+    free(seeds);
+    free(bits);
+    bench("Prng_philox/get", n, [n]() {
+        Prng_philox rng;
+        rng.init(1);
+        uint64_t acc = 0;
+        for(uint64_t i = 0; i < n; i++) {
+            acc ^= rng.get(2, 0, i);
+        }
+        do_not_optimize(acc);
+    });
+    uint64_t *out = (uint64_t*)malloc(n * sizeof(uint64_t));
+    bench("Prng_philox/get_many", n, [out, n]() {
+        Prng_philox rng;
+        rng.init(1);
+        rng.get_many(out, 2, 0, 0, n);
+        do_not_optimize(out[n - 1]);
+    });
+    free(out);
+}
+
+void bench_terrain_lookup() {
+    TerrainTree tree(52, 10.0, 6.371e6, 1.0);
+    terrain_mesh mesh = tree.buildMesh(dvec3(0.0, 6.371e6, 0.0), 3, nil);
+    mesh.destroy();
+    const uint64_t n = 1 << 14;
+    dvec3 *positions = (dvec3*)malloc(n * sizeof(dvec3));
+    ttnode **out = (ttnode**)malloc(n * sizeof(ttnode*));
+    Prng_xoshiro rng;
+    rng.init(5, 6);
+    // scattered around the vantage point where the tree is deepest, like physics and altitude queries
+    for(uint64_t i = 0; i < n; i++) {
+        positions[i] = (dvec3(0.0, 1.0, 0.0) + dvec3(rng.uniform() - 0.5, 0.0, rng.uniform() - 0.5) * 1e-3) * 6.371e6;
+    }
+    bench("TerrainTree/lookup", n, [&tree, positions, n]() {
+        uint64_t acc = 0;
+        for(uint64_t i = 0; i < n; i++) {
+            acc += tree[positions[i]]->rendered_at_level;
+        }
+        do_not_optimize(acc);
+    });
+    bench("TerrainTree/lookup_batch", n, [&tree, positions, out, n]() {
+        tree.lookup(positions, n, out);
+        do_not_optimize(out[0]);
+    });
+    free(positions);
+    free(out);
+    tree.destroy();
+    delete tree.generator;
+}
+
+void bench_ground_query() {
+    ground_query_service ground;
+    ground.init(52, 6.371e6, 1.0, 1 << 20);
+    const uint64_t n = 1024;
+    ground_sample *samples = (ground_sample*)malloc(n * sizeof(ground_sample));
+    Prng_xoshiro rng;
+    rng.init(7, 8);
+    // a few hundred units and their wheels spread over a couple of kilometres
+    for(uint64_t i = 0; i < n; i++) {
+        samples[i].pos = dvec3(0.0, 6.371e6, 0.0) + dvec3(rng.uniform() - 0.5, 0.0, rng.uniform() - 0.5) * 2000.0;
+    }
+    bench("ground_query/single", n, [&ground, samples, n]() {
+        for(uint64_t i = 0; i < n; i++) {
+            ground.query(&samples[i], 1, 20);
+        }
+        do_not_optimize(samples[0].altitude);
+    });
+    bench("ground_query/batch", n, [&ground, samples, n]() {
+        ground.query(samples, n, 20);
+        do_not_optimize(samples[0].altitude);
+    });
+    free(samples);
+    ground.destroy();
+}
+
+void bench_terrain_oracle() {
+    terrain_oracle oracle;
+    oracle.init(52, 6.371e6, 1.0, 1024);
+    const uint64_t n = 1024;
+    ground_sample *samples = (ground_sample*)malloc(n * sizeof(ground_sample));
+    Prng_xoshiro rng;
+    rng.init(7, 8);
+    // telemetry from a few hundred units spread over a couple of kilometres
+    for(uint64_t i = 0; i < n; i++) {
+        samples[i].pos = dvec3(0.0, 6.371e6, 0.0) + dvec3(rng.uniform() - 0.5, 0.0, rng.uniform() - 0.5) * 2000.0;
+    }
+    bench("terrain_oracle/sample", n, [&oracle, samples, n]() {
+        for(uint64_t i = 0; i < n; i++) {
+            oracle.sample(&samples[i], 20);
+        }
+        do_not_optimize(samples[0].altitude);
+    });
+    free(samples);
+    oracle.destroy();
+}
+
+void bench_subdivision_noise() {
+    terrain_oracle oracle;
+    oracle.init(52, 6.371e6, 1.0, 64);
+    const uint64_t n = 256;
+    // coarse levels only evaluate the octaves they can resolve
+    for(int level : {4, 12, 20}) {
+        dvec3 verts[3];
+        double elevations[3];
+        double roughnesses[3];
+        oracle.node(0, level, verts, elevations, roughnesses);
+        bench(fstr("subdivision_noise/level_%d", level), n, [&oracle, verts, level, n]() {
+            vec3 new_verts[3];
+            float e[12];
+            float r[12];
+            for(uint64_t i = 0; i < n; i++) {
+                TerrainTree::subdivision_noise(oracle.generator, oracle.radius, level, verts, new_verts, e, r);
+            }
+            do_not_optimize(e[0]);
+        });
+    }
+    oracle.destroy();
+}
+
+// tree placement for a forested node at each level trees are rendered at, per node
+void bench_vegetation_scatter() {
+    const vegetation_scatter &table = vegetation_scatter::table();
+    const uint64_t n = 1024;
+    float density[3] = {0.9f, 0.7f, 0.8f};
+    for(int level : {18, 20}) {
+        float m[3][3];
+        vegetation_scatter::descend(0x15555555555ULL, 18, level, m);
+        bench(fstr("vegetation_scatter/level_%d", level), n, [&table, &m, &density, n]() {
+            uint16_t picked[vegetation_scatter::SIZE];
+            glm::vec3 b[vegetation_scatter::SIZE];
+            int total = 0;
+            for(uint64_t i = 0; i < n; i++) {
+                total += table.place(i * 0x9e3779b97f4a7c15ULL, m, 32, density, picked, b);
+            }
+            do_not_optimize(total);
+        });
+    }
+}
+
+// the terrain thread's half of a mesh upload, colouring the vertices into the upload ring
+void bench_terrain_vertices() {
+    TerrainTree tree(52, 10.0, 6.371e6, 1.0);
+    tree.indexed_mesh = true;
+    terrain_mesh mesh = tree.buildMesh(dvec3(0.0, 6.371e6, 0.0), 3, nil);
+    texvert *verts = (texvert*)malloc(mesh.num_verts * sizeof(texvert));
+    uint32_t *indices = (uint32_t*)malloc(mesh.num_tris * 3 * sizeof(uint32_t));
+    bench("terrain_vertices/prepare", mesh.num_verts, [&mesh, verts, indices]() {
+        do_not_optimize(prepare_terrain_vertices(&mesh, 0, mesh.num_tris, 0, verts, indices));
+    });
+    free(verts);
+    free(indices);
+    mesh.destroy();
+    tree.destroy();
+    delete tree.generator;
+}
+
+void print_json() {
+    std::cout << "{\n";
+#if defined(__clang__)
+    std::cout << "  \"compiler\": \"clang " << __clang_major__ << "." << __clang_minor__ << "\",\n";
+#elif defined(__GNUC__)
+    std::cout << "  \"compiler\": \"gcc " << __GNUC__ << "." << __GNUC_MINOR__ << "\",\n";
+#endif
+#ifdef DEBUG
+    std::cout << "  \"debug\": true,\n";
+#else
+    std::cout << "  \"debug\": false,\n";
+#endif
+    std::cout << "  \"benchmarks\": [\n";
+    for(size_t i = 0; i < results.size(); i++) {
+        bench_result& r = results[i];
+        std::cout << fstr("    {\"name\": \"%s\", \"items\": %llu, \"runs\": %llu, \"best_ns_per_item\": %.4f, "
+                "\"mean_ns_per_item\": %.4f, \"items_per_second\": %.1f}%s\n",
+                r.name, r.items, r.runs, r.best_ns / r.items, r.mean_ns / r.items,
+                r.items / r.best_ns * 1e9, i + 1 < results.size() ? "," : "");
+    }
+    std::cout << "  ]\n}\n";
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1) {
+        bench_filter = argv[1];
+    }
+    bench_vector();
+    bench_frame_arena();
+    bench_mempool();
+    bench_mempool_scaling();
+    bench_slab();
+    bench_tables();
+    bench_hvec3();
+    bench_prng();
+    bench_terrain_lookup();
+    bench_ground_query();
+    bench_terrain_oracle();
+    bench_subdivision_noise();
+    bench_vegetation_scatter();
+    bench_terrain_vertices();
+    print_json();
+    results.destroy();
+    return 0;
+}
@@ -39,9 +39,17 @@ int gpu_transfer_batch_size = 10000; // reduce this if LOD updates cause stutter
 #else
 int gpu_transfer_batch_size = 100000; // reduce this if LOD updates cause stutter even at low LOD
 #endif
+double terrain_budget_ms = 200.0; // time spent refining the terrain per mesh update, the most important detail goes first
+int terrain_budget_batches = 30; // triangles per mesh update in units of gpu_transfer_batch_size
+double terrain_prefetch_ms = 100.0; // time spent per mesh update expanding the terrain where things are heading
+refine_budget terrain_boot_budget = {5.0, 4096, false}; // the first mesh, coarse so the first frame isn't kept waiting
 
 GLFWwindow* window = nil;
 Unit *player_character = nil;
+frame_arena frame_memory; // main thread temporaries, reset at the start of every frame
+std::ofstream memlog; // memory telemetry is appended here every 10 seconds if the memlog option is given
+vegetation_templates tree_templates; // built once at startup, every terrain mesh draws its trees from these
+GLuint tree_templates_vbo;
 
 using std::string;
 
@@ -198,16 +206,23 @@ struct RenderObject {
     GLuint shader;
     GLuint texture;
     GLuint vao, vbo, ebo;
-    void *vbo_mapped;
-    void *ebo_mapped;
+    GLuint vegetation_vao, instance_vbo;
+    uint32_t first_instance[NUM_VEGETATION_TYPES + 1]; // see terrain_mesh
     glm::mat4 prev;
     bool firstTime;
+    uint32_t num_indices;
 
-    RenderObject(PhysicsObject *ppo) { po = ppo; firstTime = true; }
+    RenderObject(PhysicsObject *ppo) {
+        po = ppo; firstTime = true; num_indices = 0;
+        vegetation_vao = 0; instance_vbo = 0;
+        bzero(first_instance, sizeof(first_instance));
+    }
     ~RenderObject() {
         glDeleteBuffers(1, &vbo);
         glDeleteBuffers(1, &ebo);
         glDeleteVertexArrays(1, &vao);
+        glDeleteBuffers(1, &instance_vbo);
+        glDeleteVertexArrays(1, &vegetation_vao);
     }
 
     // uploads a mesh composed of one or more box meshes to the gpu
@@ -266,15 +281,17 @@ struct RenderObject {
         glGenBuffers(1, &ebo);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
         glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+        num_indices = indices.size();
         glBindVertexArray(0);
     }
 
-    void prepare_buffers_chunked(dMesh *mesh) {
+    void prepare_buffers_chunked(terrain_mesh *mesh) {
+        num_indices = mesh->num_tris * 3;
         glGenVertexArrays(1, &vao);
         glBindVertexArray(vao);
         glGenBuffers(1, &vbo);
         glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBufferData(GL_ARRAY_BUFFER, mesh->num_tris * 3 * sizeof(texvert), nil, GL_STATIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, mesh->num_verts * sizeof(texvert), nil, GL_STATIC_DRAW);
         // Position attribute
         glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(texvert), (void*)0);
         glEnableVertexAttribArray(0);
@@ -288,103 +305,187 @@ struct RenderObject {
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
         glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh->num_tris * 3 * sizeof(GLuint), nil, GL_STATIC_DRAW);
         glBindVertexArray(0);
+        upload_vegetation(mesh);
+    }
+
+    // the trees are the template meshes drawn once per instance. the instances are 20 bytes each, small enough to
+    // go up in one piece before the first batch of triangles.
+    void upload_vegetation(terrain_mesh *mesh) {
+        takeoff_memcpy(first_instance, mesh->first_instance, sizeof(first_instance));
+        glGenVertexArrays(1, &vegetation_vao);
+        glBindVertexArray(vegetation_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, tree_templates_vbo);
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(texvert), (void*)0);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(texvert), (void*)(3 * sizeof(GLfloat) + sizeof(GLint)));
+        glEnableVertexAttribArray(1);
+        glGenBuffers(1, &instance_vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+        glBufferData(GL_ARRAY_BUFFER, mesh->num_instances * sizeof(vegetation_instance), mesh->instances, GL_STATIC_DRAW);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(vegetation_instance), (void*)offsetof(vegetation_instance, pos));
+        glVertexAttribPointer(3, 2, GL_SHORT, GL_TRUE, sizeof(vegetation_instance), (void*)offsetof(vegetation_instance, up));
+        glVertexAttribIPointer(4, 4, GL_UNSIGNED_BYTE, sizeof(vegetation_instance), (void*)offsetof(vegetation_instance, type));
+        for(int i = 2; i <= 4; i++) {
+            glEnableVertexAttribArray(i);
+            glVertexAttribDivisor(i, 1);
+        }
+        glBindVertexArray(0);
     }
 
-    void rebind_buffers_chunked(dMesh *mesh) {
+    // the whole mesh at once on this thread. only for the boot mesh, which is small, the updates are prepared by the
+    // terrain thread and go through terrain_upload_ring.
+    void upload_terrain_mesh(terrain_mesh *mesh) {
+        typedef tagged_alloc<TAG_UPLOAD_STAGING, arena_alloc> staging_alloc;
+        nonstd::vector<texvert, staging_alloc> vertices(staging_alloc{{&frame_memory}});
+        vertices.reserve(mesh->num_verts);
+        nonstd::vector<GLuint, staging_alloc> indices(staging_alloc{{&frame_memory}});
+        indices.reserve(mesh->num_tris * 3);
+        uint32_t num_verts = prepare_terrain_vertices(mesh, 0, mesh->num_tris, 0, vertices.data, indices.data);
         glBindVertexArray(vao);
         glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, num_verts * sizeof(texvert), vertices.data);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, mesh->num_tris * 3 * sizeof(GLuint), indices.data);
         glBindVertexArray(0);
+        vertices.destroy();
+        indices.destroy();
     }
+};
 
-    // can prepare the data ahead of time to offload the main thread a little, but it's low priority. this is fast enough.
-    uint32_t upload_terrain_mesh_chunked(dMesh *mesh, uint32_t progress) {
-        auto begin = now();
-        std::vector<texvert> vertices;
-        vertices.reserve(gpu_transfer_batch_size * 3);
-        std::vector<GLuint> indices;
-        indices.reserve(gpu_transfer_batch_size * 3);
-        uint32_t limit = min(mesh->num_tris, progress + gpu_transfer_batch_size);
-        for (uint32_t i = progress; i < limit; ++i) {
-            dTri* t = &mesh->tris[i];
-            indices.insert(indices.end(), {t->verts[0], t->verts[1], t->verts[2]});
-            glm::vec3 floatverts[3] = {
-                glm::vec3(mesh->verts[ t->verts[0] ]),
-                glm::vec3(mesh->verts[ t->verts[1] ]),
-                glm::vec3(mesh->verts[ t->verts[2] ])};
-            glm::vec3 normal = glm::normalize(glm::cross(floatverts[1] - floatverts[0], floatverts[2] - floatverts[0]));
-            float inclination = glm::angle(normal, glm::vec3(t->normal));
-            float insolation = glm::dot(normal, glm::vec3(0.4, 0.4, 0.4));
-            inclination /= PI;
-            insolation += 0.5;
-            for(int j = 0; j < 3; j++){
-                float elevation = t->elevations[j];
-                vec3 fragColor = vec3(0.0f);
-                vec3 grass = vec3(0.0f);
-                vec3 rock = vec3(0.0f);
-                vec3 sand = vec3(0.0f);
-                vec3 color = vec3(0.0f);
-                vec3 foliage = vec3(0.0f);
-                switch(t->type_id){
-                case VERTEX_TYPE_TERRAIN:
-                    grass = mix(vec3(0.15, 0.4, 0.15), vec3(1.0), min(1.0, max(0.0, (elevation - 2000.0) / 1000.0)));
-                    rock = mix(vec3(0.7, 0.5, 0.3), vec3(0.15), min(1.0, max(0.0, elevation / 2000.0)));
-                    color = mix(grass, rock, max(0.0, min(1.0, (-0.5 + 5 * inclination) - max(0.0, (elevation - 3000) / 2000.0) )));
-                    sand = mix(vec3(194/255.0, 178/255.0, 128/255.0), color, min(1.0, max(0.0, (elevation + (20.0 * inclination)) / 10.0)));
-                    if(elevation < 1.0){
-                        color = vec3(0.1, 0.2, 0.3);
-                        fragColor = vec3(color * (3.0 + insolation) * 0.25);
-                    } else if(elevation < 100.0) {
-                        fragColor = vec3(sand * insolation);
-                    } else {
-                        fragColor = vec3(color * insolation);
-                    }
-                    break;
-                case VERTEX_TYPE_FARTERRAIN:
-                    grass = mix(vec3(0.15, 0.4, 0.15), vec3(1.0), min(1.0, max(0.0, (elevation - 2000.0) / 1000.0)));
-                    rock = mix(vec3(0.7, 0.5, 0.3), vec3(0.15), min(1.0, max(0.0, elevation / 2000.0)));
-                    color = mix(grass, rock, max(0.0, min(1.0, (-0.5 + 5 * inclination) - max(0.0, (elevation - 3000) / 2000.0) )));
-                    sand = mix(vec3(194/255.0, 178/255.0, 128/255.0), color, min(1.0, max(0.0, (elevation + (20.0 * inclination)) / 10.0)));
-                    if(elevation < 1.0){
-                        color = vec3(0.1, 0.2, 0.3);
-                        fragColor = vec3(color * (3.0 + insolation) * 0.25);
-                    } else if(elevation < 100.0) {
-                        fragColor = vec3(sand * insolation);
-                    } else {
-                        fragColor = vec3(color * insolation);
-                    }
-                    foliage = mix(vec3(0.15, 0.4, 0.15), vec3(0, 0, 0), 1.0 - inclination);
-                    fragColor = mix(fragColor, foliage, t->foliage_density[j]);
-                    break;
-                case VERTEX_TYPE_TREETRUNK:
-                    fragColor = mix(vec3(0.4, 0.3, 0.2), vec3(0, 0, 0), 1.0 - elevation);
-                    break;
-                case VERTEX_TYPE_LEAF:
-                    fragColor = mix(vec3(0.15, 0.4, 0.15), vec3(0, 0, 0), 1.0 - elevation);
-                    break;
-                }
-                vertices.insert(vertices.end(), {floatverts[j], t->type_id, fragColor});
+// terrain vertices on their way to the gpu. the terrain thread prepares each batch of triangles straight into a slot
+// of a persistently mapped buffer, the main thread copies the finished slots into the new mesh's buffers on the gpu
+// and fences them, and a slot is written again once its fence has passed. so the main thread never touches a vertex,
+// it only issues copies and checks fences. the slots are filled and drained in order.
+struct terrain_upload_ring {
+    enum slot_state {
+        SLOT_FREE, // the terrain thread may fill it
+        SLOT_READY, // filled, waiting for the main thread to copy it
+        SLOT_IN_FLIGHT // the gpu is copying it
+    };
+    static const int SLOTS = 3;
+    struct slot {
+        std::atomic<int> state;
+        GLsync fence;
+        uint32_t first_tri;
+        uint32_t num_tris;
+        uint32_t first_vert;
+        uint32_t num_verts;
+    };
+    GLuint buffer;
+    char *mapped;
+    uint32_t batch_tris;
+    size_t slot_bytes;
+    slot slots[SLOTS];
+    uint32_t fill_seq; // terrain thread
+    uint32_t next_vert; // terrain thread
+    uint32_t drain_seq; // main thread
+
+    size_t indices_offset() { return batch_tris * 3 * sizeof(texvert); }
+
+    // main thread, a slot holds pbatch_tris triangles
+    void init(uint32_t pbatch_tris) {
+        batch_tris = pbatch_tris;
+        slot_bytes = batch_tris * 3 * (sizeof(texvert) + sizeof(GLuint));
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glBufferStorage(GL_COPY_READ_BUFFER, SLOTS * slot_bytes, nil, flags);
+        mapped = (char*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, SLOTS * slot_bytes, flags);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        for(int i = 0; i < SLOTS; i++) {
+            slots[i].state = SLOT_FREE;
+            slots[i].fence = nil;
+        }
+        fill_seq = 0;
+        next_vert = 0;
+        drain_seq = 0;
+    }
+
+    // main thread, after the terrain thread has stopped
+    void destroy() {
+        for(int i = 0; i < SLOTS; i++) {
+            if(slots[i].fence) {
+                glDeleteSync(slots[i].fence);
+            }
+        }
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glUnmapBuffer(GL_COPY_READ_BUFFER);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glDeleteBuffers(1, &buffer);
+    }
+
+    // terrain thread: prepares the batch of mesh starting at triangle progress into the next slot. returns where the
+    // next batch starts, or progress if the slot is still busy.
+    uint32_t fill(terrain_mesh *mesh, uint32_t progress) {
+        if(progress == 0) {
+            next_vert = 0;
+        }
+        int i = fill_seq % SLOTS;
+        slot &s = slots[i];
+        if(s.state.load(std::memory_order_acquire) != SLOT_FREE) {
+            return progress;
+        }
+        s.first_tri = progress;
+        s.num_tris = min(mesh->num_tris - progress, batch_tris);
+        s.first_vert = next_vert;
+        s.num_verts = prepare_terrain_vertices(mesh, s.first_tri, s.num_tris, s.first_vert,
+                (texvert*)(mapped + i * slot_bytes), (uint32_t*)(mapped + i * slot_bytes + indices_offset()));
+        next_vert += s.num_verts;
+        s.state.store(SLOT_READY, std::memory_order_release);
+        fill_seq++;
+        return progress + s.num_tris;
+    }
+
+    // main thread: copies the finished batches into obj's buffers, returns progress plus the triangles copied
+    uint32_t drain(RenderObject *obj, uint32_t progress) {
+        recycle();
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        for(;;) {
+            int i = drain_seq % SLOTS;
+            slot &s = slots[i];
+            if(s.state.load(std::memory_order_acquire) != SLOT_READY) {
+                break;
+            }
+            glBindBuffer(GL_COPY_WRITE_BUFFER, obj->vbo);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, i * slot_bytes,
+                    s.first_vert * sizeof(texvert), s.num_verts * sizeof(texvert));
+            glBindBuffer(GL_COPY_WRITE_BUFFER, obj->ebo);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, i * slot_bytes + indices_offset(),
+                    s.first_tri * 3 * sizeof(GLuint), s.num_tris * 3 * sizeof(GLuint));
+            s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            s.state.store(SLOT_IN_FLIGHT, std::memory_order_relaxed);
+            progress += s.num_tris;
+            drain_seq++;
+        }
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        return progress;
+    }
+
+    // main thread: frees the slots the gpu is done copying, without waiting for the ones it isn't
+    void recycle() {
+        for(int i = 0; i < SLOTS; i++) {
+            if(slots[i].state.load(std::memory_order_relaxed) != SLOT_IN_FLIGHT) {
+                continue;
+            }
+            GLenum result = glClientWaitSync(slots[i].fence, 0, 0);
+            if(result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED) {
+                glDeleteSync(slots[i].fence);
+                slots[i].fence = nil;
+                slots[i].state.store(SLOT_FREE, std::memory_order_release);
             }
         }
-        auto begin_upload = now();
-        glBindVertexArray(vao);
-        glBufferSubData(GL_ARRAY_BUFFER, progress * 3 * sizeof(texvert), vertices.size() * sizeof(texvert), vertices.data());
-        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, progress * 3 * sizeof(GLuint), indices.size() * sizeof(GLuint), indices.data());
-        glBindVertexArray(0);
-        auto end = now();
-//        std::cout << "prepared mesh in: " << std::chrono::duration_cast<std::chrono::microseconds>(begin_upload - begin).count() / 1000.0 << " ms\n";
-//        std::cout << "uploaded mesh in: " << std::chrono::duration_cast<std::chrono::microseconds>(end - begin_upload).count() / 1000.0 << " ms\n";
-        return limit;
     }
 };
 
+terrain_upload_ring terrain_uploads;
+
 void initializeGLFW() {
     if (!glfwInit()) {
         std::cerr << "Failed to initialize GLFW\n";
         exit(EXIT_FAILURE);
     }
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4); // 4.4 for persistently mapped buffers, see terrain_upload_ring
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 }
 
@@ -518,13 +619,11 @@ void render(RenderObject *obj) {
             (float)screenwidth / (float)screenheight, 0.001f, 1e38f);
     glm::mat4 transform = projection * view * translation * rotation;
 
+    glm::mat4 previous = obj->firstTime ? transform : obj->prev;
+
     glUseProgram(obj->shader);
     glUniformMatrix4fv(glGetUniformLocation(obj->shader, "current"), 1, GL_FALSE, &transform[0][0]);
-    if(obj->firstTime) {
-        glUniformMatrix4fv(glGetUniformLocation(obj->shader, "previous"), 1, GL_FALSE, &transform[0][0]);
-    } else {
-        glUniformMatrix4fv(glGetUniformLocation(obj->shader, "previous"), 1, GL_FALSE, &obj->prev[0][0]);
-    }
+    glUniformMatrix4fv(glGetUniformLocation(obj->shader, "previous"), 1, GL_FALSE, &previous[0][0]);
     obj->prev = transform;
     obj->firstTime = false;
 
@@ -542,9 +641,26 @@ void render(RenderObject *obj) {
         std::cout << "Shader Program Validation Failed: " << infoLog << std::endl;
     }
 
-    glDrawElements(GL_TRIANGLES, obj->po->mesh.num_tris * 3, GL_UNSIGNED_INT, 0);
+    glDrawElements(GL_TRIANGLES, obj->num_indices, GL_UNSIGNED_INT, 0);
     glBindVertexArray(0);
 
+    // one instanced draw per tree type, the instances are sorted by type
+    if(obj->first_instance[NUM_VEGETATION_TYPES]) {
+        GLuint vegetation_shader = shaders["vegetation"];
+        glUseProgram(vegetation_shader);
+        glUniformMatrix4fv(glGetUniformLocation(vegetation_shader, "current"), 1, GL_FALSE, &transform[0][0]);
+        glUniformMatrix4fv(glGetUniformLocation(vegetation_shader, "previous"), 1, GL_FALSE, &previous[0][0]);
+        glBindVertexArray(obj->vegetation_vao);
+        for(int i = 0; i < NUM_VEGETATION_TYPES; i++) {
+            uint32_t count = obj->first_instance[i + 1] - obj->first_instance[i];
+            if(count) {
+                glDrawArraysInstancedBaseInstance(GL_TRIANGLES, tree_templates.first[i], tree_templates.count[i], count,
+                        obj->first_instance[i]);
+            }
+        }
+        glBindVertexArray(0);
+    }
+
     checkGLerror();
 }
 
@@ -632,22 +748,30 @@ dvec3 vantage;
 ttnode* zone;
 dvec3 player_global_pos;
 dvec3 delta;
-dMesh mesh_in_waiting;
-dMesh the_old_mesh;
+terrain_mesh mesh_in_waiting;
+terrain_mesh the_old_mesh;
+// the main thread tracks the player (0) and the other units, and the terrain thread prefetches where they're heading
+const int MAX_TRACKED_UNITS = 4;
+const double prefetch_horizons[4] = {1.0, 2.0, 4.0, 8.0}; // seconds ahead
+trajectory_tracker trajectories[MAX_TRACKED_UNITS];
+dvec3 prefetch_targets[MAX_TRACKED_UNITS * 4];
+int num_prefetch_targets = 0;
+ground_query_service ground; // ground contact for physics, independent of the rendered terrain
 TerrainTree terrain_in_waiting;
 TerrainTree the_old_terrain;
 mutex terrain_lock;
 
 void terrain_thread_entry(int seed, double lod) {
-    double current_lod = 1.0;
-    double time_taken = 500000.0;
     uint32_t last_eviction = 0;
 terrain_lock.lock();
     terrain_upload_status = generating;
-    glitch = new Celestial(seed, current_lod, "Glitch", 6.371e6, 0.2, nil); // initial terrain generation must block the main thread
+    // the main thread waits for the first mesh, so it's only as detailed as terrain_boot_budget allows whatever the
+    // lod. the updates below refine it from there like any other mesh.
+    glitch = new Celestial(seed, 1.0, "Glitch", 6.371e6, 0.2, nil, &terrain_boot_budget);
     vantage = dvec3(0, glitch->terrain.radius, 0);
     origo = vantage;
-    mesh_in_waiting = glitch->body.mesh;
+    mesh_in_waiting = glitch->mesh;
+    ground.init(seed, glitch->terrain.radius, glitch->terrain.generator->roughness, 1 << 20);
     terrain_upload_status = done_generating_first_time;
 terrain_lock.unlock();
     while(terrain_upload_status == done_generating_first_time) {
@@ -656,22 +780,14 @@ terrain_lock.unlock();
     while(terrain_upload_status != should_exit) {
         terrain_upload_status = generating;
 
-        dvec3 estimated_vantage = zone->spheroidPosition(player_global_pos, glitch->terrain.radius);
-        double lod_increase = 10000000.0 / (time_taken + 1000000.0);
-        if(POTATO_MODE){
-            lod_increase = 0.5;
-            current_lod = min(current_lod + lod_increase, lod);
-            current_lod = min(current_lod, max(1.0, (current_lod * 100) / (1.0 + glm::length(origo - estimated_vantage))));
-        } else {
-            current_lod = min(current_lod + lod_increase, lod);
-            current_lod = min(current_lod, max(10.0, (current_lod * 1000) / (1.0 + glm::length(origo - estimated_vantage))));
-        }
-        if(verbose) std::cout << "generating terrain mesh with LOD " << current_lod << "\n";
-        auto begin = now();
+        if(verbose) std::cout << "generating terrain mesh with LOD " << lod << "\n";
 
 /////// the real stuff
+        dvec3 targets[MAX_TRACKED_UNITS * 4];
 terrain_lock.lock();
         vantage = zone->spheroidPosition(player_global_pos, glitch->terrain.radius);
+        int num_targets = num_prefetch_targets;
+        takeoff_memcpy(targets, prefetch_targets, num_targets * sizeof(dvec3));
 terrain_lock.unlock();
 
         // this is just a dumb heuristic that should work fine on my computer. a more intelligent way to do this
@@ -684,8 +800,16 @@ terrain_lock.unlock();
             terrain_in_waiting = glitch->terrain.copy();
         }
 
-        terrain_in_waiting.LOD_DISTANCE_SCALE = current_lod;
-        dMesh tmp = terrain_in_waiting.buildMesh(vantage, 3, &terrain_upload_status);
+        terrain_in_waiting.LOD_DISTANCE_SCALE = lod;
+        // the detail is generated ahead of whoever is moving, so it's already there when the mesh catches up with them
+        if(num_targets) {
+            refine_budget prefetch_budget = {terrain_prefetch_ms, 0, false};
+            terrain_in_waiting.prefetch(targets, num_targets, 3, &prefetch_budget, &terrain_upload_status);
+        }
+        // refinement picks up where the last update stopped, so a budget that runs out only delays the detail that
+        // matters least until the next update
+        refine_budget budget = {terrain_budget_ms, (uint64_t)gpu_transfer_batch_size * terrain_budget_batches, false};
+        terrain_mesh tmp = terrain_in_waiting.buildMesh(vantage, 3, &terrain_upload_status, &budget);
 
 terrain_lock.lock();
         mesh_in_waiting = tmp;
@@ -694,25 +818,43 @@ terrain_lock.lock();
             return;
         }
         terrain_upload_status = done_generating;
-        auto end = now();
-        double time_taken = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
 terrain_lock.unlock();
+        // the vertices are prepared here so the main thread only has to copy them into place
+        for(uint32_t progress = 0; progress < tmp.num_tris; ) {
+            if(terrain_upload_status == should_exit){
+                return;
+            }
+            uint32_t next = terrain_uploads.fill(&tmp, progress);
+            if(next == progress) {
+                usleep(1000.0); // every slot is waiting for the main thread or the gpu
+            }
+            progress = next;
+        }
         while(terrain_upload_status != idle) { // wait for main thread to finish shoveling
             if(terrain_upload_status == should_exit){
                 return;
             }
             usleep(1000.0);
         }
-        if(current_lod >= lod) {
+        // a budget that ran out without adding a node can't get any further from here, another update would only
+        // rebuild and upload the same mesh. it waits for the player to move like a finished one.
+        if( ! budget.exhausted || ! budget.new_nodes) {
+            dvec3 estimated_vantage;
+            dvec3 predicted_vantage;
             do{
+                // the main thread updates the trajectories under the lock
+terrain_lock.lock();
                 estimated_vantage = zone->spheroidPosition(player_global_pos, glitch->terrain.radius);
+                predicted_vantage = trajectories[0].samples ?
+                    zone->spheroidPosition(trajectories[0].predict(prefetch_horizons[0]), glitch->terrain.radius) : estimated_vantage;
+terrain_lock.unlock();
                 for(double i = 0.0; i < 0.1; i += 0.01) {
                     if(terrain_upload_status == should_exit){
                         return;
                     }
                     usleep(10000.0);
                 }
-            } while(glm::length(origo - estimated_vantage) < 20.0);
+            } while(glm::length(origo - estimated_vantage) < 20.0 && glm::length(origo - predicted_vantage) < 20.0);
             if(verbose) std::cout << "origo: " << str(origo) << " estimated vantage: " << str(estimated_vantage) << " estimated delta: " << str(origo - estimated_vantage) << "\n";
         }
     }
@@ -747,6 +889,11 @@ int main(int argc, char** argv) {
             mouse_capture = false;
             std::cout << "not capturing mouse\n";
         }
+        if(!strncmp(argv[i], "memlog=", min(7, strlen(argv[i])))){
+            memlog.open(argv[i] + 7, std::ios::app);
+            assert(memlog.is_open());
+            std::cout << "logging memory telemetry to " << argv[i] + 7 << "\n";
+        }
         if(!strncmp(argv[i], "seed=", min(5, strlen(argv[i])))){
             seed = atol(argv[i] + 5);
         }
@@ -758,6 +905,10 @@ int main(int argc, char** argv) {
             gpu_transfer_batch_size = atol(argv[i] + 3);
             assert(gpu_transfer_batch_size >= 1000);
         }
+        if(!strncmp(argv[i], "tms=", min(4, strlen(argv[i])))){
+            terrain_budget_ms = (double)atol(argv[i] + 4);
+            assert(terrain_budget_ms > 0);
+        }
         if(!strncmp(argv[i], "aa=", min(3, strlen(argv[i])))){
             antialiasing = atol(argv[i] + 3);
             assert(antialiasing >= 1 && antialiasing <= 8);
@@ -779,7 +930,7 @@ int main(int argc, char** argv) {
     }
     if(argc < 2 || verbose){
         std::cout << "\n\n";
-        std::cout << "Usage: " << argv[0] << " [-v] [--potato] [--lowmem] [--nocapture] [seed=n] [lod=n] [bs=n] [aa=n] [af=n] [blur=n] [blurmode=n]\n";
+        std::cout << "Usage: " << argv[0] << " [-v] [--potato] [--lowmem] [--nocapture] [seed=n] [lod=n] [bs=n] [aa=n] [af=n] [blur=n] [blurmode=n] [memlog=file] [tms=n]\n";
         std::cout << "-v: print debug information to console.\n";
         std::cout << "--potato: compatibility mode for single-core CPUs and debugging with valgrind.\n";
         std::cout << "--lowmem: conserve RAM by caching less of the procedurally generated content.\n";
@@ -790,6 +941,7 @@ int main(int argc, char** argv) {
         std::cout << "aa: antialiasing. 1 to 8. Number of samples per pixel is the square of this number so 2 is 4x, 4 is 16x.\n";
         std::cout << "af: anisotropic filtering. 0, to 16.\n";
         std::cout << "blur: the amount of motion blur. 0 to 50.\n";
+        std::cout << "memlog: append memory use per subsystem to this file every 10 seconds.\n";
         std::cout << "\nexamples:\nlow: ./takeoff aa=1 af=0 blur=0 bs=10000 lod=10\n";
         std::cout << "default: ./takeoff aa=2 af=16 blur=3 lod=20\n";
         std::cout << "high: ./takeoff aa=2 af=16 blur=2 lod=50\n";
@@ -797,6 +949,7 @@ int main(int argc, char** argv) {
         std::cout << "ultra: ./takeoff aa=4 af=16 blur=2 lod=100\n\n";
         if(!verbose) std::cout << "No options have been specified. Using default settings.\n\n";
     }
+    frame_memory.init(16 << 20);
     initializeGLFW();
     window = createWindow(screenwidth, screenheight, "Takeoff Sendario");
     glfwSwapInterval(0); // disabling vsync can reveal performance issues earlier
@@ -846,6 +999,14 @@ int main(int argc, char** argv) {
     checkGLerror();
     shaders["box"] = mkShader("box");
     shaders["terrain"] = mkShader("terrain");
+    shaders["vegetation"] = mkShader("vegetation");
+    checkGLerror();
+    tree_templates.init();
+    glGenBuffers(1, &tree_templates_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, tree_templates_vbo);
+    glBufferData(GL_ARRAY_BUFFER, tree_templates.verts.count * sizeof(texvert), tree_templates.verts.data, GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    terrain_uploads.init(gpu_transfer_batch_size);
     checkGLerror();
     textures["isqswjwki55a1.png"] = loadTexture("textures/isqswjwki55a1.png", true);
     textures["green_transparent_wireframe_box_64x64.png"] = loadTexture("textures/green_transparent_wireframe_box_64x64.png", false);
@@ -886,13 +1047,14 @@ int main(int argc, char** argv) {
     uint32_t terrain_upload_progress = 0;
     // Main loop
     while (!glfwWindowShouldClose(window)) {
+        frame_memory.reset();
 terrain_lock.lock(); // grab mutex
         if(terrain_upload_status == done_generating_first_time) {
             terrain0 = new RenderObject(&glitch->body);
             terrain0->shader = shaders["terrain"];
             terrain0->texture = textures["isqswjwki55a1.png"];
-            terrain0->prepare_buffers_chunked(&glitch->body.mesh);
-            terrain0->upload_terrain_mesh_chunked(&glitch->body.mesh, 0);
+            terrain0->prepare_buffers_chunked(&glitch->mesh);
+            terrain0->upload_terrain_mesh(&glitch->mesh);
             glitch->body.ro = terrain0;
             player_character->body.zone = 0x2aaaaaaaa8;
             units[1].body.zone = 0x2aaaaaaaa8;
@@ -906,16 +1068,14 @@ terrain_lock.lock(); // grab mutex
             terrain_upload_status = idle;
         }
         if(terrain_upload_status == done_generating) {
-            if(terrain_upload_progress == 0){
+            if( ! terrain1){
                 terrain1 = new RenderObject(&glitch->body);
                 terrain1->shader = shaders["terrain"];
                 terrain1->texture = textures["isqswjwki55a1.png"];
                 terrain1->prepare_buffers_chunked(&mesh_in_waiting);
             }
-            else {
-                terrain1->rebind_buffers_chunked(&mesh_in_waiting);
-            }
-            terrain_upload_progress = terrain1->upload_terrain_mesh_chunked(&mesh_in_waiting, terrain_upload_progress);
+            // the terrain thread is preparing the vertices, whatever it has finished is copied on the gpu
+            terrain_upload_progress = terrain_uploads.drain(terrain1, terrain_upload_progress);
             if(terrain_upload_progress == mesh_in_waiting.num_tris){
                 terrain_upload_status = done_uploading;
                 terrain_upload_progress = 0;
@@ -924,10 +1084,11 @@ terrain_lock.lock(); // grab mutex
         if(terrain_upload_status == done_uploading) {
             delete terrain0;
             terrain0 = terrain1;
+            terrain1 = nil;
             glitch->body.ro = terrain0;
             the_old_mesh.destroy();
-            the_old_mesh = glitch->body.mesh;
-            glitch->body.mesh = mesh_in_waiting;
+            the_old_mesh = glitch->mesh;
+            glitch->mesh = mesh_in_waiting;
             the_old_terrain.destroy();
             the_old_terrain = glitch->terrain;
             glitch->terrain = terrain_in_waiting;
@@ -964,12 +1125,27 @@ terrain_lock.unlock(); // release mutex
             player_character->body.rot = glm::conjugate(camera_rot * glm::angleAxis(glm::radians(0.0f), glm::vec3(0.0, 1.0, 0.0)));
             player_character->body.pos += player_character->body.rot * input_vector(window) * dt * 10.0;
             player_global_pos = origo + player_character->body.pos;
-            ttnode* tile = glitch->terrain[player_global_pos];
-            double altitude = tile->player_altitude(player_character->body.pos, &glitch->body.mesh, local_gravity_normalized);
-            player_character->body.pos += altitude * local_gravity_normalized;
+            ground_sample contact;
+            contact.pos = player_global_pos;
+            ground.query(&contact, 1, glitch->terrain.MAX_LOD);
+            player_character->body.pos += contact.altitude * local_gravity_normalized;
             player_global_pos = origo + player_character->body.pos;
             // optimization: compute view matrix here instead of in render()
             camera_target = vec3(player_character->body.pos);
+
+            double seconds = std::chrono::duration_cast<std::chrono::microseconds>(now() - start_time).count() / 1000000.0;
+terrain_lock.lock();
+            num_prefetch_targets = 0;
+            for(int i = 0; i < min(units.size(), (size_t)MAX_TRACKED_UNITS); i++) {
+                trajectories[i].update(origo + units[i].body.pos, seconds);
+                if(glm::length(trajectories[i].vel) < 1.0) {
+                    continue; // standing still or close enough, the next update is centered on it anyway
+                }
+                for(int j = 0; j < 4; j++) {
+                    prefetch_targets[num_prefetch_targets++] = trajectories[i].predict(prefetch_horizons[j]);
+                }
+            }
+terrain_lock.unlock();
         }
         if(game_paused && !camera_dirty){
             usleep(8000.0);
@@ -983,10 +1159,10 @@ terrain_lock.unlock(); // release mutex
 
         render(terrain0);
 
-		nonstd::vector<ctleaf> l;
+		nonstd::arena_vector<ctleaf> l(arena_alloc{&frame_memory});
         l.emplace_back(ctleaf(&player_character->body));
         l.emplace_back(ctleaf(&units[1].body));
-        CollisionTree t = CollisionTree(dvec3(0.0), l.data, l.count);
+        CollisionTree t = CollisionTree(dvec3(0.0), l.data, l.count, &frame_memory);
 
         checkGLerror();
 
@@ -1071,6 +1247,14 @@ terrain_lock.unlock(); // release mutex
                     std::cout << " " << framerate_handicap * (1000000.0 / frameDuration) << " theoretically";
                 }
                 if(verbose) std::cout << "\n";
+                static telemetry_snapshot verbose_snapshot;
+                if(verbose) dump_memory_telemetry(std::cout, &verbose_snapshot);
+            }
+            static telemetry_snapshot memlog_snapshot;
+            if(memlog.is_open() && std::chrono::duration_cast<std::chrono::seconds>(now() - memlog_snapshot.time).count() >= 10) {
+                memlog << std::chrono::duration_cast<std::chrono::seconds>(now() - start_time).count() << " s\n";
+                dump_memory_telemetry(memlog, &memlog_snapshot);
+                memlog.flush();
             }
             // limit the game to 120 fps if the system/libraries don't limit it for us
             if(frameDuration < 1000000.0 / 120.0 && !
@@ -1082,15 +1266,20 @@ terrain_lock.unlock(); // release mutex
         }
     } // end of main loop
     terrain_upload_status = should_exit;
+    terrain_thread.join(); // before the upload ring it may be writing to is unmapped
     glDeleteFramebuffers(1, &framebuffer);
     glDeleteTextures(1, &colorTex);
     glDeleteTextures(1, &velocityTex);
+    glDeleteBuffers(1, &tree_templates_vbo);
+    terrain_uploads.destroy();
     glfwTerminate();
-    terrain_thread.join();
+    frame_memory.destroy();
+    ground.destroy();
 
     delete the_old_terrain.generator;
     delete terrain0;
     delete glitch;
+    tree_templates.destroy();
     for(int i = 0; i < ros.size(); i++) {
         ros[i].po->mesh.destroy();
     }
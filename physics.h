@@ -1,17 +1,20 @@
 #include "terragen.h"
 
 #include <algorithm>
+#include <atomic>
 #include <boost/align/aligned_allocator.hpp>
 #include <chrono>
 #include <deque>
 #include <iostream>
 #include <mutex>
+#include <shared_mutex>
 #include <vector>
 
 #include <cassert>
 #include <cstdarg>
 #include <cstdint>
 #include <cstring>
+#include <sys/mman.h>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
@@ -96,21 +99,105 @@ double max(double a, double b) {
 }
 
 
+// Memory telemetry. Allocations that go through a tagged path are counted against their subsystem so we can see
+// where the bytes go, set budgets and spot leaks. dump_memory_telemetry() prints live and peak bytes per tag and the
+// allocation rate since the previous dump.
+enum alloc_tag {
+    TAG_UNTAGGED,
+    TAG_TERRAIN_NODES,
+    TAG_VEGETATION,
+    TAG_MESHES,
+    TAG_COLLISION,
+    TAG_PHYSICS,
+    TAG_UPLOAD_STAGING,
+    TAG_COUNT
+};
+
+const char *alloc_tag_names[TAG_COUNT] = {
+    "untagged",
+    "terrain nodes",
+    "vegetation",
+    "meshes",
+    "collision",
+    "physics",
+    "upload staging"
+};
+
+struct alloc_tag_stats {
+    std::atomic<int64_t> live;
+    std::atomic<int64_t> peak;
+    std::atomic<uint64_t> allocs;
+    std::atomic<uint64_t> frees;
+    std::atomic<uint64_t> bytes_allocated; // total over the whole run, for the rate
+};
+
+alloc_tag_stats memory_telemetry[TAG_COUNT];
+
+void telemetry_alloc(alloc_tag tag, size_t bytes) {
+    alloc_tag_stats& t = memory_telemetry[tag];
+    t.allocs.fetch_add(1, std::memory_order_relaxed);
+    t.bytes_allocated.fetch_add(bytes, std::memory_order_relaxed);
+    int64_t live = t.live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    int64_t peak = t.peak.load(std::memory_order_relaxed);
+    while(live > peak && ! t.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed));
+}
+
+void telemetry_free(alloc_tag tag, size_t bytes) {
+    alloc_tag_stats& t = memory_telemetry[tag];
+    t.frees.fetch_add(1, std::memory_order_relaxed);
+    t.live.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+// a resize counts as one allocation of the new size and one free of the old
+void telemetry_realloc(alloc_tag tag, size_t old_bytes, size_t new_bytes) {
+    if(old_bytes) {
+        telemetry_free(tag, old_bytes);
+    }
+    if(new_bytes) {
+        telemetry_alloc(tag, new_bytes);
+    }
+}
+
+// allocation policy for nonstd::vector. other policies (see slab_alloc, arena_alloc) get the old size back so they
+// don't need to store it in front of the block.
+struct heap_alloc {
+    static void* realloc(void *ptr, size_t old_bytes, size_t new_bytes) { return ::realloc(ptr, new_bytes); }
+    static void free(void *ptr, size_t bytes) { ::free(ptr); }
+};
+
+// wraps another policy and counts everything against a telemetry tag
+template <alloc_tag tag, typename A = heap_alloc> struct tagged_alloc : A {
+    void* realloc(void *ptr, size_t old_bytes, size_t new_bytes) {
+        telemetry_realloc(tag, ptr ? old_bytes : 0, new_bytes);
+        return A::realloc(ptr, old_bytes, new_bytes);
+    }
+    void free(void *ptr, size_t bytes) {
+        if(ptr) {
+            telemetry_free(tag, bytes);
+        }
+        A::free(ptr, bytes);
+    }
+};
+
 namespace nonstd {
 
-template <typename T> struct vector {
+template <typename T, typename A = heap_alloc> struct vector {
     T* data;
     size_t count;
     size_t capacity;
+    [[no_unique_address]] A alloc; // takes no space unless the policy has state
 
-    vector() { bzero(this, sizeof(vector<T>)); }
+    vector() { bzero(this, sizeof(vector<T, A>)); }
+    explicit vector(A palloc) { bzero(this, sizeof(vector<T, A>)); alloc = palloc; }
 
     void destroy() {
         for(size_t i = 0; i < count; ++i){
             data[i].~T();
         }
-        free(data);
-        bzero(this, sizeof(vector<T>));
+        alloc.free(data, sizeof(T) * capacity);
+        A palloc = alloc;
+        bzero(this, sizeof(vector<T, A>));
+        alloc = palloc;
     }
 
     void wipe() {
@@ -120,9 +207,9 @@ template <typename T> struct vector {
         bzero(data, capacity * sizeof(T));
     }
 
-    vector<T> copy() {
-        vector<T> tmp;
-        tmp.data = (T*)malloc(sizeof(T) * count);
+    vector<T, A> copy() {
+        vector<T, A> tmp(alloc);
+        tmp.data = (T*)alloc.realloc(nil, 0, sizeof(T) * count);
         takeoff_memcpy(tmp.data, data, sizeof(T) * count);
         tmp.count = count;
         tmp.capacity = count;
@@ -133,7 +220,7 @@ template <typename T> struct vector {
 
     void reserve(size_t new_capacity) {
         assert(new_capacity >= count);
-        data = (T*)realloc(data, sizeof(T) * new_capacity);
+        data = (T*)alloc.realloc(data, sizeof(T) * capacity, sizeof(T) * new_capacity);
         capacity = new_capacity;
     }
 
@@ -184,6 +271,35 @@ std::string str(dvec3 in) {
     return fstr("(%f, %f, %f)", in.x, in.y, in.z);
 }
 
+// where the previous dump left off, so each log can compute its own rates
+struct telemetry_snapshot {
+    std::chrono::high_resolution_clock::time_point time = now();
+    uint64_t allocs[TAG_COUNT] = {};
+    uint64_t bytes[TAG_COUNT] = {};
+};
+
+// prints one line per tag that has seen any traffic. rates are per second since the snapshot, which is then updated.
+void dump_memory_telemetry(std::ostream& out, telemetry_snapshot *since) {
+    auto this_dump = now();
+    double seconds = std::chrono::duration_cast<std::chrono::microseconds>(this_dump - since->time).count() * 1e-6;
+    seconds = max(seconds, 1e-6);
+    out << "memory telemetry: live MB, peak MB, allocs/s, MB/s allocated, allocs - frees\n";
+    for(int i = 0; i < TAG_COUNT; i++) {
+        alloc_tag_stats& t = memory_telemetry[i];
+        uint64_t allocs = t.allocs.load(std::memory_order_relaxed);
+        uint64_t bytes = t.bytes_allocated.load(std::memory_order_relaxed);
+        if(allocs) {
+            out << fstr("  %-16s %10.3f %10.3f %12.1f %10.3f %10lld\n", alloc_tag_names[i],
+                    t.live.load(std::memory_order_relaxed) / 1048576.0, t.peak.load(std::memory_order_relaxed) / 1048576.0,
+                    (allocs - since->allocs[i]) / seconds, (bytes - since->bytes[i]) / 1048576.0 / seconds,
+                    (long long)(allocs - t.frees.load(std::memory_order_relaxed)));
+        }
+        since->allocs[i] = allocs;
+        since->bytes[i] = bytes;
+    }
+    since->time = this_dump;
+}
+
 
 // right now (2024) Intel and AMD cpus have 64 byte cache lines and Apple's M series have 128 bytes.
 // Apple can suck a dick because opengl is deprecated on macos and their ios app store policies are anticompetitive.
@@ -195,6 +311,7 @@ struct mempool {
     nonstd::vector<cacheline*> data;
     nonstd::vector<cacheline*> recycler;
     uint64_t data_idx;
+    alloc_tag tag;
 
     ~mempool() { data.destroy(); recycler.destroy(); }
     cacheline* alloc();
@@ -202,6 +319,7 @@ struct mempool {
 };
 
 cacheline* mempool::alloc() {
+    telemetry_alloc(tag, sizeof(cacheline));
     if(recycler.size() > 0) {
         return recycler.pop_back();
     } else {
@@ -210,7 +328,7 @@ cacheline* mempool::alloc() {
             uint64_t misalignment = (uint64_t)data.back() % sizeof(cacheline);
             if(misalignment != 0){
                 if(verbose) std::cout << "pool allocator adjusted misaligned memory: off by " << misalignment <<" bytes\n";
-                data[data.size()-1] -= misalignment;
+                data[data.size()-1] = (cacheline*)((uint8_t*)data.back() - misalignment);
                 ++data_idx;
             } else {
                 if(verbose) std::cout << "pool allocator got memory that was already aligned, nothing to adjust\n";
@@ -223,9 +341,488 @@ cacheline* mempool::alloc() {
 }
 
 void mempool::free(cacheline *line) {
+    telemetry_free(tag, sizeof(cacheline));
     recycler.push_back(line);
 }
 
+// Thread-safe variant of mempool. Every thread gets its own stash of free cache lines per pool so alloc and free
+// are lock free in the common case. When a thread's stash runs dry it grabs MEMPOOL_CACHE_BATCH lines from the
+// shared pool in one go, and when it fills up (a thread that frees more than it allocates, e.g. a thread that
+// destroys objects spawned elsewhere) it hands MEMPOOL_CACHE_BATCH lines back, so the shared pool's lock is taken
+// at most once every MEMPOOL_CACHE_BATCH operations.
+// A pool must outlive every thread that has used it, or destroy() must be called while those threads are idle.
+// destroy() ends the pool, its id goes to the next pool created along with the thread caches it left behind, so
+// short lived pools cost the threads no more than the most pools that were ever alive at once.
+// Telemetry is counted per batch, so a tag's live bytes include the lines sitting in thread stashes.
+#define MEMPOOL_CACHE_BATCH 64
+#define MEMPOOL_CACHE_MAX (4 * MEMPOOL_CACHE_BATCH)
+#define MEMPOOL_CHUNK_LINES 4096
+
+struct concurrent_mempool;
+
+struct mempool_cache {
+    concurrent_mempool *pool;
+    uint32_t count;
+    cacheline *lines[MEMPOOL_CACHE_MAX];
+};
+
+// one per thread, indexed by concurrent_mempool::id. returns everything to the pools when the thread exits.
+struct mempool_thread_caches {
+    nonstd::vector<mempool_cache*> caches;
+    ~mempool_thread_caches();
+};
+
+thread_local mempool_thread_caches mempool_tls;
+
+#define MEMPOOL_NO_ID UINT32_MAX
+mutex mempool_ids_lock;
+uint32_t mempool_next_id = 0;
+nonstd::vector<uint32_t> mempool_free_ids; // of destroyed pools
+
+uint32_t mempool_acquire_id() {
+    std::lock_guard<mutex> guard(mempool_ids_lock);
+    return mempool_free_ids.size() ? mempool_free_ids.pop_back() : mempool_next_id++;
+}
+
+void mempool_release_id(uint32_t id) {
+    std::lock_guard<mutex> guard(mempool_ids_lock);
+    mempool_free_ids.push_back(id);
+}
+
+struct concurrent_mempool {
+    mutex lock;
+    nonstd::vector<cacheline*> chunks;
+    nonstd::vector<cacheline*> recycler;
+    nonstd::vector<mempool_cache*> caches; // every thread cache that belongs to this pool
+    uint64_t chunk_idx;
+    uint32_t id;
+    alloc_tag tag;
+
+    concurrent_mempool(alloc_tag ptag = TAG_UNTAGGED) { chunk_idx = 0; id = mempool_acquire_id(); tag = ptag; }
+    ~concurrent_mempool() { destroy(); }
+    cacheline* alloc();
+    void free(cacheline *line);
+    mempool_cache* cache();
+    void refill(mempool_cache *c);
+    void drain(mempool_cache *c, uint32_t n);
+    void destroy();
+};
+
+mempool_cache* concurrent_mempool::cache() {
+    assert(id != MEMPOOL_NO_ID); // used after destroy()
+    nonstd::vector<mempool_cache*>& tls = mempool_tls.caches;
+    if(id < tls.size() && tls[id] && tls[id]->pool) {
+        return tls[id];
+    }
+    while(tls.size() <= id) {
+        tls.push_back(nil);
+    }
+    // a cache without a pool was detached by destroy() and can be taken into use again
+    mempool_cache *c = tls[id] ? tls[id] : (mempool_cache*)calloc(1, sizeof(mempool_cache));
+    c->pool = this;
+    tls[id] = c;
+    std::lock_guard<mutex> guard(lock);
+    caches.push_back(c);
+    return c;
+}
+
+// must hold the lock
+void concurrent_mempool::refill(mempool_cache *c) {
+    telemetry_alloc(tag, (MEMPOOL_CACHE_BATCH - c->count) * sizeof(cacheline));
+    uint32_t n = min((uint32_t)recycler.size(), (uint32_t)MEMPOOL_CACHE_BATCH);
+    recycler.count -= n;
+    takeoff_memcpy(&c->lines[c->count], &recycler.data[recycler.count], n * sizeof(cacheline*));
+    c->count += n;
+    while(c->count < MEMPOOL_CACHE_BATCH) {
+        if( ! chunk_idx) {
+            chunks.push_back((cacheline*)aligned_alloc(sizeof(cacheline), MEMPOOL_CHUNK_LINES * sizeof(cacheline)));
+        }
+        c->lines[c->count++] = &chunks.back()[chunk_idx];
+        chunk_idx = (chunk_idx + 1) % MEMPOOL_CHUNK_LINES;
+    }
+}
+
+// must hold the lock
+void concurrent_mempool::drain(mempool_cache *c, uint32_t n) {
+    assert(n <= c->count);
+    telemetry_free(tag, n * sizeof(cacheline));
+    if(recycler.count + n > recycler.capacity) {
+        recycler.reserve(max(recycler.capacity * 2, recycler.count + n));
+    }
+    c->count -= n;
+    takeoff_memcpy(&recycler.data[recycler.count], &c->lines[c->count], n * sizeof(cacheline*));
+    recycler.count += n;
+}
+
+cacheline* concurrent_mempool::alloc() {
+    mempool_cache *c = cache();
+    if( ! c->count) {
+        std::lock_guard<mutex> guard(lock);
+        refill(c);
+    }
+    return c->lines[--c->count];
+}
+
+void concurrent_mempool::free(cacheline *line) {
+    mempool_cache *c = cache();
+    if(c->count == MEMPOOL_CACHE_MAX) {
+        std::lock_guard<mutex> guard(lock);
+        drain(c, MEMPOOL_CACHE_BATCH);
+    }
+    c->lines[c->count++] = line;
+}
+
+void concurrent_mempool::destroy() {
+    std::lock_guard<mutex> guard(lock);
+    if(id == MEMPOOL_NO_ID) {
+        return;
+    }
+    for(size_t i = 0; i < caches.size(); i++) {
+        caches[i]->pool = nil;
+        caches[i]->count = 0;
+    }
+    for(size_t i = 0; i < chunks.size(); i++) {
+        ::free(chunks[i]);
+    }
+    caches.destroy();
+    chunks.destroy();
+    recycler.destroy();
+    chunk_idx = 0;
+    mempool_release_id(id);
+    id = MEMPOOL_NO_ID;
+}
+
+mempool_thread_caches::~mempool_thread_caches() {
+    for(size_t i = 0; i < caches.size(); i++) {
+        mempool_cache *c = caches[i];
+        if( ! c) {
+            continue;
+        }
+        concurrent_mempool *pool = c->pool;
+        if(pool) {
+            std::lock_guard<mutex> guard(pool->lock);
+            pool->drain(c, c->count);
+            for(size_t j = 0; j < pool->caches.size(); j++) {
+                if(pool->caches[j] == c) {
+                    pool->caches[j] = pool->caches.back();
+                    pool->caches.count--;
+                    break;
+                }
+            }
+        }
+        ::free(c);
+    }
+    caches.destroy();
+}
+
+// Size-class slab allocator for the small and medium allocations that used to go straight to malloc: mesh buffers,
+// vegetation and unit parts. Blocks are powers of two from 16 bytes to 64 KiB carved out of 2 MiB slabs, and freed
+// blocks go on a free list per size class. Bigger requests fall through to malloc.
+// Like mempool, nothing is stored in front of a block, so the caller has to pass the size back when freeing.
+#define SLAB_MIN_SHIFT 4
+#define SLAB_MAX_SHIFT 16
+#define SLAB_NUM_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_BYTES (2 << 20)
+
+struct slab_stats {
+    uint64_t block_size;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t live; // blocks
+    uint64_t peak; // blocks
+    uint64_t slabs;
+};
+
+struct slab_class {
+    mutex lock;
+    void *free_list; // linked through the first 8 bytes of each free block
+    uint8_t *bump;
+    uint8_t *bump_end;
+    slab_stats stats;
+};
+
+struct slab_allocator {
+    slab_class classes[SLAB_NUM_CLASSES];
+    mutex slab_lock;
+    nonstd::vector<void*> slabs;
+    nonstd::vector<void*> mapped_slabs; // huge page slabs that came from mmap
+    std::atomic<uint64_t> large_allocs;
+    std::atomic<uint64_t> large_frees;
+    bool huge_pages; // set before the first allocation to back the slabs with 2 MiB pages
+
+    slab_allocator();
+    static int size_class(size_t bytes);
+    void* new_slab();
+    void* alloc_bytes(size_t bytes);
+    void free_bytes(void *ptr, size_t bytes);
+    void* realloc_bytes(void *ptr, size_t old_bytes, size_t new_bytes);
+    slab_stats stats(int cls);
+    void print_stats(std::ostream& out);
+    void destroy();
+
+    template <typename T> T* alloc(size_t n = 1) { return (T*)alloc_bytes(n * sizeof(T)); }
+    template <typename T> void free(T *ptr, size_t n = 1) { free_bytes(ptr, n * sizeof(T)); }
+    template <typename T> T* realloc(T *ptr, size_t old_n, size_t new_n) {
+        return (T*)realloc_bytes(ptr, old_n * sizeof(T), new_n * sizeof(T));
+    }
+};
+
+slab_allocator::slab_allocator() {
+    for(int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        classes[i].free_list = nil;
+        classes[i].bump = nil;
+        classes[i].bump_end = nil;
+        bzero(&classes[i].stats, sizeof(slab_stats));
+        classes[i].stats.block_size = 1ULL << (i + SLAB_MIN_SHIFT);
+    }
+    large_allocs = 0;
+    large_frees = 0;
+    huge_pages = false;
+}
+
+// -1 for sizes that go to malloc
+int slab_allocator::size_class(size_t bytes) {
+    if(bytes > (1ULL << SLAB_MAX_SHIFT)) {
+        return -1;
+    }
+    if(bytes <= (1ULL << SLAB_MIN_SHIFT)) {
+        return 0;
+    }
+    return 64 - __builtin_clzll(bytes - 1) - SLAB_MIN_SHIFT;
+}
+
+void* slab_allocator::new_slab() {
+    std::lock_guard<mutex> guard(slab_lock);
+    void *mem = nil;
+    if(huge_pages) {
+        mem = mmap(nil, SLAB_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(mem == MAP_FAILED) {
+            // no reserved huge pages, ask for transparent huge pages instead
+            mem = nil;
+        } else {
+            mapped_slabs.push_back(mem);
+            return mem;
+        }
+    }
+    mem = aligned_alloc(SLAB_BYTES, SLAB_BYTES);
+    assert(mem);
+    if(huge_pages) {
+        madvise(mem, SLAB_BYTES, MADV_HUGEPAGE);
+    }
+    slabs.push_back(mem);
+    return mem;
+}
+
+void* slab_allocator::alloc_bytes(size_t bytes) {
+    int cls = size_class(bytes);
+    if(cls < 0) {
+        large_allocs++;
+        return malloc(bytes);
+    }
+    slab_class& c = classes[cls];
+    std::lock_guard<mutex> guard(c.lock);
+    void *rax;
+    if(c.free_list) {
+        rax = c.free_list;
+        c.free_list = *(void**)rax;
+    } else {
+        if(c.bump == c.bump_end) {
+            c.bump = (uint8_t*)new_slab();
+            c.bump_end = c.bump + SLAB_BYTES;
+            c.stats.slabs++;
+        }
+        rax = c.bump;
+        c.bump += c.stats.block_size;
+    }
+    c.stats.allocs++;
+    c.stats.live++;
+    c.stats.peak = max(c.stats.peak, c.stats.live);
+    return rax;
+}
+
+void slab_allocator::free_bytes(void *ptr, size_t bytes) {
+    if( ! ptr) {
+        return;
+    }
+    int cls = size_class(bytes);
+    if(cls < 0) {
+        large_frees++;
+        ::free(ptr);
+        return;
+    }
+    slab_class& c = classes[cls];
+    std::lock_guard<mutex> guard(c.lock);
+    *(void**)ptr = c.free_list;
+    c.free_list = ptr;
+    c.stats.frees++;
+    c.stats.live--;
+}
+
+void* slab_allocator::realloc_bytes(void *ptr, size_t old_bytes, size_t new_bytes) {
+    if( ! ptr) {
+        return alloc_bytes(new_bytes);
+    }
+    int old_cls = size_class(old_bytes);
+    int new_cls = size_class(new_bytes);
+    if(old_cls == new_cls && old_cls >= 0) {
+        return ptr;
+    }
+    if(old_cls < 0 && new_cls < 0) {
+        return ::realloc(ptr, new_bytes);
+    }
+    void *rax = alloc_bytes(new_bytes);
+    takeoff_memcpy(rax, ptr, min(old_bytes, new_bytes));
+    free_bytes(ptr, old_bytes);
+    return rax;
+}
+
+slab_stats slab_allocator::stats(int cls) {
+    std::lock_guard<mutex> guard(classes[cls].lock);
+    return classes[cls].stats;
+}
+
+void slab_allocator::print_stats(std::ostream& out) {
+    out << "slab allocator: " << slabs.size() + mapped_slabs.size() << " slabs (" << mapped_slabs.size() << " huge page mapped)\n";
+    for(int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        slab_stats s = stats(i);
+        if( ! s.allocs) {
+            continue;
+        }
+        out << fstr("  %6llu B: %10llu allocs %10llu frees %8llu live %8llu peak %4llu slabs\n",
+                s.block_size, s.allocs, s.frees, s.live, s.peak, s.slabs);
+    }
+    out << fstr("  large: %10llu allocs %10llu frees\n", large_allocs.load(), large_frees.load());
+}
+
+// every block handed out by this allocator becomes invalid
+void slab_allocator::destroy() {
+    for(int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        std::lock_guard<mutex> guard(classes[i].lock);
+        classes[i].free_list = nil;
+        classes[i].bump = nil;
+        classes[i].bump_end = nil;
+        uint64_t block_size = classes[i].stats.block_size;
+        bzero(&classes[i].stats, sizeof(slab_stats));
+        classes[i].stats.block_size = block_size;
+    }
+    std::lock_guard<mutex> guard(slab_lock);
+    for(size_t i = 0; i < slabs.size(); i++) {
+        ::free(slabs[i]);
+    }
+    for(size_t i = 0; i < mapped_slabs.size(); i++) {
+        munmap(mapped_slabs[i], SLAB_BYTES);
+    }
+    slabs.destroy();
+    mapped_slabs.destroy();
+    large_allocs = 0;
+    large_frees = 0;
+}
+
+slab_allocator slab_pool;
+
+// nonstd::vector policy for containers that should live in slab_pool
+struct slab_alloc {
+    static void* realloc(void *ptr, size_t old_bytes, size_t new_bytes) { return slab_pool.realloc_bytes(ptr, old_bytes, new_bytes); }
+    static void free(void *ptr, size_t bytes) { slab_pool.free_bytes(ptr, bytes); }
+};
+
+// Bump allocator for memory that only lives until the end of a frame, a physics tick or a mesh build.
+// Nothing is freed on its own, reset() takes everything back at once. If more is needed than the arena holds the
+// rest comes from malloc, and the next reset() grows the arena to the high-water mark so it fits next time.
+// Not thread safe, every thread that needs one has its own.
+struct frame_arena {
+    uint8_t *base;
+    size_t used;
+    size_t capacity;
+    size_t requested; // bytes asked for since the last reset, including what went to overflow
+    size_t high_water;
+    uint8_t *last; // the most recent allocation is the only one that can grow in place
+    nonstd::vector<void*> overflow;
+
+    void init(size_t pcapacity);
+    void* alloc(size_t bytes);
+    void* realloc(void *ptr, size_t old_bytes, size_t new_bytes);
+    void reset();
+    void destroy();
+};
+
+void frame_arena::init(size_t pcapacity) {
+    bzero(this, sizeof(frame_arena));
+    capacity = (pcapacity + 15) & ~(size_t)15;
+    base = (uint8_t*)aligned_alloc(16, capacity);
+}
+
+void* frame_arena::alloc(size_t bytes) {
+    bytes = (bytes + 15) & ~(size_t)15;
+    requested += bytes;
+    high_water = max(high_water, requested);
+    if(used + bytes > capacity) {
+        last = nil;
+        overflow.push_back(aligned_alloc(16, bytes));
+        return overflow.back();
+    }
+    last = base + used;
+    used += bytes;
+    return last;
+}
+
+void* frame_arena::realloc(void *ptr, size_t old_bytes, size_t new_bytes) {
+    old_bytes = (old_bytes + 15) & ~(size_t)15;
+    new_bytes = (new_bytes + 15) & ~(size_t)15;
+    if(ptr && ptr == last && (size_t)(last - base) + new_bytes <= capacity) {
+        requested += new_bytes - min(old_bytes, new_bytes);
+        high_water = max(high_water, requested);
+        used = (last - base) + new_bytes;
+        return ptr;
+    }
+    void *rax = alloc(new_bytes);
+    if(ptr) {
+        takeoff_memcpy(rax, ptr, min(old_bytes, new_bytes));
+    }
+    return rax;
+}
+
+// every pointer handed out since the last reset becomes invalid
+void frame_arena::reset() {
+    for(size_t i = 0; i < overflow.size(); i++) {
+        free(overflow[i]);
+    }
+    overflow.count = 0;
+    if(high_water > capacity) {
+        free(base);
+        capacity = ((high_water + high_water / 4) + 15) & ~(size_t)15;
+        base = (uint8_t*)aligned_alloc(16, capacity);
+    }
+    used = 0;
+    requested = 0;
+    last = nil;
+}
+
+void frame_arena::destroy() {
+    reset();
+    free(base);
+    overflow.destroy();
+    bzero(this, sizeof(frame_arena));
+}
+
+// a frame_arena for a thread_local, destroyed when its thread exits. init() is still up to the user.
+struct thread_arena {
+    frame_arena arena;
+
+    ~thread_arena() { arena.destroy(); }
+};
+
+// nonstd::vector policy for temporaries in a frame_arena. free does nothing, the memory comes back on reset().
+struct arena_alloc {
+    frame_arena *arena;
+    void* realloc(void *ptr, size_t old_bytes, size_t new_bytes) { return arena->realloc(ptr, old_bytes, new_bytes); }
+    static void free(void *ptr, size_t bytes) {}
+};
+
+namespace nonstd {
+template <typename T> using arena_vector = vector<T, arena_alloc>;
+};
+
 struct unionvec3 {
     union {
         float radio;
@@ -406,9 +1003,17 @@ struct dMesh {
         num_tris = pnumTris;
     }
 
+    // verts and tris share one block from slab_pool, verts first
+    static dvec3* alloc(uint64_t num_verts, uint64_t num_tris) {
+        telemetry_alloc(TAG_MESHES, num_verts * sizeof(dvec3) + num_tris * sizeof(dTri));
+        return (dvec3*)slab_pool.alloc_bytes(num_verts * sizeof(dvec3) + num_tris * sizeof(dTri));
+    }
+
     void destroy() {
-        if(verts)
-            free(verts);
+        if(verts) {
+            telemetry_free(TAG_MESHES, num_verts * sizeof(dvec3) + num_tris * sizeof(dTri));
+            slab_pool.free_bytes(verts, num_verts * sizeof(dvec3) + num_tris * sizeof(dTri));
+        }
         verts = 0;
         tris = 0;
         num_verts = 0;
@@ -424,7 +1029,7 @@ struct dMesh {
         assert(depth > 0);
         const int numVertices = 8;
         const int numTriangles = 12;
-        dvec3 *vertices = (dvec3*)malloc(numVertices * sizeof(dvec3) + numTriangles * sizeof(dTri));
+        dvec3 *vertices = dMesh::alloc(numVertices, numTriangles);
         dTri *triangles = (dTri*)&vertices[numVertices];
         double halfwidth = width / 2.0;
         double halfheight = height / 2.0;
@@ -451,9 +1056,115 @@ struct dMesh {
         }
         return dMesh(vertices, numVertices, triangles, numTriangles);
     }
-    
+
+};
+
+// octahedral encoding of a unit vector as two snorm16 values, accurate to about 0.01 degrees
+void oct_encode(glm::vec3 n, int16_t out[2]) {
+    n /= fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    float x = n.x;
+    float y = n.y;
+    if(n.z < 0.0f) {
+        // fold the lower hemisphere over the diagonals
+        x = (1.0f - fabsf(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+        y = (1.0f - fabsf(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    out[0] = (int16_t)roundf(max(-1.0f, min(1.0f, x)) * 32767.0f);
+    out[1] = (int16_t)roundf(max(-1.0f, min(1.0f, y)) * 32767.0f);
+}
+
+glm::vec3 oct_decode(const int16_t in[2]) {
+    glm::vec3 n(in[0] / 32767.0f, in[1] / 32767.0f, 0.0f);
+    n.z = 1.0f - fabsf(n.x) - fabsf(n.y);
+    float t = max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return glm::normalize(n);
+}
+
+// terrain output of buildMesh. positions are floats relative to the zone the mesh was built around, which is all
+// the precision the renderer ever used. a vertex has one elevation because buildMesh only shares a vertex between
+// triangles that agree on it. 16 bytes per vertex and 20 per triangle, against 24 and 64 for dMesh.
+struct terrain_vert {
+    glm::vec3 pos;
+    float elevation; // metres above the spheroid for terrain, a shading factor for vegetation
+};
+
+struct terrain_tri {
+    uint32_t verts[3];
+    int16_t normal[2]; // octahedral encoded local up vector, see oct_decode
+    uint8_t type_id;
+    uint8_t foliage_density[3]; // 0-255 for 0.0-1.0
+
+    glm::vec3 up() const { return oct_decode(normal); }
+    float foliage(int i) const { return foliage_density[i] * (1.0f / 255.0f); }
+    void set_foliage(int i, float density) { foliage_density[i] = (uint8_t)(max(0.0f, min(1.0f, density)) * 255.0f + 0.5f); }
+};
+
+enum vegetation_type_enum {
+    VEGETATION_TREE_SMALL,
+    VEGETATION_TREE_MEDIUM,
+    VEGETATION_TREE_LARGE,
+    VEGETATION_TREE_TALL,
+    NUM_VEGETATION_TYPES
+};
+
+// one tree. the geometry is in vegetation_templates, this is only where it stands and which way it faces.
+// the nodes keep their trees in their own object space with y up, emit() moves them to zone space.
+struct vegetation_instance {
+    glm::vec3 pos; // foot of the trunk
+    int16_t up[2]; // octahedral encoded direction of the trunk, see oct_decode
+    uint8_t type; // vegetation_type_enum
+    uint8_t yaw; // rotation around up in units of 2pi/256
+    uint8_t scale; // size relative to the template in units of 1/128
+    uint8_t shade; // 0-255 for 0.0-1.0, the shading factor that terrain_vert::elevation carries for baked geometry
+
+    glm::vec3 normal() const { return oct_decode(up); }
+    float yaw_radians() const { return yaw * (2.0f * PI / 256.0f); }
+    float size() const { return scale * (1.0f / 128.0f); }
+    float shading() const { return shade * (1.0f / 255.0f); }
+};
+
+struct terrain_mesh {
+    terrain_vert *verts;
+    terrain_tri *tris;
+    vegetation_instance *instances; // sorted by type
+    uint32_t num_verts;
+    uint32_t num_tris;
+    uint32_t num_instances;
+    uint32_t first_instance[NUM_VEGETATION_TYPES + 1]; // the instances of type i are first_instance[i] to first_instance[i + 1]
+
+    terrain_mesh() { bzero(this, sizeof(terrain_mesh)); }
+
+    static uint64_t bytes(uint64_t num_verts, uint64_t num_tris, uint64_t num_instances = 0) {
+        return num_verts * sizeof(terrain_vert) + num_tris * sizeof(terrain_tri) + num_instances * sizeof(vegetation_instance);
+    }
+
+    // verts, tris and instances share one block from slab_pool, verts first
+    static terrain_mesh alloc(uint32_t num_verts, uint32_t num_tris, uint32_t num_instances = 0) {
+        terrain_mesh m;
+        telemetry_alloc(TAG_MESHES, bytes(num_verts, num_tris, num_instances));
+        m.verts = (terrain_vert*)slab_pool.alloc_bytes(bytes(num_verts, num_tris, num_instances));
+        m.tris = (terrain_tri*)&m.verts[num_verts];
+        m.instances = (vegetation_instance*)&m.tris[num_tris];
+        m.num_verts = num_verts;
+        m.num_tris = num_tris;
+        m.num_instances = num_instances;
+        return m;
+    }
+
+    void destroy() {
+        if(verts) {
+            telemetry_free(TAG_MESHES, bytes(num_verts, num_tris, num_instances));
+            slab_pool.free_bytes(verts, bytes(num_verts, num_tris, num_instances));
+        }
+        bzero(this, sizeof(terrain_mesh));
+    }
 };
 
+struct texvert;
+typedef tagged_alloc<TAG_VEGETATION, slab_alloc> vegetation_alloc;
+
 struct texvert {
     glm::vec4 xyz;
 //    int32_t type_id; (opengl clobbered this when I passed it as int so I packed it into the w component of xyz as a workaround)
@@ -463,7 +1174,7 @@ struct texvert {
 };
 
 // foliage geometry quad, no relation to quadtrees
-void mktreequad(nonstd::vector<texvert> *dest, glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 d, glm::vec3 uvw, int32_t type_id){
+void mktreequad(nonstd::vector<texvert, vegetation_alloc> *dest, glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 d, glm::vec3 uvw, int32_t type_id){
     dest->push_back({a, type_id, uvw});
     dest->push_back({b, type_id, uvw});
     dest->push_back({c, type_id, uvw});
@@ -473,7 +1184,7 @@ void mktreequad(nonstd::vector<texvert> *dest, glm::vec3 a, glm::vec3 b, glm::ve
 }
 
 // foliage, not data structure
-void mktree(nonstd::vector<texvert> *dest, float h_trunk, float r_trunk, float h_canopy, float r_canopy, glm::vec3 origin){
+void mktree(nonstd::vector<texvert, vegetation_alloc> *dest, float h_trunk, float r_trunk, float h_canopy, float r_canopy, glm::vec3 origin){
     float h_root = -0.5;
     // trunk, should be at least 4 quads
     mktreequad(dest,
@@ -516,6 +1227,213 @@ void mktree(nonstd::vector<texvert> *dest, float h_trunk, float r_trunk, float h
             glm::vec3(1.0f), VERTEX_TYPE_LEAF);
 }
 
+// the template mesh of every vegetation_type_enum, made by mktree around the origin. built once and shared by every
+// instance, the renderer draws each type's range of verts once per instance of that type.
+struct vegetation_templates {
+    nonstd::vector<texvert, vegetation_alloc> verts;
+    uint32_t first[NUM_VEGETATION_TYPES]; // first vertex of each type in verts
+    uint32_t count[NUM_VEGETATION_TYPES];
+
+    void init() {
+        // h_trunk, r_trunk, h_canopy, r_canopy
+        const float shapes[NUM_VEGETATION_TYPES][4] = {
+            {2.0f, 0.15f, 6.0f, 2.5f},
+            {3.0f, 0.2f, 10.0f, 4.0f},
+            {4.0f, 0.3f, 14.0f, 5.0f},
+            {6.0f, 0.25f, 16.0f, 3.0f}};
+        bzero(&verts, sizeof(verts));
+        for(int i = 0; i < NUM_VEGETATION_TYPES; i++) {
+            first[i] = verts.count;
+            mktree(&verts, shapes[i][0], shapes[i][1], shapes[i][2], shapes[i][3], glm::vec3(0.0f));
+            count[i] = verts.count - first[i];
+        }
+    }
+
+    void destroy() {
+        verts.destroy();
+    }
+};
+
+// the renderer's vertices for triangles first_tri to first_tri + num_tris of mesh, with the colour in uvw and the type
+// id in w, see texvert. vertices are numbered in the order the triangles first use them (see buildMesh), so the new
+// ones in a batch are the range starting at first_vert, a vertex shared by several triangles gets its colour from the
+// first one. writes 3 indices per triangle to indices and the new vertices to verts, returns how many vertices.
+uint32_t prepare_terrain_vertices(const terrain_mesh *mesh, uint32_t first_tri, uint32_t num_tris, uint32_t first_vert,
+        texvert *verts, uint32_t *indices) {
+    uint32_t num_verts = 0;
+    for(uint32_t i = first_tri; i < first_tri + num_tris; ++i) {
+        const terrain_tri* t = &mesh->tris[i];
+        *indices++ = t->verts[0];
+        *indices++ = t->verts[1];
+        *indices++ = t->verts[2];
+        glm::vec3 floatverts[3] = {
+            mesh->verts[ t->verts[0] ].pos,
+            mesh->verts[ t->verts[1] ].pos,
+            mesh->verts[ t->verts[2] ].pos};
+        glm::vec3 normal = glm::normalize(glm::cross(floatverts[1] - floatverts[0], floatverts[2] - floatverts[0]));
+        float inclination = acosf(max(-1.0f, min(1.0f, glm::dot(normal, t->up()))));
+        float insolation = glm::dot(normal, glm::vec3(0.4, 0.4, 0.4));
+        inclination /= PI;
+        insolation += 0.5;
+        for(int j = 0; j < 3; j++){
+            if(t->verts[j] < first_vert + num_verts) {
+                continue; // already done by an earlier triangle
+            }
+            assert(t->verts[j] == first_vert + num_verts);
+            float elevation = mesh->verts[t->verts[j]].elevation;
+            vec3 fragColor = vec3(0.0f);
+            vec3 grass = vec3(0.0f);
+            vec3 rock = vec3(0.0f);
+            vec3 sand = vec3(0.0f);
+            vec3 color = vec3(0.0f);
+            vec3 foliage = vec3(0.0f);
+            switch(t->type_id){
+            case VERTEX_TYPE_TERRAIN:
+                grass = mix(vec3(0.15, 0.4, 0.15), vec3(1.0), min(1.0, max(0.0, (elevation - 2000.0) / 1000.0)));
+                rock = mix(vec3(0.7, 0.5, 0.3), vec3(0.15), min(1.0, max(0.0, elevation / 2000.0)));
+                color = mix(grass, rock, max(0.0, min(1.0, (-0.5 + 5 * inclination) - max(0.0, (elevation - 3000) / 2000.0) )));
+                sand = mix(vec3(194/255.0, 178/255.0, 128/255.0), color, min(1.0, max(0.0, (elevation + (20.0 * inclination)) / 10.0)));
+                if(elevation < 1.0){
+                    color = vec3(0.1, 0.2, 0.3);
+                    fragColor = vec3(color * (3.0 + insolation) * 0.25);
+                } else if(elevation < 100.0) {
+                    fragColor = vec3(sand * insolation);
+                } else {
+                    fragColor = vec3(color * insolation);
+                }
+                break;
+            case VERTEX_TYPE_FARTERRAIN:
+                grass = mix(vec3(0.15, 0.4, 0.15), vec3(1.0), min(1.0, max(0.0, (elevation - 2000.0) / 1000.0)));
+                rock = mix(vec3(0.7, 0.5, 0.3), vec3(0.15), min(1.0, max(0.0, elevation / 2000.0)));
+                color = mix(grass, rock, max(0.0, min(1.0, (-0.5 + 5 * inclination) - max(0.0, (elevation - 3000) / 2000.0) )));
+                sand = mix(vec3(194/255.0, 178/255.0, 128/255.0), color, min(1.0, max(0.0, (elevation + (20.0 * inclination)) / 10.0)));
+                if(elevation < 1.0){
+                    color = vec3(0.1, 0.2, 0.3);
+                    fragColor = vec3(color * (3.0 + insolation) * 0.25);
+                } else if(elevation < 100.0) {
+                    fragColor = vec3(sand * insolation);
+                } else {
+                    fragColor = vec3(color * insolation);
+                }
+                foliage = mix(vec3(0.15, 0.4, 0.15), vec3(0, 0, 0), 1.0 - inclination);
+                fragColor = mix(fragColor, foliage, t->foliage(j));
+                break;
+            }
+            new(&verts[num_verts++]) texvert(floatverts[j], t->type_id, fragColor);
+        }
+    }
+    return num_verts;
+}
+
+// where the trees stand. a blue noise point set on the unit torus in the order Mitchell's best candidate algorithm
+// picks the points, so every prefix of it is blue noise too. the torus is the rhombus of a triangle and its mirror
+// image in (u, v) = barycentric coordinates 1 and 2, a point is in the triangle when u + v <= 1.
+// a triangle gets a randomly shifted copy of the first few points, and a point becomes a tree if it lands in the
+// triangle and the foliage density there is above the point's threshold, so a sparse forest is the first points.
+struct vegetation_scatter {
+    static constexpr int SIZE = 256;
+    float u[SIZE];
+    float v[SIZE];
+    float threshold[SIZE]; // (rank + 0.5) / SIZE
+
+    static const vegetation_scatter& table() {
+        static const vegetation_scatter the_table;
+        return the_table;
+    }
+
+    vegetation_scatter() {
+        Prng_xoshiro rng;
+        rng.init(0x5ca77e4, 1);
+        const int candidates = 32;
+        for(int i = 0; i < SIZE; i++) {
+            float best = -1.0f;
+            for(int c = 0; c < candidates; c++) {
+                float cu = rng.uniform();
+                float cv = rng.uniform();
+                float nearest = 2.0f;
+                for(int j = 0; j < i; j++) {
+                    float du = fabsf(cu - u[j]);
+                    float dv = fabsf(cv - v[j]);
+                    du = min(du, 1.0f - du);
+                    dv = min(dv, 1.0f - dv);
+                    nearest = min(nearest, du * du + dv * dv);
+                }
+                if(nearest > best) {
+                    best = nearest;
+                    u[i] = cu;
+                    v[i] = cv;
+                }
+            }
+            threshold[i] = (i + 0.5f) / SIZE;
+        }
+    }
+
+    // the matrix from the barycentric coordinates of the level `from` ancestor of the node at path, level `to`, to
+    // the node's own. descend_barycentric as a matrix.
+    static void descend(uint64_t path, int from, int to, float m[3][3]) {
+        bzero(m, sizeof(float) * 9);
+        for(int i = 0; i < 3; i++) {
+            m[i][i] = 1.0f;
+        }
+        for(int level = from; level < to; level++) {
+            uint32_t child = (path >> (1 + 2 * level)) & 3;
+            float r[3][3];
+            takeoff_memcpy(r, m, sizeof(r));
+            for(int j = 0; j < 3; j++) {
+                if(child) {
+                    int i = child - 1;
+                    m[0][j] = 2.0f * r[i][j] - r[0][j] - r[1][j] - r[2][j];
+                    m[1][j] = 2.0f * r[(i + 1) % 3][j];
+                    m[2][j] = 2.0f * r[(i + 2) % 3][j];
+                } else {
+                    m[0][j] = r[0][j] + r[1][j] - r[2][j];
+                    m[1][j] = r[1][j] + r[2][j] - r[0][j];
+                    m[2][j] = r[2][j] + r[0][j] - r[1][j];
+                }
+            }
+        }
+    }
+
+    // places the trees of a node in a triangle shifted by the random bits in shift, scanning the first count points.
+    // to_node maps the triangle's coordinates to the node's (see descend), density is the foliage density at the
+    // node's corners. at density 1 the triangle gets about count / 2 trees, the rest land in the mirror image.
+    // the indices of the points used go to picked and their barycentric coordinates in the node to b, returns how many.
+    int place(uint64_t shift, const float to_node[3][3], int count, const float density[3], uint16_t *picked,
+            glm::vec3 *b) const {
+        assert(count <= SIZE);
+        float su = (shift & 0xffffffff) * (1.0f / 4294967296.0f);
+        float sv = (shift >> 32) * (1.0f / 4294967296.0f);
+        float scale = (float)count / SIZE;
+        // branch free so it runs in SIMD registers, the few hits are collected afterwards
+        float l[3][SIZE];
+        uint8_t hit[SIZE];
+        for(int i = 0; i < count; i++) {
+            float pu = u[i] + su;
+            float pv = v[i] + sv;
+            pu -= pu >= 1.0f ? 1.0f : 0.0f;
+            pv -= pv >= 1.0f ? 1.0f : 0.0f;
+            float pw = 1.0f - pu - pv;
+            float l0 = to_node[0][0] * pw + to_node[0][1] * pu + to_node[0][2] * pv;
+            float l1 = to_node[1][0] * pw + to_node[1][1] * pu + to_node[1][2] * pv;
+            float l2 = to_node[2][0] * pw + to_node[2][1] * pu + to_node[2][2] * pv;
+            float d = l0 * density[0] + l1 * density[1] + l2 * density[2];
+            hit[i] = (l0 >= 0.0f) & (l1 >= 0.0f) & (l2 >= 0.0f) & (d * scale > threshold[i]);
+            l[0][i] = l0;
+            l[1][i] = l1;
+            l[2][i] = l2;
+        }
+        int n = 0;
+        for(int i = 0; i < count; i++) {
+            if(hit[i]) {
+                picked[n] = i;
+                b[n] = glm::vec3(l[0][i], l[1][i], l[2][i]);
+                n++;
+            }
+        }
+        return n;
+    }
+};
+
 struct Motor {
     double max_force;
     double min_force; // negative values for motors that can produce power in both directions
@@ -568,7 +1486,7 @@ enum physics_state {
 
 struct RenderObject;
 
-mempool collision_pool;
+concurrent_mempool collision_pool(TAG_COLLISION);
 
 struct PhysicsObject {
     PhysicsObject *parent;
@@ -654,8 +1572,8 @@ struct Unit {
     uint64_t id;
     uint64_t owner_id;
     PhysicsObject body;
-    nonstd::vector<PhysicsObject> limbs;
-    nonstd::vector<PhysicsObject> components;
+    nonstd::vector<PhysicsObject, tagged_alloc<TAG_PHYSICS, slab_alloc>> limbs;
+    nonstd::vector<PhysicsObject, tagged_alloc<TAG_PHYSICS, slab_alloc>> components;
     bool limbs_dirty;
     bool components_dirty;
 
@@ -697,7 +1615,7 @@ struct Unit {
                 num_tris += components[i].mesh.num_tris;
                 num_verts += components[i].mesh.num_verts;
             }
-            dvec3 *verts = (dvec3 *)malloc(num_verts * sizeof(dvec3) + num_tris * sizeof(dTri));
+            dvec3 *verts = dMesh::alloc(num_verts, num_tris);
 
             uint64_t tri_idx = 0;
             uint64_t vert_idx = 0;
@@ -828,12 +1746,15 @@ struct CollisionTree {
     dvec3 pos;
     ctnode *root = 0;
     ctleaf *leaves = 0;
+    frame_arena *arena = 0; // the nodes live in this arena if set
+    size_t node_bytes = 0;
 
     void destroy() {
-        if(root){
+        if(root && ! arena){
+            telemetry_free(TAG_COLLISION, node_bytes);
             free(root);
-            root = 0;
         }
+        root = 0;
         leaves = 0;
     }
 
@@ -842,10 +1763,15 @@ struct CollisionTree {
         root = 0;
     }
 
-    CollisionTree(dvec3 origo, ctleaf* pleaves, int N) {
+    CollisionTree(dvec3 origo, ctleaf* pleaves, int N, frame_arena *parena = nil) {
         pos = origo;
         leaves = pleaves;
-        ctnode* nodes = (ctnode*) malloc(sizeof(ctnode) * (2 * N));
+        arena = parena;
+        node_bytes = sizeof(ctnode) * (2 * N);
+        if( ! arena) {
+            telemetry_alloc(TAG_COLLISION, node_bytes);
+        }
+        ctnode* nodes = (ctnode*) (arena ? arena->alloc(node_bytes) : malloc(node_bytes));
         root = &nodes[0];
         root->count = N;
         AABB globalBounds = calculateBounds(pleaves, 0, N-1);
@@ -869,7 +1795,7 @@ struct ttnode {
     dvec3 verts[3]; // vertices (node space (octahedron with manhattan distance to center = r everywhere on the surface))
     uint32_t last_used_at_frame;
     float foliage_density[3];
-    nonstd::vector<texvert> vegetation;
+    nonstd::vector<vegetation_instance, vegetation_alloc> vegetation; // in the object space of the node, see emit()
 
     vec3 wind_velocity;
     float pressure;
@@ -922,17 +1848,17 @@ struct ttnode {
         return elevation;
     }
 
-    double player_altitude(dvec3 pos, dMesh* mesh, dvec3 gravity_dir) {
-        dTri *tri = &mesh->tris[triangle];
-        dvec3 a = mesh->verts[tri->verts[0]];
-        dvec3 b = mesh->verts[tri->verts[1]];
-        dvec3 c = mesh->verts[tri->verts[2]];
+    double player_altitude(dvec3 pos, terrain_mesh* mesh, dvec3 gravity_dir) {
+        terrain_tri *tri = &mesh->tris[triangle];
+        dvec3 a = mesh->verts[tri->verts[0]].pos;
+        dvec3 b = mesh->verts[tri->verts[1]].pos;
+        dvec3 c = mesh->verts[tri->verts[2]].pos;
         dvec3 ab = b - a;
         dvec3 ac = c - a;
         dvec3 norm = normalize(glm::cross(ab, ac));
         double divisor = dot(norm, gravity_dir);
         for(int i = 0; i < 9; i++){
-            assert(!isnan(((double*)(&mesh->verts[tri->verts[i/3]]))[i % 3])); // fight me
+            assert(!isnan(((float*)(&mesh->verts[tri->verts[i/3]].pos))[i % 3])); // fight me
         }
         assert(divisor != 0.0);
         double d = dot(norm, (a - pos)) / divisor;
@@ -941,75 +1867,206 @@ struct ttnode {
 
 };
 
-glm::vec3 calculate_center(uint64_t level, uint64_t address, glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, uint64_t wiggle) {
-    assert(level < 32);
-    for(int i = 0; i < level; i++){
-        glm::vec3 mid0 = (v0 + v1) * 0.5f;
-        glm::vec3 mid1 = (v1 + v2) * 0.5f;
-        glm::vec3 mid2 = (v2 + v0) * 0.5f;
-        switch ((address >> (2 * i)) & 3) {
-            case 0: // Center triangle
-                v0 = mid0;
-                v1 = mid1;
-                v2 = mid2;
-                break;
-            case 1: // First corner triangle
-                v1 = mid0;
-                v2 = mid2;
-                break;
-            case 2: // Second corner triangle
-                v2 = mid1;
-                v0 = mid0;
-                break;
-            case 3: // Third corner triangle
-                v0 = mid2;
-                v1 = mid1;
-                break;
+// Maps node space corner positions to vertex indices so the triangles that meet at a corner share one vertex.
+// Neighbouring nodes derive a shared corner from the same parent vertices, so its position matches bit for bit.
+// Nodes of one level sample the same octaves at it (see TerrainTree::subdivision_noise) and agree on its elevation,
+// where leaves of different levels meet the finer one has more octaves and its elevation is kept.
+// Lives in the mesh arena for the duration of one buildMesh.
+struct shared_vertex_map {
+    struct entry {
+        dvec3 pos;
+        double elevation;
+        uint32_t idx;
+        uint32_t level; // of the leaf the elevation came from, 0 if the slot is empty
+    };
+    nonstd::arena_vector<entry> slots;
+    size_t size;
+
+    void init(frame_arena *arena, size_t expected) {
+        new(&slots) nonstd::arena_vector<entry>(arena_alloc{arena});
+        size = 0;
+        size_t capacity = 16;
+        while(capacity < expected * 2) {
+            capacity *= 2;
         }
+        resize(capacity);
     }
-    if(wiggle) {
-        float r1 = sqrt((wiggle % 10000000) / 10000000.0f);
-        float r2 = (wiggle % 9000000) / 9000000.0f;
-        float a = 1 - r1;
-        float b = r1 * (1 - r2);
-        float c = r1 * r2;
-        return a * v0 + b * v1 + c * v2;
-    } else {
-        glm::vec3 center = (v0 + v1 + v2) / 3.0f;
-        return center;
-    }
-}
-
-struct TerrainTree {
-    uint64_t seed;
-    double radius;
-    double noise_yscaling;
-    double LOD_DISTANCE_SCALE;
-    int MAX_LOD;
-    float highest_point = 0.0f;
-    float lowest_point = 0.0f;
-
-    TerrainGenerator *generator;
-    nonstd::vector<ttnode> nodes;
 
-    void destroy() {
-        for(int i = 0; i > nodes.count; i++){
-            nodes[i].vegetation.destroy();
+    static uint64_t hash(dvec3 p) {
+        uint64_t h = 0x9E3779B97F4A7C15ULL;
+        for(int i = 0; i < 3; i++) {
+            uint64_t bits;
+            takeoff_memcpy(&bits, &p[i], sizeof(bits));
+            h = (h ^ bits) * 0xBF58476D1CE4E5B9ULL;
+            h ^= h >> 31;
         }
-        nodes.destroy();
+        return h;
     }
 
-    ~TerrainTree() {
+    void resize(size_t capacity) {
+        entry *old = slots.data;
+        size_t old_capacity = slots.count;
+        // the old slots stay in the arena until it is reset, nothing to free
+        slots.data = nil;
+        slots.count = 0;
+        slots.capacity = 0;
+        slots.reserve(capacity);
+        bzero(slots.data, capacity * sizeof(entry));
+        slots.count = capacity;
+        for(size_t i = 0; i < old_capacity; i++) {
+            if(old[i].level) {
+                size_t j = hash(old[i].pos) & (capacity - 1);
+                while(slots[j].level) {
+                    j = (j + 1) & (capacity - 1);
+                }
+                slots[j] = old[i];
+            }
+        }
     }
 
-    TerrainTree() {
-        bzero(this, sizeof(TerrainTree));
-    }
+    // returns the index stored for pos, or stores idx and returns it if pos is new. *finer is set if pos was known
+    // from a coarser leaf, the caller overwrites that vertex with this elevation.
+    uint32_t find_or_insert(dvec3 pos, double elevation, uint32_t level, uint32_t idx, bool *finer) {
+        assert(level > 0);
+        *finer = false;
+        if((size + 1) * 2 > slots.count) {
+            resize(slots.count * 2);
+        }
+        size_t mask = slots.count - 1;
+        size_t j = hash(pos) & mask;
+        while(slots[j].level) {
+            if(slots[j].pos == pos) {
+                assert(level != slots[j].level || elevation == slots[j].elevation);
+                if(level > slots[j].level) {
+                    slots[j].elevation = elevation;
+                    slots[j].level = level;
+                    *finer = true;
+                }
+                return slots[j].idx;
+            }
+            j = (j + 1) & mask;
+        }
+        slots[j].pos = pos;
+        slots[j].elevation = elevation;
+        slots[j].idx = idx;
+        slots[j].level = level;
+        size++;
+        return idx;
+    }
+};
+
+// estimates where something is heading from where it has been
+struct trajectory_tracker {
+    dvec3 pos;
+    dvec3 vel;
+    double time; // seconds, any epoch as long as it's the same for every update
+    uint32_t samples;
+
+    trajectory_tracker() { bzero(this, sizeof(trajectory_tracker)); }
+
+    void update(dvec3 ppos, double ptime) {
+        if(samples && ptime > time) {
+            // smoothed over about half a second so a single jittery frame doesn't throw the prediction
+            double a = samples == 1 ? 1.0 : min(1.0, (ptime - time) / 0.5);
+            vel = vel * (1.0 - a) + ((ppos - pos) / (ptime - time)) * a;
+        }
+        pos = ppos;
+        time = ptime;
+        samples++;
+    }
+
+    dvec3 predict(double seconds_ahead) {
+        return pos + vel * seconds_ahead;
+    }
+};
+
+// a terrain node waiting to be refined, ordered by the error it would leave if it was rendered as it is
+struct refine_candidate {
+    double error;
+    uint32_t node_idx;
+    uint32_t level;
+    uint64_t path;
+
+    bool operator<(const refine_candidate &rhs) const { return error < rhs.error; }
+};
+
+// limits for one buildMesh, refinement stops at whichever is hit first. 0 means no limit.
+struct refine_budget {
+    double milliseconds;
+    uint64_t max_tris;
+    bool exhausted; // set by buildMesh if it ran out of budget before the whole mesh reached LOD_DISTANCE_SCALE
+    uint64_t new_nodes; // set with exhausted, how many nodes the tree gained. 0 with exhausted set means the budget
+                        // is too small to get any further from this location
+};
+
+// the 6 clip planes of a view-projection matrix, normals pointing inward
+struct view_frustum {
+    glm::dvec4 planes[6];
+
+    static view_frustum from_matrix(glm::dmat4 m) {
+        view_frustum f;
+        for(int i = 0; i < 3; i++) {
+            glm::dvec4 row = glm::dvec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+            glm::dvec4 w = glm::dvec4(m[0][3], m[1][3], m[2][3], m[3][3]);
+            f.planes[i * 2] = w + row;
+            f.planes[i * 2 + 1] = w - row;
+        }
+        for(int i = 0; i < 6; i++) {
+            f.planes[i] = f.planes[i] * (1.0 / glm::length(dvec3(f.planes[i].x, f.planes[i].y, f.planes[i].z)));
+        }
+        return f;
+    }
+
+    bool sphere_outside(dvec3 center, double r) {
+        for(int i = 0; i < 6; i++) {
+            if(glm::dot(dvec3(planes[i].x, planes[i].y, planes[i].z), center) + planes[i].w < -r) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+struct TerrainTree {
+    uint64_t seed;
+    double radius;
+    double noise_yscaling;
+    double LOD_DISTANCE_SCALE;
+    int MAX_LOD;
+    float highest_point = 0.0f;
+    float lowest_point = 0.0f;
+
+    bool indexed_mesh; // terrain triangles share corner vertices instead of each getting three of their own
+    bool horizon_culling; // nodes that are below the horizon from the vantage point are not refined
+    bool frustum_culling; // nodes outside frustum are not refined. the mesh outlives the camera direction, use with care
+    view_frustum frustum; // in zone space, the space buildMesh outputs
+
+    TerrainGenerator *generator;
+    nonstd::vector<ttnode, tagged_alloc<TAG_TERRAIN_NODES>> nodes;
+
+    // a vegetation buffer is owned by exactly one tree. copy() moves it to the copy, omitting_copy() throws away
+    // the copied nodes' vegetation and leaves the evicted nodes' vegetation to be freed here.
+    void destroy() {
+        for(int i = 0; i < nodes.count; i++){
+            nodes[i].vegetation.destroy();
+        }
+        nodes.destroy();
+    }
+
+    ~TerrainTree() {
+    }
+
+    TerrainTree() {
+        bzero(this, sizeof(TerrainTree));
+    }
 
     TerrainTree copy() {
         TerrainTree tmp;
         takeoff_memcpy(&tmp, this, sizeof(TerrainTree));
         tmp.nodes = nodes.copy();
+        for(int i = 0; i < nodes.count; i++) {
+            bzero(&nodes[i].vegetation, sizeof(nodes[i].vegetation));
+        }
         if(LOW_MEMORY_MODE) {
             for(int i = 0; i < tmp.nodes.count; i++) {
                 tmp.nodes[i].vegetation.destroy();
@@ -1031,6 +2088,7 @@ struct TerrainTree {
         for(uint32_t i = 0; i < 4; ++i){
             tmp->nodes.push_back(nodes[first_child + i]);
             tmp->nodes.back().vegetation.destroy();
+            bzero(&nodes[first_child + i].vegetation, sizeof(nodes[first_child + i].vegetation));
         }
         for(uint32_t i = 0; i < 4; ++i){
             descend_and_omit(tmp, &tmp->nodes[node->first_child + i], cutoff);
@@ -1045,6 +2103,7 @@ struct TerrainTree {
         tmp.nodes.reserve(nodes.count);
         for(int i = 0; i < 8; i++) {
             tmp.nodes.push_back(nodes[i]);
+            bzero(&nodes[i].vegetation, sizeof(nodes[i].vegetation));
         }
         for(int i = 0; i < 8; i++) {
             descend_and_omit(&tmp, &tmp.nodes[i], cutoff);
@@ -1052,6 +2111,30 @@ struct TerrainTree {
         return tmp;
     }
 
+    // corner i of root tile `tile`. the root tiles are the faces of an octahedron with its 6 corners on the axes.
+    static dvec3 root_corner(uint32_t tile, int i, double radius) {
+        static const double corners[6][3] = {
+            {0.0, 1.0, 0.0},
+            {0.0, -1.0, 0.0},
+            {0.0, 0.0, 1.0},
+            {1.0, 0.0, 0.0},
+            {0.0, 0.0, -1.0},
+            {-1.0, 0.0, 0.0}
+        };
+        static const uint32_t indices[8][3] = {
+            {0, 2, 3},
+            {0, 3, 4},
+            {0, 4, 5},
+            {0, 5, 2},
+            {1, 2, 5},
+            {1, 5, 4},
+            {1, 4, 3},
+            {1, 3, 2},
+        };
+        const double *corner = corners[indices[tile][i]];
+        return dvec3(corner[0] * radius, corner[1] * radius, corner[2] * radius);
+    }
+
     // MAX_LOD should be no more than 18 for an Earth-sized planet because of precision artifacts in the fractal
     // noise generator.
     // LOD_DISTANCE_SCALE should be roughly on the order of 10 to 100 for decent performance. The gpu can handle more
@@ -1062,26 +2145,10 @@ struct TerrainTree {
         noise_yscaling = sqrt(radius);
         LOD_DISTANCE_SCALE = pLOD;
         MAX_LOD = 20;
+        indexed_mesh = true;
+        horizon_culling = true;
+        frustum_culling = false;
         generator = new TerrainGenerator(seed, roughness);
-        // 6 corners
-        dvec3 initial_corners[6] = {
-            dvec3(0.0, radius, 0.0),
-            dvec3(0.0, -radius, 0.0),
-            dvec3(0.0, 0.0, radius),
-            dvec3(radius, 0.0, 0.0),
-            dvec3(0.0, 0.0, -radius),
-            dvec3(-radius, 0.0, 0.0)
-        };
-        uint32_t indices[8][3] = {
-            {0, 2, 3},
-            {0, 3, 4},
-            {0, 4, 5},
-            {0, 5, 2},
-            {1, 2, 5},
-            {1, 5, 4},
-            {1, 4, 3},
-            {1, 3, 2},
-        };
         // neighboring triangles share an edge and 2 vertices
         // make sure neighbors are in ccw order so it's consistent with the vertex ordering
         uint32_t neighbors[8][3] = {
@@ -1097,226 +2164,411 @@ struct TerrainTree {
         for(uint64_t i = 0; i < 8; i++){
             nodes.push_back({i, 0, 0, 0,
                     neighbors[i][0], neighbors[i][1], neighbors[i][2],
-                    generator->getElevation(initial_corners[indices[i][0]]),
-                    generator->getElevation(initial_corners[indices[i][1]]),
-                    generator->getElevation(initial_corners[indices[i][2]]),
+                    generator->getElevation(root_corner(i, 0, radius)),
+                    generator->getElevation(root_corner(i, 1, radius)),
+                    generator->getElevation(root_corner(i, 2, radius)),
                     0, 0, 0,
-                    initial_corners[indices[i][0]],
-                    initial_corners[indices[i][1]],
-                    initial_corners[indices[i][2]],
-                    0, {0, 0, 0}, nonstd::vector<texvert>(),
+                    root_corner(i, 0, radius),
+                    root_corner(i, 1, radius),
+                    root_corner(i, 2, radius),
+                    0, {0, 0, 0}, nonstd::vector<vegetation_instance, vegetation_alloc>(),
                     vec3(0, 0, 0), 0.0f, vec3(0, 0, 0), 0.0f, 0.0f, 0.0f
                     } );
         }
     }
 
-    // no rotation, only translation so the mesh is centered at location with spheroid = radius
-    void generate(dvec3 location, uint32_t node_idx, nonstd::vector<glm::dvec3> *verts, nonstd::vector<dTri> *tris,
-            uint64_t level, int min_level, uint64_t path, terrain_upload_status_enum *status) {
-        if(status && *status == should_exit){
-            return;
+    // true if no part of the node can be seen from location. the terrain is somewhere between lowest_point and
+    // highest_point, so a sphere at lowest_point is the occluder and the node and the viewer are assumed to be as
+    // high as highest_point. on the safe side: a node this returns false for may still be hidden. the bounds grow
+    // as new nodes are generated, so the first build of a fresh tree can stop refining a little early near the horizon.
+    bool below_horizon(dvec3 location, uint32_t node_idx) {
+        double occluder = radius + lowest_point;
+        double top = radius + highest_point;
+        if(top <= occluder) {
+            return false;
         }
-        if(POTATO_MODE && node_idx % 10 == 0){
-            usleep(1000);
+        // the greatest angle at the planet's center between the viewer and a point it can see
+        double horizon = 2.0 * acos(occluder / top);
+        dvec3 center = normalize(nodes[node_idx].center());
+        double extent = 0.0;
+        for(int i = 0; i < 3; i++) {
+            extent = max(extent, acos(min(1.0, dot(center, normalize(nodes[node_idx].verts[i])))));
         }
-        nodes[node_idx].path = path;
-        nodes[node_idx].last_used_at_frame = frame_counter;
+        double angle = acos(max(-1.0, min(1.0, dot(center, normalize(location)))));
+        return angle - extent > horizon;
+    }
+
+    // true if the node's bounding sphere in zone space is entirely outside frustum
+    bool outside_frustum(dvec3 location, uint32_t node_idx) {
+        double mid = radius + (highest_point + lowest_point) * 0.5;
+        dvec3 center = normalize(nodes[node_idx].center()) * mid;
+        double extent = 0.0;
+        for(int i = 0; i < 3; i++) {
+            extent = max(extent, length(normalize(nodes[node_idx].verts[i]) * mid - center));
+        }
+        double r = extent + (highest_point - lowest_point) * 0.5;
+        return frustum.sphere_outside(center - location, r);
+    }
+
+    // the error a node would leave if it was rendered instead of its children: its width over its distance from the
+    // vantage point. refinement stops below 1 / LOD_DISTANCE_SCALE.
+    double refinement_error(dvec3 location, uint32_t node_idx) {
+        dvec3 nodespace_center = nodes[node_idx].center();
+        //double distance = glm::length(location - nodes[node_idx].verts[0]);
+        double distance = glm::length(location - (nodespace_center * radius / glm::length(nodespace_center)));
+        double nodeWidth = glm::length(nodes[node_idx].verts[0] - nodes[node_idx].verts[1]);
+        return nodeWidth / distance;
+    }
+
+    // true if the node should be rendered as it is rather than refined further
+    bool refinement_done(dvec3 location, uint32_t node_idx, uint64_t level, int min_level) {
+        // a LOD going on here
+        if(level <= min_level) {
+            return false;
+        }
+        if(refinement_error(location, node_idx) * LOD_DISTANCE_SCALE < 1.0 || level >= MAX_LOD) {
+            return true;
+        }
+        // a node that can't be seen stays at the coarsest level so the surface is still closed
+        return (horizon_culling && below_horizon(location, node_idx)) ||
+            (frustum_culling && outside_frustum(location, node_idx));
+    }
+
+    // the midpoints of a node's edges, the corners of its center child
+    static void midpoints(const dvec3 verts[3], vec3 new_verts[3]) {
+        new_verts[0] = (verts[0] + verts[1]) * 0.5f;
+        new_verts[1] = (verts[1] + verts[2]) * 0.5f;
+        new_verts[2] = (verts[2] + verts[0]) * 0.5f;
+    }
+
+    // the noise subdivide() samples for a node with the given corners. elevations and roughnesses 0-2 are at the
+    // edge midpoints and 3-5 at the corners, the elevations not yet multiplied by noise_yscaling. 6-11 are scratch.
+    // only the octaves with features at least as wide as the children's corner spacing at level are evaluated, finer
+    // ones would fall between the corners and be aliased into noise. the first octave is always there so the upper
+    // levels keep their continents. a leaf skips a few octaves, the upper levels most of them. the width is the nominal one of the level rather than the node's own, same level nodes differ in size
+    // across the octahedron and neighbours have to agree on the corners and midpoints they share.
+    static void subdivision_noise(TerrainGenerator *generator, double radius, int level, const dvec3 verts[3],
+            vec3 new_verts[3], float elevations[12], float roughnesses[12]) {
         double noise_xzscaling = 0.0001;
         double noise_xzscaling2 = -0.00001;
-        // a LOD going on here
-        if(level > min_level) {
-            dvec3 nodespace_center = nodes[node_idx].center();
-            //double distance = glm::length(location - nodes[node_idx].verts[0]);
-            double distance = glm::length(location - (nodespace_center * radius / glm::length(nodespace_center)));
-            double nodeWidth = glm::length(nodes[node_idx].verts[0] - nodes[node_idx].verts[1]);
-            double ratio = distance / nodeWidth;
-
-            if(ratio > LOD_DISTANCE_SCALE || level >= MAX_LOD) {
-                int tree_render_level = 18;
-                dTri t;
-                if(level < tree_render_level){
-                    t.type_id = VERTEX_TYPE_FARTERRAIN;
-                } else {
-                    t.type_id = VERTEX_TYPE_TERRAIN;
-                }
-                dvec3 zonespace_center = {0, 0, 0};
-                for(int i = 0; i < 3; i++) {
-                    t.verts[i] = verts->size();
-                    // scaling each point to the surface of the spheroid, subtracting location and adding the elevation value
-                    glm::vec3 point = nodes[node_idx].zone_space_position(location, radius, i);
-                    verts->push_back(point);
-                    zonespace_center += point;
-                    t.elevations[i] = nodes[node_idx].elevations[i];
-                }
-                zonespace_center /= 3.0;
-                // the local normalized inverse gravity vector in spheroid and octahedron space
-                t.normal = normalize(nodes[node_idx].verts[0]);
-                glm::vec3 floatverts[3] = {
-                    glm::vec3((*verts)[t.verts[0]]) - zonespace_center,
-                    glm::vec3((*verts)[t.verts[1]]) - zonespace_center,
-                    glm::vec3((*verts)[t.verts[2]]) - zonespace_center};
-                glm::vec3 surfacenormal = glm::normalize(glm::cross(
-                            floatverts[1] - floatverts[0], floatverts[2] - floatverts[0]));
-                float inclination = length(glm::vec3(t.normal) - surfacenormal);
-                for(int i = 0; i < 3; i++){
-                    nodes[node_idx].foliage_density[i] = max(0.0f, min(1.0f, (nodes[node_idx].elevations[i] / 50.0f)));
-                    nodes[node_idx].foliage_density[i] = max(0.0f, min(nodes[node_idx].foliage_density[i], 1.0f - ((nodes[node_idx].elevations[i] - 1500.0f) / 1500.0f)));
-                    nodes[node_idx].foliage_density[i] *= (1.0f - inclination);
-                    nodes[node_idx].foliage_density[i] = nodes[node_idx].foliage_density[i];
-                }
-                float density = nodes[node_idx].foliage_density[0] + nodes[node_idx].foliage_density[1] + nodes[node_idx].foliage_density[2];
-                density /= 3.0f;
-                    
-                nodes[node_idx].triangle = tris->size();
-                t.foliage_density[0] = nodes[node_idx].foliage_density[0];
-                t.foliage_density[1] = nodes[node_idx].foliage_density[1];
-                t.foliage_density[2] = nodes[node_idx].foliage_density[2];
-                tris->push_back(t);
-                nodes[node_idx].rendered_at_level = level;
-
-                // generate vegetation and shit
-                if(level >= tree_render_level){
-                    Prng_xoshiro rng;
-                    uint64_t level_mask = 1;
-                    for(int i = 0; i < tree_render_level; i++){
-                        level_mask <<= 2;
-                        level_mask |= 3;
-                    }
-                    rng.init(path & level_mask, seed);
-                    // prescriptive, not descriptive:
-                    // elevation 20-2000: vegetation and rocks
-                    // low roughness: grass
-                    // medium roughness: trees
-                    // high roughness: rocks
-                    // high inclination: nothing
-                    uint64_t vegetation_random_value = rng.get();
-                    bool should_generate = nodes[node_idx].vegetation.count == 0;
-                    int num_subdivisions = MAX_LOD - level;
-                    int offset = 1 + (2 * level);
-                    int num_leaves = 1 << (2 * num_subdivisions);
-                    glm::mat4 transformation = glm::toMat4(glm::rotation( glm::vec3(surfacenormal), glm::vec3(0.0, 1.0, 0.0)));
-                    glm::vec3 object_space_verts[3] = {
-                        glm::vec3(transformation * (glm::vec4(floatverts[0], 1.0))),
-                        glm::vec3(transformation * (glm::vec4(floatverts[1], 1.0))),
-                        glm::vec3(transformation * (glm::vec4(floatverts[2], 1.0)))};
-                    // "leaf" here refers to a leaf node of the terrain tree, not a piece of geometry in the vegetation we're generating
-                    for(int leaf = 0; leaf < num_leaves; leaf++){
-                        uint64_t estimated_path = path;
-                        uint64_t leaf_address = 0;
-                        for(int j = 0; j < num_subdivisions; j++){
-                            leaf_address |= (  (leaf & (3ULL << (2 * j))) << (2 * (num_subdivisions - 1)) >> (4 * j)  );
-                        }
-                        estimated_path |= (leaf_address << offset);
-                        assert((path | (leaf_address << offset)) == (path ^ (leaf_address << offset)));
-                        uint64_t local_address = leaf_address;
-                        uint64_t mask = local_address + (local_address << 12) + (local_address << 24) +
-                            (local_address << 36) + (local_address << 48);
-                        uint64_t notrandom = ((vegetation_random_value ^ estimated_path) % 1511);
-                        glm::vec3 leaf_node_center = calculate_center(num_subdivisions, leaf_address,
-                                object_space_verts[0], object_space_verts[1], object_space_verts[2], vegetation_random_value ^ estimated_path);
-                        float probability_score = notrandom / 1511.0f;
-                        if(density > probability_score) {
-                            // generate vegetation if it doesn't exist yet
-                            if(should_generate) {
-                                double h_trunk = 3.0;
-                                double r_trunk = 0.2;
-                                double h_canopy = 10.0;
-                                double r_canopy = 4.0;
-                                mktree(&nodes[node_idx].vegetation, h_trunk, r_trunk, h_canopy, r_canopy, leaf_node_center);
-                            }
-                        }
-                    }
-                    // transform vegetation to node space coordinates
-                    glm::mat4 rotation_matrix = glm::toMat4(glm::rotation(glm::vec3(0.0, 1.0, 0.0), surfacenormal));
-                    for(int i = 0; i < nodes[node_idx].vegetation.count; i+= 3) {
-                        dTri t2;
-                        t2.type_id = *(uint32_t*)(&nodes[node_idx].vegetation[i].xyz.w);
-                        for(int j = 0; j < 3; j++) {
-                            t2.verts[j] = verts->size();
-                            glm::vec4 point4 = nodes[node_idx].vegetation[i + j].xyz;
-                            point4.w = 1.0f;
-                            point4 = rotation_matrix * point4;
-                            glm::dvec3 point = glm::dvec3(point4) + zonespace_center;
-                            verts->push_back(point);
-                            //t2.elevations[j] = nodes[node_idx].vegetation[i + j].uvw.x;
-                            t2.elevations[j] = inclination;
-                        }
-                        t2.normal = t.normal;
-                        tris->push_back(t2);
-                    }
-                }
-                return;
-            }
+        midpoints(verts, new_verts);
+        vec3 scaled_verts[12] = {
+            glm::normalize(new_verts[0]) * radius * noise_xzscaling,
+            glm::normalize(new_verts[1]) * radius * noise_xzscaling,
+            glm::normalize(new_verts[2]) * radius * noise_xzscaling,
+            glm::normalize(verts[0]) * radius * noise_xzscaling,
+            glm::normalize(verts[1]) * radius * noise_xzscaling,
+            glm::normalize(verts[2]) * radius * noise_xzscaling,
+            glm::normalize(new_verts[0]) * radius * noise_xzscaling2,
+            glm::normalize(new_verts[1]) * radius * noise_xzscaling2,
+            glm::normalize(new_verts[2]) * radius * noise_xzscaling2,
+            glm::normalize(verts[0]) * radius * noise_xzscaling2,
+            glm::normalize(verts[1]) * radius * noise_xzscaling2,
+            glm::normalize(verts[2]) * radius * noise_xzscaling2};
+        // a root edge spans a quarter of a great circle
+        double width = ldexp(M_SQRT2 * radius, 1 - level);
+        int octaves[2] = {
+            TerrainGenerator::resolvable_octaves(width * noise_xzscaling),
+            TerrainGenerator::resolvable_octaves(width * -noise_xzscaling2)};
+        generator->getMultiple(elevations, roughnesses, scaled_verts, 12, 0.2, octaves);
+        for(int i = 0; i < 6; i++) {
+            elevations[i] += (elevations[i+6] * 5.0);
+            roughnesses[i] += (roughnesses[i+6]);
         }
-        // procedurally generate terrain height values on demand
-        if( ! nodes[node_idx].first_child) {
-            nodes[node_idx].first_child = (uint32_t)nodes.size();
-            vec3 new_verts[3] = {
-                (nodes[node_idx].verts[0] + nodes[node_idx].verts[1]) * 0.5f,
-                (nodes[node_idx].verts[1] + nodes[node_idx].verts[2]) * 0.5f,
-                (nodes[node_idx].verts[2] + nodes[node_idx].verts[0]) * 0.5f};
-            vec3 scaled_verts[12] = {
-                glm::normalize(new_verts[0]) * radius * noise_xzscaling,
-                glm::normalize(new_verts[1]) * radius * noise_xzscaling,
-                glm::normalize(new_verts[2]) * radius * noise_xzscaling,
-                glm::normalize(nodes[node_idx].verts[0]) * radius * noise_xzscaling,
-                glm::normalize(nodes[node_idx].verts[1]) * radius * noise_xzscaling,
-                glm::normalize(nodes[node_idx].verts[2]) * radius * noise_xzscaling,
-                glm::normalize(new_verts[0]) * radius * noise_xzscaling2,
-                glm::normalize(new_verts[1]) * radius * noise_xzscaling2,
-                glm::normalize(new_verts[2]) * radius * noise_xzscaling2,
-                glm::normalize(nodes[node_idx].verts[0]) * radius * noise_xzscaling2,
-                glm::normalize(nodes[node_idx].verts[1]) * radius * noise_xzscaling2,
-                glm::normalize(nodes[node_idx].verts[2]) * radius * noise_xzscaling2};
-            float elevations[12];
-            float roughnesses[12];
-            generator->getMultiple(elevations, roughnesses, scaled_verts, 12, 0.2);
-
-            for(int i = 0; i < 6; i++) {
-                elevations[i] += (elevations[i+6] * 5.0);
-                roughnesses[i] += (roughnesses[i+6]);
-                lowest_point = glm::min(elevations[i] * (float)noise_yscaling, lowest_point);
-                highest_point = glm::max(elevations[i] * (float)noise_yscaling, highest_point);
-            }
+    }
 
-            // the center triangle neighbors the other 3 triangles, that's easy
+    // procedurally generate terrain height values on demand. level is the node's, 1 for the roots.
+    void subdivide(uint32_t node_idx, int level) {
+        if(nodes[node_idx].first_child) {
+            return;
+        }
+        nodes[node_idx].first_child = (uint32_t)nodes.size();
+        vec3 new_verts[3];
+        float elevations[12];
+        float roughnesses[12];
+        subdivision_noise(generator, radius, level, nodes[node_idx].verts, new_verts, elevations, roughnesses);
+        for(int i = 0; i < 6; i++) {
+            lowest_point = glm::min(elevations[i] * (float)noise_yscaling, lowest_point);
+            highest_point = glm::max(elevations[i] * (float)noise_yscaling, highest_point);
+        }
+
+        // the center triangle neighbors the other 3 triangles, that's easy
+        nodes.push_back({0, 0, 0, 0,
+            (uint32_t)nodes.size() + 1, (uint32_t)nodes.size() + 2, (uint32_t)nodes.size() + 3,
+            elevations[0] * noise_yscaling,
+            elevations[1] * noise_yscaling,
+            elevations[2] * noise_yscaling,
+            roughnesses[0],
+            roughnesses[1],
+            roughnesses[2],
+            new_verts[0],
+            new_verts[1],
+            new_verts[2],
+            0, {0, 0, 0}, nonstd::vector<vegetation_instance, vegetation_alloc>(),
+            vec3(0, 0, 0), 0.0f, vec3(0, 0, 0), 0.0f, 0.0f, 0.0f
+            });
+        // the other 3 triangles neighbor the center triangle and child trangles of the parent's neighbors
+        // we can't know the parent's neighbors' children because they may not exist yet
+        for(int i = 0; i < 3; i++) {
             nodes.push_back({0, 0, 0, 0,
-                (uint32_t)nodes.size() + 1, (uint32_t)nodes.size() + 2, (uint32_t)nodes.size() + 3,
-                elevations[0] * noise_yscaling,
-                elevations[1] * noise_yscaling,
-                elevations[2] * noise_yscaling,
-                roughnesses[0],
-                roughnesses[1],
-                roughnesses[2],
-                new_verts[0],
-                new_verts[1],
-                new_verts[2],
-                0, {0, 0, 0}, nonstd::vector<texvert>(),
+                0, 0, (uint32_t)nodes.size(),
+                elevations[i + 3] * noise_yscaling,
+                elevations[i] * noise_yscaling,
+                elevations[((i + 2) % 3)] * noise_yscaling,
+                roughnesses[i + 3],
+                roughnesses[i],
+                roughnesses[((i + 2) % 3)],
+                nodes[node_idx].verts[i],
+                new_verts[i],
+                new_verts[(i + 2) % 3],
+                0, {0, 0, 0}, nonstd::vector<vegetation_instance, vegetation_alloc>(),
                 vec3(0, 0, 0), 0.0f, vec3(0, 0, 0), 0.0f, 0.0f, 0.0f
                 });
-            // the other 3 triangles neighbor the center triangle and child trangles of the parent's neighbors
-            // we can't know the parent's neighbors' children because they may not exist yet
-            for(int i = 0; i < 3; i++) {
-                nodes.push_back({0, 0, 0, 0,
-                    0, 0, (uint32_t)nodes.size(),
-                    elevations[i + 3] * noise_yscaling,
-                    elevations[i] * noise_yscaling,
-                    elevations[((i + 2) % 3)] * noise_yscaling,
-                    roughnesses[i + 3],
-                    roughnesses[i],
-                    roughnesses[((i + 2) % 3)],
-                    nodes[node_idx].verts[i],
-                    new_verts[i],
-                    new_verts[(i + 2) % 3],
-                    0, {0, 0, 0}, nonstd::vector<texvert>(),
-                    vec3(0, 0, 0), 0.0f, vec3(0, 0, 0), 0.0f, 0.0f, 0.0f
-                    });
+        }
+    }
+
+    // appends the node's triangle to the mesh, and its trees to instances if it is close enough to have any
+    void emit(dvec3 location, uint32_t node_idx, uint64_t level, uint64_t path, nonstd::arena_vector<terrain_vert> *verts,
+            nonstd::arena_vector<terrain_tri> *tris, nonstd::arena_vector<vegetation_instance> *instances,
+            shared_vertex_map *shared_verts) {
+        int tree_render_level = 18;
+        terrain_tri t;
+        if(level < tree_render_level){
+            t.type_id = VERTEX_TYPE_FARTERRAIN;
+        } else {
+            t.type_id = VERTEX_TYPE_TERRAIN;
+        }
+        dvec3 zonespace_center = {0, 0, 0};
+        for(int i = 0; i < 3; i++) {
+            bool finer = false;
+            t.verts[i] = shared_verts ? shared_verts->find_or_insert(nodes[node_idx].verts[i],
+                    nodes[node_idx].elevations[i], level, verts->size(), &finer) : verts->size();
+            // scaling each point to the surface of the spheroid, subtracting location and adding the elevation value
+            glm::vec3 point = nodes[node_idx].zone_space_position(location, radius, i);
+            if(t.verts[i] == verts->size()) {
+                verts->push_back({point, (float)nodes[node_idx].elevations[i]});
+            } else if(finer) {
+                (*verts)[t.verts[i]] = {point, (float)nodes[node_idx].elevations[i]};
+            }
+            zonespace_center += point;
+        }
+        zonespace_center /= 3.0;
+        // the local normalized inverse gravity vector in spheroid and octahedron space
+        glm::vec3 up = normalize(nodes[node_idx].verts[0]);
+        oct_encode(up, t.normal);
+        glm::vec3 floatverts[3] = {
+            (*verts)[t.verts[0]].pos - glm::vec3(zonespace_center),
+            (*verts)[t.verts[1]].pos - glm::vec3(zonespace_center),
+            (*verts)[t.verts[2]].pos - glm::vec3(zonespace_center)};
+        glm::vec3 surfacenormal = glm::normalize(glm::cross(
+                    floatverts[1] - floatverts[0], floatverts[2] - floatverts[0]));
+        float inclination = length(up - surfacenormal);
+        for(int i = 0; i < 3; i++){
+            nodes[node_idx].foliage_density[i] = max(0.0f, min(1.0f, (nodes[node_idx].elevations[i] / 50.0f)));
+            nodes[node_idx].foliage_density[i] = max(0.0f, min(nodes[node_idx].foliage_density[i], 1.0f - ((nodes[node_idx].elevations[i] - 1500.0f) / 1500.0f)));
+            nodes[node_idx].foliage_density[i] *= (1.0f - inclination);
+            nodes[node_idx].foliage_density[i] = nodes[node_idx].foliage_density[i];
+        }
+            
+        nodes[node_idx].triangle = tris->size();
+        t.set_foliage(0, nodes[node_idx].foliage_density[0]);
+        t.set_foliage(1, nodes[node_idx].foliage_density[1]);
+        t.set_foliage(2, nodes[node_idx].foliage_density[2]);
+        tris->push_back(t);
+        nodes[node_idx].rendered_at_level = level;
+
+        // generate vegetation and shit
+        if(level >= tree_render_level){
+            // the trees of a node are the points of its tree_render_level ancestor's scatter table that land in it,
+            // drawn from the ancestor's numbers, so the vegetation is the same whichever level the node is rendered
+            // at and whichever order or thread the nodes are generated in
+            Prng_philox rng;
+            rng.init(seed);
+            // prescriptive, not descriptive:
+            // elevation 20-2000: vegetation and rocks
+            // low roughness: grass
+            // medium roughness: trees
+            // high roughness: rocks
+            // high inclination: nothing
+            if(nodes[node_idx].vegetation.count == 0) {
+                uint64_t ancestor = path & ((1ULL << (1 + 2 * tree_render_level)) - 1);
+                float to_node[3][3];
+                vegetation_scatter::descend(path, tree_render_level, level, to_node);
+                // about one tree per MAX_LOD node at full density
+                int count = std::min(vegetation_scatter::SIZE, 2 << (2 * std::max(0, MAX_LOD - tree_render_level)));
+                uint16_t picked[vegetation_scatter::SIZE];
+                glm::vec3 b[vegetation_scatter::SIZE];
+                int n = vegetation_scatter::table().place(rng.get(ancestor, PRNG_STREAM_VEGETATION, 0), to_node, count,
+                        nodes[node_idx].foliage_density, picked, b);
+                glm::mat4 transformation = glm::toMat4(glm::rotation( glm::vec3(surfacenormal), glm::vec3(0.0, 1.0, 0.0)));
+                glm::vec3 object_space_verts[3] = {
+                    glm::vec3(transformation * (glm::vec4(floatverts[0], 1.0))),
+                    glm::vec3(transformation * (glm::vec4(floatverts[1], 1.0))),
+                    glm::vec3(transformation * (glm::vec4(floatverts[2], 1.0)))};
+                for(int i = 0; i < n; i++) {
+                    uint64_t shape = rng.get(ancestor, PRNG_STREAM_VEGETATION, 1 + picked[i]);
+                    vegetation_instance v;
+                    v.pos = b[i].x * object_space_verts[0] + b[i].y * object_space_verts[1] + b[i].z * object_space_verts[2];
+                    oct_encode(glm::vec3(0.0f, 1.0f, 0.0f), v.up);
+                    v.type = shape % NUM_VEGETATION_TYPES;
+                    v.yaw = shape >> 8;
+                    v.scale = 96 + (shape >> 16) % 64;
+                    v.shade = 0;
+                    nodes[node_idx].vegetation.push_back(v);
+                }
+            }
+            // transform vegetation to zone space, the geometry is added by whoever draws the instances
+            glm::mat4 rotation_matrix = glm::toMat4(glm::rotation(glm::vec3(0.0, 1.0, 0.0), surfacenormal));
+            uint8_t shade = (uint8_t)(max(0.0f, min(1.0f, inclination)) * 255.0f + 0.5f);
+            for(int i = 0; i < nodes[node_idx].vegetation.count; i++) {
+                vegetation_instance v = nodes[node_idx].vegetation[i];
+                glm::vec4 point4 = rotation_matrix * glm::vec4(v.pos, 1.0f);
+                v.pos = glm::vec3(glm::dvec3(glm::vec3(point4)) + zonespace_center);
+                oct_encode(surfacenormal, v.up);
+                v.shade = shade;
+                instances->push_back(v);
+            }
+        }
+    }
+
+    // like generate() but breadth first by priority: the node with the greatest refinement_error is refined first,
+    // so when the budget runs out the detail that was left out is the detail that mattered least. every node that
+    // is still in the queue at that point is rendered as it is.
+    void refine(dvec3 location, int min_level, refine_budget *budget, frame_arena *arena,
+            nonstd::arena_vector<terrain_vert> *verts, nonstd::arena_vector<terrain_tri> *tris,
+            nonstd::arena_vector<vegetation_instance> *instances, terrain_upload_status_enum *status,
+            shared_vertex_map *shared_verts) {
+        auto begin = now();
+        nonstd::arena_vector<refine_candidate> queue(arena_alloc{arena});
+        nonstd::arena_vector<refine_candidate> leaves(arena_alloc{arena});
+        for(uint32_t i = 0; i < 8; i++) {
+            queue.push_back({INFINITY, i, 1, i});
+        }
+        budget->exhausted = false;
+        budget->new_nodes = 0;
+        size_t nodes_before = nodes.size();
+        uint64_t expanded = 0;
+        while(queue.size()) {
+            if(status && *status == should_exit){
+                return;
+            }
+            // each node in the queue or in leaves becomes one triangle, expanding one adds 3
+            if(budget->max_tris && queue.size() + leaves.size() + 3 > budget->max_tris) {
+                budget->exhausted = true;
+                break;
             }
+            if(budget->milliseconds > 0.0 && (expanded & 15) == 0 &&
+                    std::chrono::duration_cast<std::chrono::microseconds>(now() - begin).count() > budget->milliseconds * 1000.0) {
+                budget->exhausted = true;
+                break;
+            }
+            std::pop_heap(queue.begin(), queue.end());
+            refine_candidate c = queue.pop_back();
+            nodes[c.node_idx].path = c.path;
+            nodes[c.node_idx].last_used_at_frame = frame_counter;
+            if(refinement_done(location, c.node_idx, c.level, min_level)) {
+                leaves.push_back(c);
+                continue;
+            }
+            if(POTATO_MODE && expanded % 10 == 0){
+                usleep(1000);
+            }
+            subdivide(c.node_idx, c.level);
+            for(uint32_t i = 0; i < 4; i++) {
+                uint32_t child = nodes[c.node_idx].first_child + i;
+                double error = c.level + 1 <= min_level ? INFINITY : refinement_error(location, child);
+                queue.push_back({error, child, c.level + 1, c.path | ((uint64_t)i << (1 + 2 * c.level))});
+                std::push_heap(queue.begin(), queue.end());
+            }
+            expanded++;
+        }
+        for(size_t i = 0; i < queue.size(); i++) {
+            nodes[queue[i].node_idx].path = queue[i].path;
+            nodes[queue[i].node_idx].last_used_at_frame = frame_counter;
+            leaves.push_back(queue[i]);
+        }
+        budget->new_nodes = nodes.size() - nodes_before;
+        for(size_t i = 0; i < leaves.size(); i++) {
+            emit(location, leaves[i].node_idx, leaves[i].level, leaves[i].path, verts, tris, instances, shared_verts);
+        }
+        queue.destroy();
+        leaves.destroy();
+    }
+
+    // expands the nodes a mesh built from any of the locations will need, without building one, so the detail is
+    // already in the tree by the time somebody gets there. worst first like refine(), only budget->milliseconds
+    // applies. nothing is culled because nobody knows which way the camera will be pointing.
+    void prefetch(const dvec3 *locations, int num_locations, int min_level, refine_budget *budget, terrain_upload_status_enum *status) {
+        auto begin = now();
+        nonstd::vector<dvec3> surface;
+        for(int i = 0; i < num_locations; i++) {
+            surface.push_back(locations[i] * (radius / length(locations[i])));
+        }
+        nonstd::vector<refine_candidate> queue;
+        for(uint32_t i = 0; i < 8; i++) {
+            queue.push_back({INFINITY, i, 1, i});
         }
+        budget->exhausted = false;
+        size_t nodes_before = nodes.size();
+        uint64_t expanded = 0;
+        while(queue.size()) {
+            if(status && *status == should_exit){
+                break;
+            }
+            if(budget->milliseconds > 0.0 && (expanded & 15) == 0 &&
+                    std::chrono::duration_cast<std::chrono::microseconds>(now() - begin).count() > budget->milliseconds * 1000.0) {
+                budget->exhausted = true;
+                break;
+            }
+            std::pop_heap(queue.begin(), queue.end());
+            refine_candidate c = queue.pop_back();
+            if(c.level >= MAX_LOD || c.error * LOD_DISTANCE_SCALE < 1.0) {
+                continue;
+            }
+            nodes[c.node_idx].path = c.path;
+            nodes[c.node_idx].last_used_at_frame = frame_counter;
+            subdivide(c.node_idx, c.level);
+            for(uint32_t i = 0; i < 4; i++) {
+                uint32_t child = nodes[c.node_idx].first_child + i;
+                double error = 0.0;
+                for(int j = 0; j < num_locations; j++) {
+                    error = max(error, refinement_error(surface[j], child));
+                }
+                if(c.level + 1 <= min_level) {
+                    error = INFINITY;
+                }
+                queue.push_back({error, child, c.level + 1, c.path | ((uint64_t)i << (1 + 2 * c.level))});
+                std::push_heap(queue.begin(), queue.end());
+            }
+            expanded++;
+        }
+        budget->new_nodes = nodes.size() - nodes_before;
+        surface.destroy();
+        queue.destroy();
+    }
+
+    // no rotation, only translation so the mesh is centered at location with spheroid = radius
+    // shared_verts is nil unless indexed_mesh is set
+    void generate(dvec3 location, uint32_t node_idx, nonstd::arena_vector<terrain_vert> *verts, nonstd::arena_vector<terrain_tri> *tris,
+            nonstd::arena_vector<vegetation_instance> *instances, uint64_t level, int min_level, uint64_t path,
+            terrain_upload_status_enum *status, shared_vertex_map *shared_verts) {
+        if(status && *status == should_exit){
+            return;
+        }
+        if(POTATO_MODE && node_idx % 10 == 0){
+            usleep(1000);
+        }
+        nodes[node_idx].path = path;
+        nodes[node_idx].last_used_at_frame = frame_counter;
+        if(refinement_done(location, node_idx, level, min_level)) {
+            emit(location, node_idx, level, path, verts, tris, instances, shared_verts);
+            return;
+        }
+        subdivide(node_idx, level);
         // we need to go deeper
         for(uint64_t i = 0; i < 4; i++) {
-            generate(location, nodes[node_idx].first_child + i, verts, tris, level + 1, min_level,
-                    path | (i << (1 + 2 * level)), status);
+            generate(location, nodes[node_idx].first_child + i, verts, tris, instances, level + 1, min_level,
+                    path | (i << (1 + 2 * level)), status, shared_verts);
         }
     }
 
@@ -1330,32 +2582,94 @@ struct TerrainTree {
         return n;
     }
 
+    // the root tile containing pos, and pos in barycentric coordinates of that tile. a root tile is one face of the
+    // node space octahedron, so the coordinates are just the absolute components over the manhattan length.
+    static uint32_t root_barycentric(dvec3 pos, double b[3]) {
+        double manhattan_length = abs(pos[0]) + abs(pos[1]) + abs(pos[2]);
+        uint32_t tile;
+        if(pos[1] >= 0) {
+            tile = pos[0] >= 0 ? (pos[2] >= 0 ? 0 : 1) : (pos[2] >= 0 ? 3 : 2);
+        } else {
+            tile = pos[0] >= 0 ? (pos[2] >= 0 ? 7 : 6) : (pos[2] >= 0 ? 4 : 5);
+        }
+        // the corners of even tiles are +-y, +-z, +-x and of odd ones +-y, +-x, +-z, see root_corner
+        b[0] = abs(pos[1]) / manhattan_length;
+        b[1] = abs(pos[tile & 1 ? 0 : 2]) / manhattan_length;
+        b[2] = abs(pos[tile & 1 ? 2 : 0]) / manhattan_length;
+        return tile;
+    }
+
+    // which of a node's children contains the point at barycentric coordinates b, and b in that child's coordinates.
+    // subdivide() in reverse: a corner child holds the points at least halfway to its corner, the center child holds
+    // the rest.
+    static uint32_t descend_barycentric(double b[3]) {
+        for(int i = 0; i < 3; i++) {
+            if(b[i] >= 0.5) {
+                double b1 = b[(i + 1) % 3];
+                double b2 = b[(i + 2) % 3];
+                b[0] = 2.0 * b[i] - 1.0;
+                b[1] = 2.0 * b1;
+                b[2] = 2.0 * b2;
+                return 1 + i;
+            }
+        }
+        double b0 = b[0];
+        double b1 = b[1];
+        double b2 = b[2];
+        b[0] = 1.0 - 2.0 * b2;
+        b[1] = 1.0 - 2.0 * b0;
+        b[2] = 1.0 - 2.0 * b1;
+        return 0;
+    }
+
     // pos must be a direction from the center of the celestial, length >= 1mm
+    // returns the deepest node containing pos in O(depth) with no square roots
     ttnode* operator[](dvec3 pos) {
         double manhattan_length = abs(pos[0]) + abs(pos[1]) + abs(pos[2]);
         if(manhattan_length < 0.001){
             return nil;
         }
-        // location is pos projected onto the surface of the node space octahedron
-        dvec3 location = pos * (radius / manhattan_length);
-        
-        uint64_t tile = (location[1] > 0) ? 0 : 4;
-        uint64_t i = 0;
-        ttnode* n = nil;
-        do {
-            n = &nodes[tile];
-            double shortest_distance = glm::length(location - n->center());
-            for(uint64_t i = 1; i < 4; i++){
-                double distance = glm::length(location - nodes[tile + i].center());
-                if(distance < shortest_distance){
-                    shortest_distance = distance;
-                    n = &nodes[tile + i];
+        double b[3];
+        ttnode* n = &nodes[root_barycentric(pos, b)];
+        while(n->first_child){
+            n = &nodes[n->first_child + descend_barycentric(b)];
+        }
+        return n;
+    }
+
+    // operator[] for many positions at once. the queries go down the tree a level at a time together, so the cache
+    // misses of one overlap with the work on the others instead of each query waiting out its own.
+    void lookup(const dvec3 *positions, size_t count, ttnode **out) {
+        const size_t batch = 16;
+        for(size_t first = 0; first < count; first += batch) {
+            size_t n = min(batch, count - first);
+            uint32_t current[batch];
+            double b[batch][3];
+            size_t active = 0;
+            for(size_t i = 0; i < n; i++) {
+                dvec3 pos = positions[first + i];
+                if(abs(pos[0]) + abs(pos[1]) + abs(pos[2]) < 0.001) {
+                    current[i] = UINT32_MAX;
+                    continue;
                 }
+                current[i] = root_barycentric(pos, b[i]);
+                active++;
             }
-            tile = n->first_child;
-            ++i;
-        } while (n->first_child);
-        return n;
+            while(active) {
+                active = 0;
+                for(size_t i = 0; i < n; i++) {
+                    if(current[i] == UINT32_MAX || ! nodes[current[i]].first_child) {
+                        continue;
+                    }
+                    current[i] = nodes[current[i]].first_child + descend_barycentric(b[i]);
+                    __builtin_prefetch(&nodes[current[i]]);
+                    active++;
+                }
+            }
+            for(size_t i = 0; i < n; i++) {
+                out[first + i] = current[i] == UINT32_MAX ? nil : &nodes[current[i]];
+            }
+        }
     }
 
     // to keep things simple I define a zone as a triangle at some reasonable subdivision level
@@ -1412,28 +2726,360 @@ struct TerrainTree {
         }
     }
 
-    dMesh buildMesh(dvec3 location, int min_subdivisions, terrain_upload_status_enum *status) {
+    // with a budget the mesh is refined by refine() and may stop short of LOD_DISTANCE_SCALE, see refine_budget
+    terrain_mesh buildMesh(dvec3 location, int min_subdivisions, terrain_upload_status_enum *status, refine_budget *budget = nil) {
         auto before = now();
         if(verbose) std::cout << "building mesh from vantage point (" << location.x << ", " << location.y << ", " << location.z << ")\n";
-        nonstd::vector<uint32_t> node_indices;
-        nonstd::vector<glm::dvec3> verts;
-        nonstd::vector<dTri> tris;
-        for(int i = 0; i < 8; i++) {
-            generate(location * radius / length(location), i, &verts, &tris, 1, min_subdivisions, i, status);
+        // the temporaries live in this thread's mesh arena, which is reset at the start of every build. they are
+        // reserved at the size of the previous build so they rarely have to move while growing.
+        static thread_local thread_arena mesh_arena_owner;
+        static thread_local uint64_t verts_hint = 0;
+        static thread_local uint64_t tris_hint = 0;
+        static thread_local uint64_t instances_hint = 0;
+        frame_arena &mesh_arena = mesh_arena_owner.arena;
+        if( ! mesh_arena.base) {
+            mesh_arena.init(1 << 20);
+        }
+        mesh_arena.reset();
+        nonstd::arena_vector<terrain_vert> verts(arena_alloc{&mesh_arena});
+        nonstd::arena_vector<terrain_tri> tris(arena_alloc{&mesh_arena});
+        nonstd::arena_vector<vegetation_instance> instances(arena_alloc{&mesh_arena});
+        verts.reserve(verts_hint + verts_hint / 8 + 16);
+        tris.reserve(tris_hint + tris_hint / 8 + 16);
+        instances.reserve(instances_hint + instances_hint / 8 + 16);
+        shared_vertex_map shared_verts;
+        if(indexed_mesh) {
+            shared_verts.init(&mesh_arena, verts_hint);
+        }
+        if(budget) {
+            refine(location * radius / length(location), min_subdivisions, budget, &mesh_arena, &verts, &tris, &instances, status,
+                    indexed_mesh ? &shared_verts : nil);
+        } else {
+            for(int i = 0; i < 8; i++) {
+                generate(location * radius / length(location), i, &verts, &tris, &instances, 1, min_subdivisions, i, status,
+                        indexed_mesh ? &shared_verts : nil);
+            }
         }
         uint64_t num_verts = verts.size();
         uint64_t num_tris = tris.size();
-        dvec3 *vertices = (dvec3*)malloc(verts.size() * sizeof(dvec3) + tris.size() * sizeof(dTri));
-        dTri *triangles = (dTri*)&vertices[verts.size()];
-
-        takeoff_memcpy(vertices, &verts[0], verts.size() * sizeof(dvec3));
-        takeoff_memcpy(triangles, &tris[0], tris.size() * sizeof(dTri));
+        uint64_t num_instances = instances.size();
+        terrain_mesh mesh = terrain_mesh::alloc(num_verts, num_tris, num_instances);
+        takeoff_memcpy(mesh.verts, &verts[0], num_verts * sizeof(terrain_vert));
+        takeoff_memcpy(mesh.tris, &tris[0], num_tris * sizeof(terrain_tri));
+        // counting sort by type so the renderer can draw each type with one instanced call
+        for(uint64_t i = 0; i < num_instances; i++) {
+            mesh.first_instance[instances[i].type + 1]++;
+        }
+        for(int i = 0; i < NUM_VEGETATION_TYPES; i++) {
+            mesh.first_instance[i + 1] += mesh.first_instance[i];
+        }
+        uint32_t next[NUM_VEGETATION_TYPES];
+        takeoff_memcpy(next, mesh.first_instance, sizeof(next));
+        for(uint64_t i = 0; i < num_instances; i++) {
+            mesh.instances[next[instances[i].type]++] = instances[i];
+        }
         auto after = now();
         double time_taken = std::chrono::duration_cast<std::chrono::microseconds>(after - before).count() / 1000.0;
-        if(verbose) std::cout << tris.size() << " triangles generated in " << time_taken << "ms (" << tris.size() / (time_taken * 0.001) << "tris/s)\n";
+        if(verbose) std::cout << tris.size() << " triangles and " << num_instances << " trees generated in " << time_taken << "ms (" << tris.size() / (time_taken * 0.001) << "tris/s)\n";
+        verts_hint = num_verts;
+        tris_hint = num_tris;
+        instances_hint = num_instances;
         verts.destroy();
         tris.destroy();
-        return dMesh(vertices, num_verts, triangles, num_tris);
+        instances.destroy();
+        return mesh;
+    }
+};
+
+// one ground contact for ground_query_service to resolve
+struct ground_sample {
+    dvec3 pos; // in: position relative to the celestial's center
+    double elevation; // out: elevation of the terrain under pos above the spheroid
+    double altitude; // out: height of pos above the terrain, negative below it
+    dvec3 normal; // out: outward normal of the terrain triangle under pos
+    float roughness; // out: terrain roughness under pos
+
+    // fills in elevation, altitude and normal from the global positions of the corners of the triangle under pos
+    void resolve(const dvec3 corners[3], double radius) {
+        dvec3 n = glm::normalize(glm::cross(corners[1] - corners[0], corners[2] - corners[0]));
+        if(glm::dot(n, corners[0]) < 0.0) {
+            n = -n;
+        }
+        // where the line from the center through pos crosses the triangle
+        double distance = glm::length(pos);
+        dvec3 dir = pos / distance;
+        double ground = glm::dot(n, corners[0]) / glm::dot(n, dir);
+        elevation = ground - radius;
+        altitude = distance - ground;
+        normal = n;
+    }
+};
+
+// answers ground height queries for physics and units from a terrain tree of its own, so the answers don't depend on
+// what happens to be rendered. every sample is resolved against the node at exactly min_level under it, and missing
+// nodes are generated on demand. the nodes are the same ones the rendering tree generates at the same path, so the
+// ground matches the rendered mesh wherever that is refined to min_level.
+// any number of threads may query at once, they only wait for each other when the tree has to grow.
+struct ground_query_service {
+    TerrainTree tree;
+    std::shared_mutex lock;
+    size_t max_nodes; // the tree is cut back to the root tiles when it would grow past this
+    static constexpr size_t QUERY_CHUNK = 128;
+
+    struct pending {
+        uint64_t path;
+        uint32_t sample;
+        uint32_t node_idx;
+        double b[3]; // barycentric coordinates of the sample in the node at min_level
+    };
+
+    void init(uint64_t seed, double radius, float roughness, size_t pmax_nodes) {
+        new(&tree) TerrainTree(seed, 1.0, radius, roughness);
+        max_nodes = pmax_nodes;
+    }
+
+    void destroy() {
+        tree.destroy();
+        delete tree.generator;
+        tree.generator = nil;
+    }
+
+    // follows path down to level, returns false if a node on the way has no children and expand is false
+    bool walk(uint64_t path, int level, bool expand, uint32_t *node_idx) {
+        uint32_t n = path & 7;
+        for(int i = 1; i < level; i++) {
+            if( ! tree.nodes[n].first_child) {
+                if( ! expand) {
+                    return false;
+                }
+                tree.nodes[n].path = path & ((1ULL << (1 + 2 * i)) - 1);
+                tree.subdivide(n, i);
+            }
+            n = tree.nodes[n].first_child + ((path >> (1 + 2 * i)) & 3);
+        }
+        *node_idx = n;
+        return true;
+    }
+
+    void resolve(ground_sample *sample, pending *p) {
+        ttnode &n = tree.nodes[p->node_idx];
+        dvec3 corners[3];
+        for(int i = 0; i < 3; i++) {
+            corners[i] = n.globalPosition(tree.radius, i);
+        }
+        sample->resolve(corners, tree.radius);
+        sample->roughness = p->b[0] * n.roughnesses[0] + p->b[1] * n.roughnesses[1] + p->b[2] * n.roughnesses[2];
+    }
+
+    // min_level is at least 1 and at most tree.MAX_LOD. the samples are taken QUERY_CHUNK at a time so the
+    // bookkeeping lives on the stack, a query per frame shouldn't cost a malloc.
+    void query(ground_sample *samples, size_t count, int min_level) {
+        assert(min_level >= 1 && min_level <= tree.MAX_LOD);
+        for(size_t first = 0; first < count; first += QUERY_CHUNK) {
+            query_chunk(&samples[first], std::min(count - first, QUERY_CHUNK), min_level);
+        }
+    }
+
+    void query_chunk(ground_sample *samples, size_t count, int min_level) {
+        // the descent only depends on the position, so every query's path is known before touching the tree.
+        // sorted by path, queries that land in the same node are resolved together.
+        pending queries[QUERY_CHUNK];
+        for(size_t i = 0; i < count; i++) {
+            pending &p = queries[i];
+            p.sample = i;
+            p.path = tree.root_barycentric(samples[i].pos, p.b);
+            for(int level = 1; level < min_level; level++) {
+                p.path |= (uint64_t)TerrainTree::descend_barycentric(p.b) << (1 + 2 * level);
+            }
+        }
+        std::sort(queries, queries + count, [](const pending &a, const pending &b) { return a.path < b.path; });
+
+        bool complete = true;
+        {
+            std::shared_lock<std::shared_mutex> reading(lock);
+            for(size_t i = 0; i < count && complete; i++) {
+                if(i && queries[i].path == queries[i - 1].path) {
+                    queries[i].node_idx = queries[i - 1].node_idx;
+                } else {
+                    complete = walk(queries[i].path, min_level, false, &queries[i].node_idx);
+                }
+            }
+            if(complete) {
+                for(size_t i = 0; i < count; i++) {
+                    resolve(&samples[queries[i].sample], &queries[i]);
+                }
+            }
+        }
+        if( ! complete) {
+            std::unique_lock<std::shared_mutex> writing(lock);
+            for(size_t i = 0; i < count; i++) {
+                if(i && queries[i].path == queries[i - 1].path) {
+                    queries[i].node_idx = queries[i - 1].node_idx;
+                } else {
+                    // a walk adds at most 4 nodes per level. the samples before this one are already resolved,
+                    // so the simplest eviction there is can happen between any two paths. whatever is still
+                    // needed comes right back.
+                    if(tree.nodes.size() + min_level * 4 > max_nodes) {
+                        for(size_t j = 0; j < 8; j++) {
+                            tree.nodes[j].first_child = 0;
+                        }
+                        tree.nodes.count = 8;
+                    }
+                    walk(queries[i].path, min_level, true, &queries[i].node_idx);
+                }
+                resolve(&samples[queries[i].sample], &queries[i]);
+            }
+        }
+    }
+};
+
+// the terrain a TerrainTree generates, evaluated one node at a time without building a tree or a mesh, so the server
+// can spot check the altitudes clients report without storing any terrain. a node's corners only depend on its
+// parent's noise batch, so a node costs walking its path plus at most one batch. the batches of recently visited
+// parents are kept in a small set associative LRU cache, reports tend to come from the same few places.
+// not thread safe, give each thread its own.
+struct terrain_oracle {
+    static const uint32_t WAYS = 4;
+
+    struct patch {
+        uint64_t key; // parent path and level, 0 if the slot is empty
+        uint64_t last_used;
+        float elevations[6]; // from TerrainTree::subdivision_noise, not yet multiplied by noise_yscaling
+        float roughnesses[6];
+    };
+
+    TerrainGenerator *generator;
+    double radius;
+    double noise_yscaling;
+    patch *cache;
+    uint32_t num_sets;
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+
+    // cache_patches is rounded up to a power of two sets of WAYS patches
+    void init(uint64_t seed, double pradius, float roughness, uint32_t cache_patches) {
+        generator = new TerrainGenerator(seed, roughness);
+        radius = pradius;
+        noise_yscaling = sqrt(radius);
+        num_sets = 1;
+        while(num_sets * WAYS < cache_patches) {
+            num_sets *= 2;
+        }
+        cache = (patch*)calloc(num_sets * WAYS, sizeof(patch));
+        clock = 0;
+        hits = 0;
+        misses = 0;
+    }
+
+    void destroy() {
+        free(cache);
+        cache = nil;
+        delete generator;
+        generator = nil;
+    }
+
+    // the noise batch of the node at path and level, from the cache or generated into it
+    patch *lookup(uint64_t path, int level, const dvec3 verts[3]) {
+        uint64_t key = path | ((uint64_t)level << 56);
+        patch *set = &cache[(((key * 0x9E3779B97F4A7C15ULL) >> 40) & (num_sets - 1)) * WAYS];
+        patch *victim = set;
+        clock++;
+        for(uint32_t i = 0; i < WAYS; i++) {
+            if(set[i].key == key) {
+                set[i].last_used = clock;
+                hits++;
+                return &set[i];
+            }
+            if(set[i].last_used < victim->last_used) {
+                victim = &set[i];
+            }
+        }
+        misses++;
+        vec3 new_verts[3];
+        float elevations[12];
+        float roughnesses[12];
+        TerrainTree::subdivision_noise(generator, radius, level, verts, new_verts, elevations, roughnesses);
+        victim->key = key;
+        victim->last_used = clock;
+        takeoff_memcpy(victim->elevations, elevations, sizeof(victim->elevations));
+        takeoff_memcpy(victim->roughnesses, roughnesses, sizeof(victim->roughnesses));
+        return victim;
+    }
+
+    // the corners, corner elevations and corner roughnesses of the node at path and level, the same values the
+    // node of a TerrainTree with the same seed has. level is at least 1.
+    void node(uint64_t path, int level, dvec3 verts[3], double elevations[3], double roughnesses[3]) {
+        assert(level >= 1);
+        uint32_t tile = path & 7;
+        for(int i = 0; i < 3; i++) {
+            verts[i] = TerrainTree::root_corner(tile, i, radius);
+        }
+        if(level == 1) {
+            for(int i = 0; i < 3; i++) {
+                elevations[i] = generator->getElevation(verts[i]);
+                roughnesses[i] = 0.0;
+            }
+            return;
+        }
+        vec3 new_verts[3];
+        for(int l = 1; l < level; l++) {
+            uint32_t child = (path >> (1 + 2 * l)) & 3;
+            if(l == level - 1) {
+                patch *p = lookup(path & ((1ULL << (1 + 2 * l)) - 1), l, verts);
+                // the same order as the children TerrainTree::subdivide pushes
+                uint32_t corners[3] = {0, 1, 2};
+                if(child) {
+                    uint32_t i = child - 1;
+                    corners[0] = i + 3;
+                    corners[1] = i;
+                    corners[2] = (i + 2) % 3;
+                }
+                for(int i = 0; i < 3; i++) {
+                    elevations[i] = p->elevations[corners[i]] * noise_yscaling;
+                    roughnesses[i] = p->roughnesses[corners[i]];
+                }
+            }
+            TerrainTree::midpoints(verts, new_verts);
+            if(child) {
+                uint32_t i = child - 1;
+                dvec3 corner = verts[i];
+                verts[0] = corner;
+                verts[1] = new_verts[i];
+                verts[2] = new_verts[(i + 2) % 3];
+            } else {
+                for(int i = 0; i < 3; i++) {
+                    verts[i] = new_verts[i];
+                }
+            }
+        }
+    }
+
+    // resolves sample against the node at level under it, like ground_query_service::query
+    void sample(ground_sample *sample, int level) {
+        double b[3];
+        uint64_t path = TerrainTree::root_barycentric(sample->pos, b);
+        for(int l = 1; l < level; l++) {
+            path |= (uint64_t)TerrainTree::descend_barycentric(b) << (1 + 2 * l);
+        }
+        dvec3 verts[3];
+        double elevations[3];
+        double roughnesses[3];
+        node(path, level, verts, elevations, roughnesses);
+        dvec3 corners[3];
+        for(int i = 0; i < 3; i++) {
+            corners[i] = verts[i] * ((radius + elevations[i]) / glm::length(verts[i]));
+        }
+        sample->resolve(corners, radius);
+        sample->roughness = b[0] * roughnesses[0] + b[1] * roughnesses[1] + b[2] * roughnesses[2];
+    }
+
+    // true if a client's claim that pos is altitude above the terrain is within tolerance of the terrain at level
+    bool plausible_altitude(dvec3 pos, double altitude, int level, double tolerance) {
+        ground_sample s;
+        s.pos = pos;
+        sample(&s, level);
+        return fabs(s.altitude - altitude) <= tolerance;
     }
 };
 
@@ -1442,6 +3088,7 @@ struct Celestial {
     std::string name;
     PhysicsObject body;
     TerrainTree terrain;
+    terrain_mesh mesh; // the body's surface as seen from the current zone
     double surface_temp_min;
     double surface_temp_max;
     vec9 radiance;
@@ -1454,21 +3101,30 @@ struct Celestial {
         std::cout << "Celestial " << name << " memcpy copy constructor\n";
     }
 
-    Celestial(uint64_t pseed, double pLOD, std::string pname, double pradius, float proughness, Celestial *pnearest_star) {
+    // with a budget the first mesh is only the most important detail that fits in it, see refine_budget. a coarse
+    // planet that is ready in milliseconds, the rest can be streamed in by later updates.
+    Celestial(uint64_t pseed, double pLOD, std::string pname, double pradius, float proughness, Celestial *pnearest_star,
+            refine_budget *budget = nil) {
         bzero(this, sizeof(Celestial));
         seed = pseed;
         name = pname;
         new(&terrain) TerrainTree(pseed, pLOD, pradius, proughness);
         auto time_begin = now();
         if(verbose) std::cout << "Generating mesh..\n";
-        new(&body) PhysicsObject(terrain.buildMesh(dvec3(0, 6.37101e6, 0), 3, nil), nil);
+        mesh = terrain.buildMesh(dvec3(0, 6.37101e6, 0), 3, nil, budget);
+        new(&body) PhysicsObject(dMesh(), nil);
+        body.radius = pradius + terrain.highest_point;
         auto time_used = std::chrono::duration_cast<std::chrono::microseconds>(now() - time_begin).count();
-        if(verbose) std::cout << "Celestial " << name << ": " << body.mesh.num_tris << " triangles procedurally generated in " << time_used/1000.0 << "ms\n";
+        if(verbose) std::cout << "Celestial " << name << ": " << mesh.num_tris << " triangles procedurally generated in " << time_used/1000.0 << "ms\n";
         if(verbose) std::cout << "Lowest point: " << terrain.lowest_point << ", highest point: " << terrain.highest_point << "\n";
         surface_temp_min = 183.0;
         surface_temp_max = 331.0;
         nearest_star = pnearest_star;
     }
+
+    ~Celestial() {
+        mesh.destroy();
+    }
 };
 
 enum state_update_type {
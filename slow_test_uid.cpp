@@ -4,6 +4,9 @@
 #define CATCH_CONFIG_MAIN
 #include <catch2/catch.hpp>
 #include <iomanip>
+#include <map>
+#include <sstream>
+#include <thread>
 
 TEST_CASE("UID operations work correctly", "[uid]") {
     UID uid;
@@ -117,6 +120,20 @@ TEST_CASE("UIDHashTable operations", "[uid_hash]") {
         REQUIRE(small_table[uid3] == 300);
     }
     
+    SECTION("Batched lookup matches operator[]") {
+        UID keys[100];
+        uint32_t out[100];
+        for(uint64_t i = 0; i < 100; i++) {
+            keys[i].setPID(i); keys[i].setOID(i * 3); keys[i].setIdx(1000 + i);
+            table.insert(keys[i]);
+        }
+        table.lookup_many(keys, 100, out);
+        for(uint64_t i = 0; i < 100; i++) {
+            REQUIRE(out[i] == 1000 + i);
+            REQUIRE(out[i] == table[keys[i]]);
+        }
+    }
+
     SECTION("Clear and resize") {
         UID uid;
         uid.setPID(1); uid.setOID(1); uid.setIdx(100);
@@ -134,6 +151,62 @@ TEST_CASE("UIDHashTable operations", "[uid_hash]") {
         REQUIRE(table[uid] == 100);
     }
 
+    SECTION("Incremental resizing") {
+        UIDHashTable inc_table;
+        inc_table.init(16);
+        inc_table.set_incremental(true);
+        const uint64_t num_keys = 100000;
+        std::vector<bool> removed(num_keys + 1, false);
+        uint64_t num_removed = 0;
+        uint64_t removed_from_old = 0;
+        for(uint64_t i = 1; i <= num_keys; i++) {
+            UID uid;
+            uid.setPID(i); uid.setOID(i * 5); uid.setIdx(i);
+            inc_table.insert(uid);
+            // remove an older key every few inserts, often while it's still waiting in the old array
+            if(i % 3 == 0 && ! removed[i / 2]) {
+                UID old;
+                old.setPID(i / 2); old.setOID((i / 2) * 5);
+                if(inc_table.migrating_slots.capacity && inc_table.find_migrating(old) != inc_table.migrating_slots.capacity)
+                    removed_from_old++;
+                inc_table.remove(old);
+                removed[i / 2] = true;
+                num_removed++;
+            }
+            // keys from both arrays must stay visible during the migration
+            if(i % 97 == 0) {
+                for(uint64_t j = i; j > i - 50; j--) {
+                    if(removed[j])
+                        continue;
+                    UID lookup;
+                    lookup.setPID(j); lookup.setOID(j * 5);
+                    REQUIRE(inc_table[lookup] == j);
+                }
+            }
+        }
+        REQUIRE(removed_from_old > 0);
+        REQUIRE(inc_table.size == num_keys - num_removed);
+        // overwrite every key, none of them may end up in both arrays
+        for(uint64_t i = 1; i <= num_keys; i++) {
+            if(removed[i])
+                continue;
+            UID uid;
+            uid.setPID(i); uid.setOID(i * 5); uid.setIdx(i + 1);
+            inc_table.insert(uid);
+        }
+        REQUIRE(inc_table.size == num_keys - num_removed);
+        inc_table.finish_migration();
+        REQUIRE(inc_table.migrating_slots.capacity == 0);
+        for(uint64_t i = 1; i <= num_keys; i++) {
+            if(removed[i])
+                continue;
+            UID uid;
+            uid.setPID(i); uid.setOID(i * 5);
+            REQUIRE(inc_table[uid] == i + 1);
+        }
+        inc_table.destroy();
+    }
+
     SECTION("Hash function") {
         UID uid1, uid2;
         uid1.setPID(1); uid1.setOID(1);
@@ -271,3 +344,1571 @@ local_table.init(4);
     }
 }
 
+
+TEST_CASE("UIDSwissTable operations", "[uid_swiss]") {
+    UIDSwissTable table;
+    table.init(4);
+
+    SECTION("Capacity is a power of two") {
+        REQUIRE(table.slots.capacity == UID_GROUP_WIDTH);
+        REQUIRE(table.ctrl.capacity == table.slots.capacity);
+        table.reserve(1000);
+        REQUIRE(table.slots.capacity == 1024);
+    }
+
+    SECTION("Basic insertion and lookup") {
+        UID uid1, uid2;
+        uid1.setPID(1); uid1.setOID(1); uid1.setIdx(100);
+        uid2.setPID(2); uid2.setOID(2); uid2.setIdx(200);
+
+        table.insert(uid1);
+        table.insert(uid2);
+        REQUIRE(table.size == 2);
+        REQUIRE(table[uid1] == 100);
+        REQUIRE(table[uid2] == 200);
+
+        UID uid3;
+        uid3.setPID(3); uid3.setOID(3);
+        REQUIRE(table.find(uid3, uid3.hash()) == table.slots.capacity);
+    }
+
+    SECTION("Update existing value") {
+        UID uid;
+        uid.setPID(1); uid.setOID(1); uid.setIdx(100);
+        table.insert(uid);
+        uid.setIdx(200);
+        table.insert(uid);
+        REQUIRE(table.size == 1);
+        REQUIRE(table[uid] == 200);
+    }
+
+    SECTION("Zero key") {
+        UID zero = {0, 0};
+        zero.setIdx(7);
+        table.insert(zero);
+        REQUIRE(table.size == 1);
+        REQUIRE(table[zero] == 7);
+        table.remove(zero);
+        REQUIRE(table.size == 0);
+    }
+
+    SECTION("Removal") {
+        UID uid;
+        uid.setPID(1); uid.setOID(1); uid.setIdx(100);
+        table.insert(uid);
+        table.remove(uid);
+        REQUIRE(table.size == 0);
+        REQUIRE(table.find(uid, uid.hash()) == table.slots.capacity);
+        table.remove(uid); // Should not crash
+    }
+
+    SECTION("Batched lookup matches operator[]") {
+        UID keys[100];
+        uint32_t out[100];
+        for(uint64_t i = 0; i < 100; i++) {
+            keys[i].setPID(i); keys[i].setOID(i * 3); keys[i].setIdx(1000 + i);
+            table.insert(keys[i]);
+        }
+        table.lookup_many(keys, 100, out);
+        for(uint64_t i = 0; i < 100; i++) {
+            REQUIRE(out[i] == 1000 + i);
+            REQUIRE(out[i] == table[keys[i]]);
+        }
+    }
+
+    SECTION("Load factor reaches 7/8 before growing") {
+        size_t capacity = table.slots.capacity;
+        for(uint64_t i = 1; i <= capacity - capacity / 8; i++) {
+            UID uid;
+            uid.setPID(i); uid.setOID(i); uid.setIdx(i);
+            table.insert(uid);
+        }
+        REQUIRE(table.slots.capacity == capacity);
+        UID uid;
+        uid.setPID(capacity); uid.setOID(capacity); uid.setIdx(capacity);
+        table.insert(uid);
+        REQUIRE(table.slots.capacity == capacity * 2);
+        REQUIRE(table[uid] == capacity);
+        for(uint64_t i = 1; i <= capacity - capacity / 8; i++) {
+            UID lookup;
+            lookup.setPID(i); lookup.setOID(i);
+            REQUIRE(table[lookup] == i);
+        }
+    }
+
+    SECTION("Tombstone churn does not grow the table") {
+        // insert and remove a sliding window of keys, the table should recycle tombstones instead of growing
+        const uint64_t window = 64;
+        table.reserve(256);
+        size_t capacity = table.slots.capacity;
+        for(uint64_t i = 1; i < 100000; i++) {
+            UID uid;
+            uid.setPID(i); uid.setOID(i * 7); uid.setIdx(i);
+            table.insert(uid);
+            if(i > window) {
+                UID old;
+                old.setPID(i - window); old.setOID((i - window) * 7);
+                REQUIRE(table[old] == i - window);
+                table.remove(old);
+            }
+        }
+        REQUIRE(table.size == window);
+        REQUIRE(table.slots.capacity == capacity);
+    }
+
+    SECTION("Large-scale operations with pseudorandom UIDs") {
+        uint64_t errors = 0;
+        UIDSwissTable large_table;
+        large_table.init(1024);
+        for(uint64_t epoch = 0; epoch < 4; epoch++) {
+            const int num_operations = 2000000;
+            Prng_xoshiro rng;
+            rng.init(3 ^ epoch, 4 ^ epoch);
+            for (int i = 0; i < num_operations; i++) {
+                UID uid;
+                uid.setPID(rng.get() % 0x0001000000000000);
+                uid.setOID(rng.get() % 0x0001000000000000);
+                uid.setIdx(i);
+                large_table.insert(uid);
+            }
+            rng.init(3 ^ epoch, 4 ^ epoch);
+            for (int i = 0; i < num_operations; i++) {
+                UID uid;
+                uid.setPID(rng.get() % 0x0001000000000000);
+                uid.setOID(rng.get() % 0x0001000000000000);
+                if(large_table[uid] != i)
+                    errors++;
+                large_table.remove(uid);
+            }
+            REQUIRE(large_table.size == 0);
+        }
+        REQUIRE(errors == 0);
+        large_table.destroy();
+    }
+
+    table.destroy();
+}
+
+TEST_CASE("UIDConcurrentTable operations", "[uid_concurrent]") {
+    UIDConcurrentTable table;
+    table.init();
+
+    SECTION("Basic insertion, lookup and removal") {
+        UID uid1, uid2, zero = {0, 0};
+        uid1.setPID(1); uid1.setOID(1); uid1.setIdx(100);
+        uid2.setPID(2); uid2.setOID(2); uid2.setIdx(200);
+        zero.setIdx(300);
+        table.insert(uid1);
+        table.insert(uid2);
+        table.insert(zero);
+        REQUIRE(table.size() == 3);
+        uint32_t idx = 0;
+        REQUIRE(table.find(uid1, &idx));
+        REQUIRE(idx == 100);
+        REQUIRE(table.find(uid2, &idx));
+        REQUIRE(idx == 200);
+        REQUIRE(table.find(zero, &idx));
+        REQUIRE(idx == 300);
+        table.remove(uid1);
+        table.remove(zero);
+        REQUIRE( ! table.find(uid1, &idx));
+        REQUIRE( ! table.find(zero, &idx));
+        REQUIRE(table.size() == 1);
+    }
+
+    SECTION("Readers and writers at the same time") {
+        // readers look up a stable set of keys that must always be found while writers insert and remove their own
+        // keys in the same shards, forcing plenty of resizes and backward shifts under the readers' feet
+        const uint64_t num_stable = 20000;
+        const int num_writers = 2;
+        const int num_readers = 4;
+        for(uint64_t i = 0; i < num_stable; i++) {
+            UID uid;
+            uid.setPID(1); uid.setOID(i); uid.setIdx(i);
+            table.insert(uid);
+        }
+        std::atomic<bool> done = false;
+        std::atomic<uint64_t> errors = 0;
+        std::vector<std::thread> threads;
+        for(int w = 0; w < num_writers; w++) {
+            threads.emplace_back([&table, w]() {
+                for(uint64_t round = 0; round < 5; round++) {
+                    for(uint64_t i = 0; i < 50000; i++) {
+                        UID uid;
+                        uid.setPID(2 + w); uid.setOID(i); uid.setIdx(i ^ round);
+                        table.insert(uid);
+                    }
+                    for(uint64_t i = 0; i < 50000; i++) {
+                        UID uid;
+                        uid.setPID(2 + w); uid.setOID(i);
+                        table.remove(uid);
+                    }
+                }
+            });
+        }
+        for(int r = 0; r < num_readers; r++) {
+            threads.emplace_back([&table, &done, &errors, r, num_stable]() {
+                Prng_xoshiro rng;
+                rng.init(r, 77);
+                while( ! done.load()) {
+                    UID uid;
+                    uint64_t i = rng.get() % num_stable;
+                    uid.setPID(1); uid.setOID(i);
+                    uint32_t idx = 0;
+                    if( ! table.find(uid, &idx) || idx != i)
+                        errors++;
+                }
+            });
+        }
+        for(int w = 0; w < num_writers; w++) {
+            threads[w].join();
+        }
+        done = true;
+        for(int r = 0; r < num_readers; r++) {
+            threads[num_writers + r].join();
+        }
+        REQUIRE(errors == 0);
+        REQUIRE(table.size() == num_stable);
+        table.reclaim();
+        for(uint64_t i = 0; i < num_stable; i++) {
+            UID uid;
+            uid.setPID(1); uid.setOID(i);
+            uint32_t idx = 0;
+            REQUIRE(table.find(uid, &idx));
+            REQUIRE(idx == i);
+        }
+    }
+
+    table.destroy();
+}
+
+struct TestComponent {
+    uint64_t value;
+    double mass;
+    TestComponent(uint64_t pvalue, double pmass) : value(pvalue), mass(pmass) {}
+};
+
+TEST_CASE("EntityRegistry operations", "[entity_registry]") {
+    EntityRegistry<TestComponent> registry;
+    registry.init(4);
+
+    SECTION("Create and look up by UID and handle") {
+        UID uid;
+        uid.setPID(1); uid.setOID(42);
+        EntityHandle h = registry.create(uid, 42, 1.5);
+        REQUIRE(registry.size() == 1);
+        REQUIRE(registry.get(h)->value == 42);
+        REQUIRE(registry[uid].mass == 1.5);
+        REQUIRE(registry.dense_uids[0].getIdx() == h.slot);
+        REQUIRE(registry.handle(uid).slot == h.slot);
+    }
+
+    SECTION("Swap-remove keeps the components dense") {
+        EntityHandle handles[100];
+        for(uint64_t i = 0; i < 100; i++) {
+            UID uid;
+            uid.setPID(1); uid.setOID(i);
+            handles[i] = registry.create(uid, i, (double)i);
+        }
+        for(uint64_t i = 0; i < 100; i += 3) {
+            registry.remove(handles[i]);
+        }
+        REQUIRE(registry.size() == 66);
+        uint64_t sum = 0;
+        for(TestComponent& c : registry) {
+            REQUIRE(c.value % 3 != 0);
+            sum += c.value;
+        }
+        uint64_t expected = 0;
+        for(uint64_t i = 0; i < 100; i++) {
+            if(i % 3 != 0)
+                expected += i;
+        }
+        REQUIRE(sum == expected);
+        for(uint64_t i = 0; i < 100; i++) {
+            UID uid;
+            uid.setPID(1); uid.setOID(i);
+            if(i % 3 == 0) {
+                REQUIRE(registry.get(handles[i]) == nil);
+            } else {
+                REQUIRE(registry.get(handles[i])->value == i);
+                REQUIRE(registry[uid].value == i);
+            }
+        }
+    }
+
+    SECTION("Stale handles are detected after the slot is reused") {
+        UID a, b;
+        a.setPID(1); a.setOID(1);
+        b.setPID(1); b.setOID(2);
+        EntityHandle ha = registry.create(a, 1, 1.0);
+        registry.remove(a);
+        EntityHandle hb = registry.create(b, 2, 2.0);
+        REQUIRE(hb.slot == ha.slot);
+        REQUIRE(hb.generation != ha.generation);
+        REQUIRE( ! registry.alive(ha));
+        REQUIRE(registry.get(ha) == nil);
+        REQUIRE(registry.get(hb)->value == 2);
+        REQUIRE(registry[b].value == 2);
+    }
+
+    registry.destroy();
+}
+
+TEST_CASE("concurrent_mempool operations", "[mempool]") {
+    SECTION("Single thread reuses freed lines") {
+        concurrent_mempool pool;
+        nonstd::vector<cacheline*> lines;
+        for(int i = 0; i < 1000; i++) {
+            cacheline *line = pool.alloc();
+            REQUIRE((uint64_t)line % sizeof(cacheline) == 0);
+            lines.push_back(line);
+        }
+        for(int i = 0; i < 1000; i++) {
+            pool.free(lines[i]);
+        }
+        REQUIRE(pool.chunks.size() == 1);
+        for(int i = 0; i < 1000; i++) {
+            pool.alloc();
+        }
+        REQUIRE(pool.chunks.size() == 1);
+        lines.destroy();
+    }
+
+    SECTION("Threads allocate and free each other's lines") {
+        // every thread stamps the lines it owns and checks the stamp before handing them to the next thread
+        // to free, so a line that is handed out twice at the same time shows up as an error
+        concurrent_mempool pool;
+        const int num_threads = 4;
+        const int rounds = 200;
+        const int per_round = 1000;
+        std::atomic<uint64_t> errors = 0;
+        std::mutex handoff_lock;
+        nonstd::vector<cacheline*> handoff[num_threads];
+        std::vector<std::thread> threads;
+        for(int t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t]() {
+                nonstd::vector<cacheline*> mine;
+                for(int round = 0; round < rounds; round++) {
+                    for(int i = 0; i < per_round; i++) {
+                        cacheline *line = pool.alloc();
+                        line->ptr[0] = (void*)(uint64_t)(t + 1);
+                        line->ptr[1] = (void*)(uint64_t)i;
+                        mine.push_back(line);
+                    }
+                    for(int i = 0; i < per_round; i++) {
+                        if(mine[i]->ptr[0] != (void*)(uint64_t)(t + 1) || mine[i]->ptr[1] != (void*)(uint64_t)i)
+                            errors++;
+                    }
+                    // half are freed here, the other half by the next thread
+                    for(int i = 0; i < per_round / 2; i++) {
+                        pool.free(mine.pop_back());
+                    }
+                    {
+                        std::lock_guard<std::mutex> guard(handoff_lock);
+                        nonstd::vector<cacheline*>& next = handoff[(t + 1) % num_threads];
+                        for(size_t i = 0; i < mine.size(); i++) {
+                            next.push_back(mine[i]);
+                        }
+                        mine.count = 0;
+                        nonstd::vector<cacheline*>& inbox = handoff[t];
+                        for(size_t i = 0; i < inbox.size(); i++) {
+                            inbox[i]->ptr[0] = nil;
+                            pool.free(inbox[i]);
+                        }
+                        inbox.count = 0;
+                    }
+                }
+                mine.destroy();
+            });
+        }
+        for(auto& thread : threads) {
+            thread.join();
+        }
+        REQUIRE(errors == 0);
+        for(int t = 0; t < num_threads; t++) {
+            for(size_t i = 0; i < handoff[t].size(); i++) {
+                pool.free(handoff[t][i]);
+            }
+            handoff[t].destroy();
+        }
+        // the exited threads returned their caches, so every line that was ever carved out is either in the
+        // shared recycler or in this thread's cache
+        uint64_t carved = (pool.chunks.size() - 1) * MEMPOOL_CHUNK_LINES + (pool.chunk_idx ? pool.chunk_idx : MEMPOOL_CHUNK_LINES);
+        REQUIRE(pool.caches.size() == 1);
+        REQUIRE(pool.recycler.size() + pool.cache()->count == carved);
+    }
+
+    SECTION("Short lived pools reuse ids and thread caches") {
+        concurrent_mempool outer;
+        outer.free(outer.alloc());
+        size_t tls_before = mempool_tls.caches.size();
+        uint32_t first_id = MEMPOOL_NO_ID;
+        for(int i = 0; i < 1000; i++) {
+            concurrent_mempool pool;
+            if(i == 0) {
+                first_id = pool.id;
+            }
+            REQUIRE(pool.id == first_id);
+            pool.free(pool.alloc());
+            REQUIRE(pool.caches.size() == 1);
+        }
+        REQUIRE(mempool_tls.caches.size() <= tls_before + 1);
+        outer.free(outer.alloc());
+        REQUIRE(outer.caches.size() == 1);
+    }
+}
+
+TEST_CASE("slab_allocator operations", "[slab]") {
+    slab_allocator slab;
+
+    SECTION("Size classes") {
+        REQUIRE(slab_allocator::size_class(1) == 0);
+        REQUIRE(slab_allocator::size_class(16) == 0);
+        REQUIRE(slab_allocator::size_class(17) == 1);
+        REQUIRE(slab_allocator::size_class(64) == 2);
+        REQUIRE(slab_allocator::size_class(65536) == SLAB_NUM_CLASSES - 1);
+        REQUIRE(slab_allocator::size_class(65537) == -1);
+    }
+
+    SECTION("Blocks are aligned, distinct and reused") {
+        nonstd::vector<uint64_t*> blocks;
+        for(int i = 0; i < 1000; i++) {
+            uint64_t *block = slab.alloc<uint64_t>(8);
+            REQUIRE((uint64_t)block % 64 == 0);
+            for(int j = 0; j < 8; j++) {
+                block[j] = i;
+            }
+            blocks.push_back(block);
+        }
+        for(int i = 0; i < 1000; i++) {
+            for(int j = 0; j < 8; j++) {
+                REQUIRE(blocks[i][j] == i);
+            }
+        }
+        slab_stats stats = slab.stats(slab_allocator::size_class(64));
+        REQUIRE(stats.allocs == 1000);
+        REQUIRE(stats.live == 1000);
+        REQUIRE(stats.slabs == 1);
+        uint64_t *last = blocks.back();
+        for(int i = 0; i < 1000; i++) {
+            slab.free(blocks[i], 8);
+        }
+        REQUIRE(slab.stats(slab_allocator::size_class(64)).live == 0);
+        REQUIRE(slab.stats(slab_allocator::size_class(64)).peak == 1000);
+        REQUIRE(slab.alloc<uint64_t>(8) == last);
+        blocks.destroy();
+    }
+
+    SECTION("Realloc keeps the contents across size classes") {
+        uint32_t *data = slab.alloc<uint32_t>(4);
+        for(uint32_t i = 0; i < 4; i++) {
+            data[i] = i;
+        }
+        REQUIRE(slab.realloc(data, 4, 3) == data);
+        data = slab.realloc(data, 4, 100000);
+        for(uint32_t i = 0; i < 4; i++) {
+            REQUIRE(data[i] == i);
+        }
+        REQUIRE(slab.large_allocs == 1);
+        data = slab.realloc(data, 100000, 8);
+        for(uint32_t i = 0; i < 4; i++) {
+            REQUIRE(data[i] == i);
+        }
+        REQUIRE(slab.large_frees == 1);
+        slab.free(data, 8);
+    }
+
+    SECTION("Vector backed by slab_pool") {
+        nonstd::vector<uint64_t, slab_alloc> v;
+        for(uint64_t i = 0; i < 100000; i++) {
+            v.push_back(i);
+        }
+        for(uint64_t i = 0; i < 100000; i++) {
+            REQUIRE(v[i] == i);
+        }
+        nonstd::vector<uint64_t, slab_alloc> c = v.copy();
+        v.destroy();
+        REQUIRE(c[99999] == 99999);
+        c.destroy();
+    }
+
+    slab.destroy();
+}
+
+TEST_CASE("frame_arena operations", "[arena]") {
+    frame_arena arena;
+    arena.init(1024);
+
+    SECTION("Allocations are aligned and reset reuses the memory") {
+        uint8_t *a = (uint8_t*)arena.alloc(3);
+        uint8_t *b = (uint8_t*)arena.alloc(40);
+        REQUIRE((uint64_t)a % 16 == 0);
+        REQUIRE((uint64_t)b % 16 == 0);
+        REQUIRE(b == a + 16);
+        arena.reset();
+        REQUIRE(arena.alloc(8) == a);
+    }
+
+    SECTION("Overflow goes to malloc and the next reset grows the arena") {
+        for(int i = 0; i < 10; i++) {
+            memset(arena.alloc(512), i, 512);
+        }
+        REQUIRE(arena.overflow.size() == 8);
+        REQUIRE(arena.high_water == 5120);
+        arena.reset();
+        REQUIRE(arena.overflow.size() == 0);
+        REQUIRE(arena.capacity >= 5120);
+        for(int i = 0; i < 10; i++) {
+            arena.alloc(512);
+        }
+        REQUIRE(arena.overflow.size() == 0);
+    }
+
+    SECTION("Vector grows in place while it is the last allocation") {
+        nonstd::arena_vector<uint32_t> v(arena_alloc{&arena});
+        REQUIRE(sizeof(nonstd::vector<uint32_t>) == 3 * sizeof(size_t));
+        v.push_back(0);
+        uint32_t *first = v.data;
+        for(uint32_t i = 1; i < 200; i++) {
+            v.push_back(i);
+        }
+        REQUIRE(v.data == first);
+        for(uint32_t i = 0; i < 200; i++) {
+            REQUIRE(v[i] == i);
+        }
+        // something else was allocated after it, now growing has to move
+        arena.alloc(16);
+        for(uint32_t i = 200; i < 2000; i++) {
+            v.push_back(i);
+        }
+        REQUIRE(v.data != first);
+        for(uint32_t i = 0; i < 2000; i++) {
+            REQUIRE(v[i] == i);
+        }
+        v.destroy();
+        REQUIRE(v.alloc.arena == &arena);
+    }
+
+    arena.destroy();
+}
+
+TEST_CASE("Memory telemetry", "[telemetry]") {
+    SECTION("Tagged vectors count live and peak bytes") {
+        int64_t live_before = memory_telemetry[TAG_PHYSICS].live;
+        uint64_t allocs_before = memory_telemetry[TAG_PHYSICS].allocs;
+        nonstd::vector<uint64_t, tagged_alloc<TAG_PHYSICS>> v;
+        for(uint64_t i = 0; i < 1000; i++) {
+            v.push_back(i);
+        }
+        REQUIRE(memory_telemetry[TAG_PHYSICS].live == live_before + (int64_t)(v.capacity * sizeof(uint64_t)));
+        REQUIRE(memory_telemetry[TAG_PHYSICS].peak >= live_before + (int64_t)(v.capacity * sizeof(uint64_t)));
+        REQUIRE(memory_telemetry[TAG_PHYSICS].allocs > allocs_before);
+        v.destroy();
+        REQUIRE(memory_telemetry[TAG_PHYSICS].live == live_before);
+        std::stringstream out;
+        telemetry_snapshot snapshot;
+        dump_memory_telemetry(out, &snapshot);
+        REQUIRE(out.str().find("physics") != std::string::npos);
+    }
+
+    SECTION("Terrain vegetation is freed exactly once across copies") {
+        TerrainTree tree(52, 10.0, 6.371e6, 1.0);
+        int64_t live_before = memory_telemetry[TAG_VEGETATION].live;
+        for(size_t i = 0; i < tree.nodes.size(); i++) {
+            for(int j = 0; j < 36; j++) {
+                tree.nodes[i].vegetation.push_back(vegetation_instance());
+            }
+        }
+        int64_t live_with_trees = memory_telemetry[TAG_VEGETATION].live;
+        REQUIRE(live_with_trees > live_before);
+        TerrainTree copy = tree.copy();
+        for(size_t i = 0; i < tree.nodes.size(); i++) {
+            REQUIRE(tree.nodes[i].vegetation.count == 0);
+            REQUIRE(copy.nodes[i].vegetation.count == 36);
+        }
+        tree.destroy();
+        REQUIRE(memory_telemetry[TAG_VEGETATION].live == live_with_trees);
+        TerrainTree omitted = copy.omitting_copy(0);
+        copy.destroy();
+        REQUIRE(memory_telemetry[TAG_VEGETATION].live == live_with_trees);
+        omitted.destroy();
+        REQUIRE(memory_telemetry[TAG_VEGETATION].live == live_before);
+        delete tree.generator;
+    }
+}
+
+TEST_CASE("Indexed terrain mesh", "[terrain]") {
+    TerrainTree tree(52, 2.0, 6.371e6, 1.0);
+    dvec3 vantage = dvec3(0.0, 6.371e6, 0.0);
+    // the horizon moves with the highest point found so far, both builds have to refine the same nodes
+    tree.horizon_culling = false;
+    tree.indexed_mesh = false;
+    terrain_mesh flat = tree.buildMesh(vantage, 3, nil);
+    tree.indexed_mesh = true;
+    terrain_mesh indexed = tree.buildMesh(vantage, 3, nil);
+
+    REQUIRE(flat.num_tris == indexed.num_tris);
+    REQUIRE(flat.num_verts == flat.num_tris * 3);
+    REQUIRE(indexed.num_verts * 2 < flat.num_verts);
+    // where leaves of different levels meet, the shared vertex is the one of the finest of them
+    std::vector<uint32_t> tri_level(indexed.num_tris, 0);
+    for(ttnode &n : tree.nodes) {
+        if(n.rendered_at_level && ! n.first_child) {
+            tri_level[n.triangle] = n.rendered_at_level;
+        }
+    }
+    std::vector<uint32_t> finest(indexed.num_verts, 0);
+    for(uint32_t i = 0; i < indexed.num_tris; i++) {
+        REQUIRE(tri_level[i] > 0);
+        for(int j = 0; j < 3; j++) {
+            REQUIRE(indexed.tris[i].verts[j] < indexed.num_verts);
+            finest[indexed.tris[i].verts[j]] = std::max(finest[indexed.tris[i].verts[j]], tri_level[i]);
+        }
+    }
+    for(uint32_t i = 0; i < flat.num_tris; i++) {
+        for(int j = 0; j < 3; j++) {
+            if(tri_level[i] == finest[indexed.tris[i].verts[j]]) {
+                REQUIRE(flat.verts[flat.tris[i].verts[j]].pos == indexed.verts[indexed.tris[i].verts[j]].pos);
+                REQUIRE(flat.verts[flat.tris[i].verts[j]].elevation == indexed.verts[indexed.tris[i].verts[j]].elevation);
+            }
+        }
+    }
+    // vertices are created in the order the triangles first use them, the chunked upload relies on it
+    uint32_t next_new = 0;
+    for(uint32_t i = 0; i < indexed.num_tris; i++) {
+        for(int j = 0; j < 3; j++) {
+            if(indexed.tris[i].verts[j] >= next_new) {
+                REQUIRE(indexed.tris[i].verts[j] == next_new);
+                next_new++;
+            }
+        }
+    }
+    REQUIRE(next_new == indexed.num_verts);
+
+    flat.destroy();
+    indexed.destroy();
+    tree.destroy();
+    delete tree.generator;
+}
+
+TEST_CASE("Terrain vertex preparation", "[terrain]") {
+    TerrainTree tree(52, 2.0, 6.371e6, 1.0);
+    dvec3 vantage = dvec3(0.0, 6.371e6, 0.0);
+    for(bool indexed : {false, true}) {
+        tree.indexed_mesh = indexed;
+        terrain_mesh mesh = tree.buildMesh(vantage, 3, nil);
+        std::vector<texvert> whole(mesh.num_verts, texvert(glm::vec3(0.0f), 0, glm::vec3(0.0f)));
+        std::vector<uint32_t> whole_indices(mesh.num_tris * 3);
+        REQUIRE(prepare_terrain_vertices(&mesh, 0, mesh.num_tris, 0, whole.data(), whole_indices.data()) == mesh.num_verts);
+        std::vector<bool> seen(mesh.num_verts, false);
+        for(uint32_t i = 0; i < mesh.num_tris; i++) {
+            for(int j = 0; j < 3; j++) {
+                uint32_t v = whole_indices[i * 3 + j];
+                REQUIRE(v == mesh.tris[i].verts[j]);
+                REQUIRE(glm::vec3(whole[v].xyz) == mesh.verts[v].pos);
+                // a shared vertex has the type of the first triangle that uses it
+                if( ! seen[v]) {
+                    REQUIRE(*(int32_t*)&whole[v].xyz.w == mesh.tris[i].type_id);
+                    seen[v] = true;
+                }
+            }
+        }
+        // the upload ring prepares it a batch at a time and has to end up with the same buffers
+        std::vector<texvert> batched(mesh.num_verts, texvert(glm::vec3(0.0f), 0, glm::vec3(0.0f)));
+        std::vector<uint32_t> batched_indices(mesh.num_tris * 3);
+        uint32_t num_verts = 0;
+        for(uint32_t first = 0; first < mesh.num_tris; first += 97) {
+            uint32_t n = min(mesh.num_tris - first, 97u);
+            num_verts += prepare_terrain_vertices(&mesh, first, n, num_verts, &batched[num_verts], &batched_indices[first * 3]);
+        }
+        REQUIRE(num_verts == mesh.num_verts);
+        REQUIRE(memcmp(batched.data(), whole.data(), num_verts * sizeof(texvert)) == 0);
+        REQUIRE(batched_indices == whole_indices);
+        mesh.destroy();
+    }
+    tree.destroy();
+    delete tree.generator;
+}
+
+TEST_CASE("Compact terrain mesh", "[terrain]") {
+    REQUIRE(sizeof(terrain_vert) == 16);
+    REQUIRE(sizeof(terrain_tri) == 20);
+
+    SECTION("octahedral normals") {
+        Prng_xoshiro rng;
+        rng.init(0, 52);
+        glm::vec3 axes[6] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+        for(int i = 0; i < 10006; i++) {
+            glm::vec3 n = i < 6 ? axes[i] : glm::normalize(glm::vec3(
+                        rng.uniform() - 0.5, rng.uniform() - 0.5, rng.uniform() - 0.5));
+            int16_t packed[2];
+            oct_encode(n, packed);
+            REQUIRE(glm::dot(oct_decode(packed), n) > 0.99999f);
+        }
+    }
+
+    SECTION("buildMesh output") {
+        TerrainTree tree(52, 2.0, 6.371e6, 1.0);
+        dvec3 vantage = dvec3(0.0, 6.371e6, 0.0);
+        terrain_mesh mesh = tree.buildMesh(vantage, 3, nil);
+        REQUIRE(mesh.num_tris > 0);
+        std::vector<uint32_t> finest(mesh.num_verts, 0);
+        for(ttnode &n : tree.nodes) {
+            if(n.rendered_at_level && ! n.first_child) {
+                for(int j = 0; j < 3; j++) {
+                    uint32_t v = mesh.tris[n.triangle].verts[j];
+                    finest[v] = std::max(finest[v], n.rendered_at_level);
+                }
+            }
+        }
+        for(uint32_t i = 0; i < tree.nodes.size(); i++) {
+            ttnode &n = tree.nodes[i];
+            if(n.rendered_at_level == 0 || n.first_child) {
+                continue;
+            }
+            terrain_tri &t = mesh.tris[n.triangle];
+            REQUIRE(glm::dot(t.up(), glm::vec3(normalize(n.verts[0]))) > 0.99999f);
+            for(int j = 0; j < 3; j++) {
+                if(n.rendered_at_level == finest[t.verts[j]]) {
+                    REQUIRE(mesh.verts[t.verts[j]].elevation == (float)n.elevations[j]);
+                }
+                REQUIRE(fabsf(t.foliage(j) - n.foliage_density[j]) <= 0.5f / 255.0f + 1e-6f);
+            }
+        }
+        mesh.destroy();
+        tree.destroy();
+        delete tree.generator;
+    }
+}
+
+TEST_CASE("Terrain culling", "[terrain]") {
+    dvec3 vantage = dvec3(0.0, 6.371e6, 0.0);
+
+    SECTION("horizon") {
+        TerrainTree all(52, 5.0, 6.371e6, 1.0);
+        all.horizon_culling = false;
+        terrain_mesh all_mesh = all.buildMesh(vantage, 3, nil);
+        TerrainTree culled(52, 5.0, 6.371e6, 1.0);
+        // start from the final bounds so the horizon doesn't move while the tree is built
+        culled.highest_point = all.highest_point;
+        culled.lowest_point = all.lowest_point;
+        terrain_mesh culled_mesh = culled.buildMesh(vantage, 3, nil);
+        REQUIRE(culled_mesh.num_tris < all_mesh.num_tris);
+        REQUIRE(culled[vantage]->rendered_at_level == all[vantage]->rendered_at_level);
+        // everything above the horizon is refined exactly as far as it would be without culling
+        uint64_t visible = 0;
+        for(uint32_t i = 0; i < culled.nodes.size(); i++) {
+            ttnode &n = culled.nodes[i];
+            // every leaf of a freshly built tree was rendered
+            if(n.first_child || culled.below_horizon(vantage, i)) {
+                continue;
+            }
+            visible++;
+            REQUIRE(all[n.path]->rendered_at_level == n.rendered_at_level);
+        }
+        REQUIRE(visible > 0);
+        all_mesh.destroy();
+        culled_mesh.destroy();
+        all.destroy();
+        culled.destroy();
+        delete all.generator;
+        delete culled.generator;
+    }
+
+    SECTION("frustum") {
+        // the identity view-projection sees the cube from -1 to 1
+        view_frustum f = view_frustum::from_matrix(glm::dmat4(1.0));
+        REQUIRE( ! f.sphere_outside(dvec3(0.0, 0.0, 0.0), 0.1));
+        REQUIRE( ! f.sphere_outside(dvec3(1.5, 0.0, 0.0), 1.0));
+        REQUIRE(f.sphere_outside(dvec3(2.5, 0.0, 0.0), 1.0));
+        REQUIRE(f.sphere_outside(dvec3(0.0, 0.0, -3.0), 1.0));
+
+        TerrainTree all(52, 5.0, 6.371e6, 1.0);
+        terrain_mesh all_mesh = all.buildMesh(vantage, 3, nil);
+        TerrainTree culled(52, 5.0, 6.371e6, 1.0);
+        culled.frustum_culling = true;
+        // looking along +z from the vantage point with a 90 degree field of view
+        double s = sqrt(0.5);
+        culled.frustum.planes[0] = glm::dvec4(s, 0.0, s, 0.0);
+        culled.frustum.planes[1] = glm::dvec4(-s, 0.0, s, 0.0);
+        culled.frustum.planes[2] = glm::dvec4(0.0, s, s, 0.0);
+        culled.frustum.planes[3] = glm::dvec4(0.0, -s, s, 0.0);
+        culled.frustum.planes[4] = glm::dvec4(0.0, 0.0, 1.0, 1.0);
+        culled.frustum.planes[5] = glm::dvec4(0.0, 0.0, -1.0, 1e9);
+        terrain_mesh culled_mesh = culled.buildMesh(vantage, 3, nil);
+        REQUIRE(culled_mesh.num_tris < all_mesh.num_tris);
+        REQUIRE(culled[vantage]->rendered_at_level == all[vantage]->rendered_at_level);
+        all_mesh.destroy();
+        culled_mesh.destroy();
+        all.destroy();
+        culled.destroy();
+        delete all.generator;
+        delete culled.generator;
+    }
+}
+
+TEST_CASE("Budgeted terrain refinement", "[terrain]") {
+    dvec3 vantage = dvec3(0.0, 6.371e6, 0.0);
+    // the horizon moves while a fresh tree is built and would make the two orders cull differently
+    TerrainTree whole(52, 5.0, 6.371e6, 1.0);
+    whole.horizon_culling = false;
+    terrain_mesh whole_mesh = whole.buildMesh(vantage, 3, nil);
+
+    SECTION("unlimited budget matches the depth first build") {
+        TerrainTree tree(52, 5.0, 6.371e6, 1.0);
+        tree.horizon_culling = false;
+        refine_budget budget = {0.0, 0, false};
+        terrain_mesh mesh = tree.buildMesh(vantage, 3, nil, &budget);
+        REQUIRE( ! budget.exhausted);
+        REQUIRE(mesh.num_tris == whole_mesh.num_tris);
+        REQUIRE(tree[vantage]->rendered_at_level == whole[vantage]->rendered_at_level);
+        mesh.destroy();
+        tree.destroy();
+        delete tree.generator;
+    }
+
+    SECTION("triangle budget") {
+        TerrainTree tree(52, 5.0, 6.371e6, 1.0);
+        refine_budget budget = {0.0, whole_mesh.num_tris / 4, false};
+        terrain_mesh mesh = tree.buildMesh(vantage, 3, nil, &budget);
+        REQUIRE(budget.exhausted);
+        REQUIRE(mesh.num_tris <= budget.max_tris);
+        REQUIRE(mesh.num_tris > budget.max_tris - 4);
+        // the detail under the vantage point goes first
+        REQUIRE(tree[vantage]->rendered_at_level == whole[vantage]->rendered_at_level);
+        // the next update continues from the nodes that already exist
+        size_t nodes_before = tree.nodes.size();
+        budget = {0.0, whole_mesh.num_tris / 2, false};
+        terrain_mesh more = tree.buildMesh(vantage, 3, nil, &budget);
+        REQUIRE(more.num_tris > mesh.num_tris);
+        REQUIRE(tree.nodes.size() > nodes_before);
+        REQUIRE(budget.new_nodes == tree.nodes.size() - nodes_before);
+        // the same budget again has nowhere left to go, the caller can stop asking
+        terrain_mesh same = tree.buildMesh(vantage, 3, nil, &budget);
+        REQUIRE(budget.exhausted);
+        REQUIRE(budget.new_nodes == 0);
+        REQUIRE(same.num_tris == more.num_tris);
+        same.destroy();
+        more.destroy();
+        mesh.destroy();
+        tree.destroy();
+        delete tree.generator;
+    }
+
+    SECTION("time budget") {
+        TerrainTree tree(52, 5.0, 6.371e6, 1.0);
+        refine_budget budget = {0.001, 0, false};
+        terrain_mesh mesh = tree.buildMesh(vantage, 3, nil, &budget);
+        REQUIRE(budget.exhausted);
+        REQUIRE(mesh.num_tris > 0);
+        REQUIRE(mesh.num_tris < whole_mesh.num_tris);
+        mesh.destroy();
+        tree.destroy();
+        delete tree.generator;
+    }
+
+    whole_mesh.destroy();
+    whole.destroy();
+    delete whole.generator;
+}
+
+TEST_CASE("Progressive startup", "[terrain]") {
+    // the first mesh costs the same whatever the lod, and the normal updates pick up from it
+    for(double lod : {1.0, 50.0}) {
+        refine_budget boot = {0.0, 4096, false};
+        Celestial planet(52, lod, "boot", 6.371e6, 0.2, nil, &boot);
+        REQUIRE(boot.exhausted == (lod > 1.0));
+        REQUIRE(planet.mesh.num_tris > 0);
+        REQUIRE(planet.mesh.num_tris <= boot.max_tris);
+        REQUIRE(planet.terrain.nodes.size() < 2 * boot.max_tris);
+
+        TerrainTree next = planet.terrain.copy();
+        next.LOD_DISTANCE_SCALE = 50.0;
+        refine_budget budget = {0.0, boot.max_tris * 4, false};
+        terrain_mesh refined = next.buildMesh(dvec3(0.0, 6.371e6, 0.0), 3, nil, &budget);
+        REQUIRE(refined.num_tris > planet.mesh.num_tris);
+        REQUIRE(next.nodes.size() > planet.terrain.nodes.size());
+        refined.destroy();
+        next.destroy();
+        planet.terrain.destroy();
+        delete planet.terrain.generator;
+    }
+}
+
+TEST_CASE("Terrain prefetch", "[terrain]") {
+    SECTION("trajectory") {
+        trajectory_tracker t;
+        for(int i = 0; i <= 100; i++) {
+            t.update(dvec3(0.0, 0.0, 100.0 * i * 0.01), i * 0.01);
+        }
+        REQUIRE(glm::length(t.vel - dvec3(0.0, 0.0, 100.0)) < 1e-6);
+        REQUIRE(glm::length(t.predict(2.0) - dvec3(0.0, 0.0, 300.0)) < 1e-6);
+    }
+
+    SECTION("prefetched detail is in the tree when we get there") {
+        dvec3 here = dvec3(0.0, 6.371e6, 0.0);
+        dvec3 there = glm::normalize(dvec3(0.0, 6.371e6, 2e5)) * 6.371e6;
+        TerrainTree tree(52, 5.0, 6.371e6, 1.0);
+        terrain_mesh mesh = tree.buildMesh(here, 3, nil);
+        mesh.destroy();
+        REQUIRE(tree[there]->rendered_at_level < 20);
+
+        refine_budget budget = {0.0, 0, false};
+        tree.prefetch(&there, 1, 3, &budget, nil);
+        REQUIRE( ! budget.exhausted);
+        size_t nodes_prefetched = tree.nodes.size();
+        // no new nodes are needed to build the mesh from there
+        mesh = tree.buildMesh(there, 3, nil);
+        REQUIRE(tree.nodes.size() == nodes_prefetched);
+        REQUIRE(tree[there]->rendered_at_level == 20);
+        mesh.destroy();
+        tree.destroy();
+        delete tree.generator;
+    }
+}
+
+TEST_CASE("Terrain point lookup", "[terrain]") {
+    TerrainTree tree(52, 5.0, 6.371e6, 1.0);
+    terrain_mesh mesh = tree.buildMesh(dvec3(0.0, 6.371e6, 0.0), 3, nil);
+    mesh.destroy();
+
+    Prng_xoshiro rng;
+    rng.init(0, 52);
+    const size_t n = 20000;
+    nonstd::vector<dvec3> positions;
+    for(size_t i = 0; i < n; i++) {
+        dvec3 dir = dvec3(rng.uniform() - 0.5, rng.uniform() - 0.5, rng.uniform() - 0.5);
+        // half of them near the vantage point where the tree is deep
+        if(i & 1) {
+            dir = dvec3(0.0, 1.0, 0.0) + dir * 1e-4;
+        }
+        positions.push_back(dir * 6.371e6);
+    }
+    nonstd::vector<ttnode*> batched;
+    for(size_t i = 0; i < n; i++) {
+        batched.push_back(nil);
+    }
+    tree.lookup(positions.data, n, batched.data);
+
+    for(size_t i = 0; i < n; i++) {
+        ttnode *node = tree[positions[i]];
+        REQUIRE(node == batched[i]);
+        REQUIRE(node->first_child == 0);
+        // the node's triangle contains the position projected onto the node space octahedron, give or take the
+        // rounding of the node corners to float when they were created
+        dvec3 p = positions[i];
+        p *= tree.radius / (abs(p.x) + abs(p.y) + abs(p.z));
+        dvec3 normal = glm::cross(node->verts[1] - node->verts[0], node->verts[2] - node->verts[0]);
+        double area = glm::dot(normal, normal);
+        for(int j = 0; j < 3; j++) {
+            dvec3 a = node->verts[j];
+            dvec3 b = node->verts[(j + 1) % 3];
+            double bary = glm::dot(glm::cross(b - a, p - a), normal) / area;
+            REQUIRE(bary * glm::length(b - a) > -1.0);
+        }
+    }
+    REQUIRE(tree[dvec3(0.0)] == nil);
+
+    positions.destroy();
+    batched.destroy();
+    tree.destroy();
+    delete tree.generator;
+}
+
+TEST_CASE("Ground height queries", "[terrain]") {
+    const double radius = 6.371e6;
+    dvec3 vantage = dvec3(0.0, radius, 0.0);
+    ground_query_service ground;
+    ground.init(52, radius, 1.0, 1 << 20);
+
+    Prng_xoshiro rng;
+    rng.init(0, 52);
+    const size_t n = 2000;
+    nonstd::vector<ground_sample> samples;
+    for(size_t i = 0; i < n; i++) {
+        ground_sample &s = samples.emplace_back();
+        s.pos = vantage + dvec3(rng.uniform() - 0.5, rng.uniform() - 0.5, rng.uniform() - 0.5) * 2000.0;
+    }
+
+    SECTION("matches the rendered terrain at the same level") {
+        TerrainTree tree(52, 5.0, radius, 1.0);
+        terrain_mesh mesh = tree.buildMesh(vantage, 3, nil);
+        for(size_t i = 0; i < n; i++) {
+            ttnode *node = tree[samples[i].pos];
+            ground.query(&samples[i], 1, node->rendered_at_level);
+            dvec3 corners[3];
+            for(int j = 0; j < 3; j++) {
+                corners[j] = node->globalPosition(radius, j);
+            }
+            dvec3 normal = glm::normalize(glm::cross(corners[1] - corners[0], corners[2] - corners[0]));
+            dvec3 dir = glm::normalize(samples[i].pos);
+            double ground_distance = glm::dot(normal, corners[0]) / glm::dot(normal, dir);
+            REQUIRE(fabs(samples[i].elevation - (ground_distance - radius)) < 1e-3);
+            REQUIRE(fabs(samples[i].altitude - (glm::length(samples[i].pos) - ground_distance)) < 1e-3);
+            REQUIRE(glm::dot(samples[i].normal, dir) > 0.0);
+        }
+        mesh.destroy();
+        tree.destroy();
+        delete tree.generator;
+    }
+
+    SECTION("batches and threads agree with single queries") {
+        nonstd::vector<ground_sample> single = samples.copy();
+        for(size_t i = 0; i < n; i++) {
+            ground.query(&single[i], 1, 20);
+        }
+        ground.destroy();
+        ground.init(52, radius, 1.0, 1 << 20);
+        const int num_threads = 4;
+        nonstd::vector<ground_sample> batched[num_threads];
+        std::vector<std::thread> threads;
+        for(int t = 0; t < num_threads; t++) {
+            batched[t] = samples.copy();
+            threads.emplace_back([&ground, &batched, t, n]() {
+                ground.query(batched[t].data, n, 20);
+            });
+        }
+        for(auto &thread : threads) {
+            thread.join();
+        }
+        for(int t = 0; t < num_threads; t++) {
+            for(size_t i = 0; i < n; i++) {
+                REQUIRE(batched[t][i].elevation == single[i].elevation);
+                REQUIRE(batched[t][i].altitude == single[i].altitude);
+                REQUIRE(batched[t][i].roughness == single[i].roughness);
+            }
+            batched[t].destroy();
+        }
+        single.destroy();
+    }
+
+    SECTION("eviction") {
+        ground.destroy();
+        ground.init(52, radius, 1.0, 1000);
+        nonstd::vector<ground_sample> before = samples.copy();
+        ground.query(before.data, n, 20);
+        REQUIRE(ground.tree.nodes.size() <= 1000);
+        ground_sample far = samples[0];
+        far.pos = dvec3(radius, 0.0, 0.0);
+        ground.query(&far, 1, 20);
+        ground.query(samples.data, n, 20);
+        for(size_t i = 0; i < n; i++) {
+            REQUIRE(samples[i].elevation == before[i].elevation);
+        }
+        before.destroy();
+    }
+
+    samples.destroy();
+    ground.destroy();
+}
+
+TEST_CASE("Terrain oracle", "[terrain]") {
+    const double radius = 6.371e6;
+    dvec3 vantage = dvec3(0.0, radius, 0.0);
+    terrain_oracle oracle;
+    oracle.init(52, radius, 1.0, 64);
+
+    SECTION("every node matches the tree") {
+        TerrainTree tree(52, 5.0, radius, 1.0);
+        terrain_mesh mesh = tree.buildMesh(vantage, 3, nil);
+        size_t checked = 0;
+        std::function<void(uint32_t, uint64_t, int)> visit = [&](uint32_t idx, uint64_t path, int level) {
+            dvec3 verts[3];
+            double elevations[3];
+            double roughnesses[3];
+            oracle.node(path, level, verts, elevations, roughnesses);
+            for(int i = 0; i < 3; i++) {
+                REQUIRE(verts[i] == tree.nodes[idx].verts[i]);
+                REQUIRE(elevations[i] == tree.nodes[idx].elevations[i]);
+                REQUIRE(roughnesses[i] == tree.nodes[idx].roughnesses[i]);
+            }
+            checked++;
+            if(tree.nodes[idx].first_child) {
+                for(uint64_t c = 0; c < 4; c++) {
+                    visit(tree.nodes[idx].first_child + c, path | (c << (1 + 2 * level)), level + 1);
+                }
+            }
+        };
+        for(uint32_t i = 0; i < 8; i++) {
+            visit(i, i, 1);
+        }
+        REQUIRE(checked == tree.nodes.size());
+        REQUIRE(oracle.hits > 0);
+        mesh.destroy();
+        tree.destroy();
+        delete tree.generator;
+    }
+
+    SECTION("agrees with ground queries") {
+        ground_query_service ground;
+        ground.init(52, radius, 1.0, 1 << 20);
+        Prng_xoshiro rng;
+        rng.init(0, 52);
+        for(int i = 0; i < 500; i++) {
+            ground_sample a;
+            a.pos = vantage + dvec3(rng.uniform() - 0.5, rng.uniform() - 0.5, rng.uniform() - 0.5) * 2000.0;
+            ground_sample b = a;
+            ground.query(&a, 1, 20);
+            oracle.sample(&b, 20);
+            REQUIRE(b.elevation == a.elevation);
+            REQUIRE(b.altitude == a.altitude);
+            REQUIRE(b.roughness == a.roughness);
+            REQUIRE(oracle.plausible_altitude(a.pos, a.altitude + 0.5, 20, 1.0));
+            REQUIRE( ! oracle.plausible_altitude(a.pos, a.altitude + 5.0, 20, 1.0));
+        }
+        ground.destroy();
+    }
+
+    oracle.destroy();
+}
+
+TEST_CASE("Octave truncation", "[terrain]") {
+    SECTION("resolvable octaves") {
+        REQUIRE(TerrainGenerator::resolvable_octaves(1e9) == 1);
+        REQUIRE(TerrainGenerator::resolvable_octaves(2.0) == 1);
+        REQUIRE(TerrainGenerator::resolvable_octaves(1.0) == 2);
+        REQUIRE(TerrainGenerator::resolvable_octaves(0.9) == 2);
+        REQUIRE(TerrainGenerator::resolvable_octaves(0.25) == 4);
+        REQUIRE(TerrainGenerator::resolvable_octaves(1e-9) == TerrainGenerator::MAX_OCTAVES);
+        for(double width = 4.0; width > 1e-6; width *= 0.7) {
+            REQUIRE(TerrainGenerator::resolvable_octaves(width) <= TerrainGenerator::resolvable_octaves(width * 0.7));
+        }
+    }
+
+    SECTION("truncated noise is the coarse part of the full noise") {
+        TerrainGenerator generator(52, 1.0);
+        Prng_xoshiro rng;
+        rng.init(0, 52);
+        const int n = 200;
+        float full[n][12];
+        float truncated[TerrainGenerator::MAX_OCTAVES + 1][n][12];
+        for(int i = 0; i < n; i++) {
+            vec3 positions[12];
+            for(int j = 0; j < 12; j++) {
+                positions[j] = vec3(rng.uniform(), rng.uniform(), rng.uniform()) * 100.0f;
+            }
+            float roughnesses[12];
+            int all[2] = {TerrainGenerator::MAX_OCTAVES, TerrainGenerator::MAX_OCTAVES};
+            generator.getMultiple(full[i], roughnesses, positions, 12, 0.2, all);
+            for(int octaves = 0; octaves <= TerrainGenerator::MAX_OCTAVES; octaves++) {
+                int counts[2] = {octaves, octaves};
+                generator.getMultiple(truncated[octaves][i], roughnesses, positions, 12, 0.2, counts);
+            }
+        }
+        double error[TerrainGenerator::MAX_OCTAVES + 1] = {};
+        for(int octaves = 0; octaves <= TerrainGenerator::MAX_OCTAVES; octaves++) {
+            for(int i = 0; i < n; i++) {
+                for(int j = 0; j < 12; j++) {
+                    if( ! octaves) {
+                        REQUIRE(truncated[octaves][i][j] == 0.0f);
+                    }
+                    error[octaves] += fabs(truncated[octaves][i][j] - full[i][j]);
+                }
+            }
+        }
+        REQUIRE(error[TerrainGenerator::MAX_OCTAVES] == 0.0);
+        REQUIRE(error[8] < error[4]);
+        REQUIRE(error[4] < error[1]);
+    }
+
+    SECTION("coarse levels keep the large features") {
+        // an Earth sized planet is wider than the features of both noise scales at the upper levels, they still have
+        // to look like the full noise there instead of a sphere
+        TerrainGenerator generator(52, 0.2);
+        const double radius = 6.371e6;
+        Prng_xoshiro rng;
+        rng.init(0, 52);
+        for(int level = 1; level <= 10; level++) {
+            double sum[2] = {};
+            double squares[2] = {};
+            double product = 0.0;
+            int n = 0;
+            for(int i = 0; i < 300; i++) {
+                dvec3 center = glm::normalize(dvec3(rng.uniform() - 0.5, rng.uniform() - 0.5, rng.uniform() - 0.5));
+                dvec3 verts[3] = {
+                    center * radius,
+                    (center + dvec3(1e-3, 0.0, 0.0)) * radius,
+                    (center + dvec3(0.0, 1e-3, 0.0)) * radius};
+                vec3 new_verts[3];
+                float coarse[12];
+                float full[12];
+                float roughnesses[12];
+                TerrainTree::subdivision_noise(&generator, radius, level, verts, new_verts, coarse, roughnesses);
+                // deep enough for every octave of both scales
+                TerrainTree::subdivision_noise(&generator, radius, 40, verts, new_verts, full, roughnesses);
+                for(int j = 0; j < 6; j++) {
+                    sum[0] += coarse[j];
+                    sum[1] += full[j];
+                    squares[0] += coarse[j] * coarse[j];
+                    squares[1] += full[j] * full[j];
+                    product += coarse[j] * full[j];
+                    n++;
+                }
+            }
+            double covariance = product / n - (sum[0] / n) * (sum[1] / n);
+            double variance[2] = {squares[0] / n - (sum[0] / n) * (sum[0] / n), squares[1] / n - (sum[1] / n) * (sum[1] / n)};
+            REQUIRE(variance[0] > 0.0);
+            REQUIRE(covariance / sqrt(variance[0] * variance[1]) > 0.7);
+        }
+    }
+
+    SECTION("neighbours agree on the vertices they share") {
+        // same level nodes differ in size across the octahedron, but have to evaluate the same octaves
+        TerrainTree tree(52, 1.0, 1e5, 0.2);
+        tree.MAX_LOD = 7;
+        terrain_mesh mesh = tree.buildMesh(dvec3(0.0, 1.0, 0.0), 7, nil, nil);
+        std::map<std::tuple<double, double, double>, double> elevations;
+        size_t conflicts = 0;
+        size_t leaves = 0;
+        for(ttnode &n : tree.nodes) {
+            if(n.first_child) {
+                continue;
+            }
+            REQUIRE(n.rendered_at_level == 8);
+            leaves++;
+            for(int i = 0; i < 3; i++) {
+                auto inserted = elevations.insert({{n.verts[i].x, n.verts[i].y, n.verts[i].z}, n.elevations[i]});
+                if(inserted.first->second != n.elevations[i]) {
+                    conflicts++;
+                }
+            }
+        }
+        REQUIRE(leaves == 8 * (1 << 14));
+        REQUIRE(conflicts == 0);
+        REQUIRE(mesh.num_verts == elevations.size());
+        mesh.destroy();
+        tree.destroy();
+        delete tree.generator;
+    }
+}
+
+TEST_CASE("Vegetation instancing", "[terrain]") {
+    REQUIRE(sizeof(vegetation_instance) == 20);
+
+    vegetation_templates templates;
+    templates.init();
+    for(int i = 0; i < NUM_VEGETATION_TYPES; i++) {
+        REQUIRE(templates.count[i] == 36);
+        REQUIRE(templates.first[i] == i * 36);
+    }
+    REQUIRE(templates.verts.count == NUM_VEGETATION_TYPES * 36);
+
+    // the first build grows the nodes, then every elevation is flattened to 500m where the whole planet is forest.
+    // without horizon culling the second build refines the same nodes instead of sampling new ones next to them.
+    TerrainTree tree(52, 2.0, 6.371e6, 1.0);
+    dvec3 vantage = dvec3(0.0, 6.371e6, 0.0);
+    tree.horizon_culling = false;
+    terrain_mesh mesh = tree.buildMesh(vantage, 3, nil);
+    mesh.destroy();
+    for(size_t i = 0; i < tree.nodes.size(); i++) {
+        for(int j = 0; j < 3; j++) {
+            tree.nodes[i].elevations[j] = 500.0;
+        }
+    }
+    int64_t vegetation_before = memory_telemetry[TAG_VEGETATION].live;
+    mesh = tree.buildMesh(vantage, 3, nil);
+    REQUIRE(mesh.num_instances > 0);
+
+    SECTION("one instance per tree in the rendered nodes") {
+        uint64_t expected = 0;
+        int64_t node_bytes = 0;
+        for(size_t i = 0; i < tree.nodes.size(); i++) {
+            ttnode &n = tree.nodes[i];
+            node_bytes += n.vegetation.capacity * sizeof(vegetation_instance);
+            if( ! n.first_child && n.rendered_at_level >= 18) {
+                expected += n.vegetation.count;
+            }
+        }
+        REQUIRE(mesh.num_instances == expected);
+        REQUIRE(memory_telemetry[TAG_VEGETATION].live - vegetation_before == node_bytes);
+    }
+
+    SECTION("sorted by type") {
+        REQUIRE(mesh.first_instance[0] == 0);
+        REQUIRE(mesh.first_instance[NUM_VEGETATION_TYPES] == mesh.num_instances);
+        for(int t = 0; t < NUM_VEGETATION_TYPES; t++) {
+            REQUIRE(mesh.first_instance[t] <= mesh.first_instance[t + 1]);
+            for(uint32_t i = mesh.first_instance[t]; i < mesh.first_instance[t + 1]; i++) {
+                REQUIRE(mesh.instances[i].type == t);
+            }
+        }
+    }
+
+    SECTION("standing on the ground") {
+        for(uint32_t i = 0; i < mesh.num_instances; i++) {
+            vegetation_instance &v = mesh.instances[i];
+            dvec3 global = vantage + dvec3(v.pos);
+            REQUIRE(fabs(glm::length(global) - (6.371e6 + 500.0)) < 1.0);
+            REQUIRE(glm::dot(glm::dvec3(v.normal()), glm::normalize(global)) > 0.999);
+            REQUIRE(v.size() >= 0.75f);
+            REQUIRE(v.size() < 1.25f);
+        }
+    }
+
+    SECTION("a fraction of the memory of baked geometry") {
+        // every baked tree used to be its template's texverts in the node, and a terrain_vert per texvert and a
+        // terrain_tri per 3 of them in the mesh
+        uint64_t baked = 0;
+        for(uint32_t i = 0; i < mesh.num_instances; i++) {
+            uint32_t n = templates.count[mesh.instances[i].type];
+            baked += n * sizeof(texvert) + terrain_mesh::bytes(n, n / 3);
+        }
+        uint64_t instanced = mesh.num_instances * sizeof(vegetation_instance) * 2;
+        REQUIRE(instanced * 40 < baked);
+    }
+
+    SECTION("the same trees in a tree generated from scratch") {
+        TerrainTree again(52, 2.0, 6.371e6, 1.0);
+        again.horizon_culling = false;
+        terrain_mesh discard = again.buildMesh(vantage, 3, nil);
+        discard.destroy();
+        for(size_t i = 0; i < again.nodes.size(); i++) {
+            for(int j = 0; j < 3; j++) {
+                again.nodes[i].elevations[j] = 500.0;
+            }
+        }
+        terrain_mesh other = again.buildMesh(vantage, 3, nil);
+        REQUIRE(other.num_instances == mesh.num_instances);
+        REQUIRE(memcmp(other.instances, mesh.instances, mesh.num_instances * sizeof(vegetation_instance)) == 0);
+        other.destroy();
+        again.destroy();
+        delete again.generator;
+    }
+
+    mesh.destroy();
+    tree.destroy();
+    delete tree.generator;
+    templates.destroy();
+}
+
+TEST_CASE("Vegetation scatter", "[terrain]") {
+    const vegetation_scatter &table = vegetation_scatter::table();
+
+    SECTION("every prefix is blue noise") {
+        // uniform random points would come about 1/n apart at the closest
+        for(int n : {4, 16, 64, vegetation_scatter::SIZE}) {
+            float nearest = 2.0f;
+            for(int i = 0; i < n; i++) {
+                for(int j = 0; j < i; j++) {
+                    float du = fabsf(table.u[i] - table.u[j]);
+                    float dv = fabsf(table.v[i] - table.v[j]);
+                    du = min(du, 1.0f - du);
+                    dv = min(dv, 1.0f - dv);
+                    nearest = min(nearest, sqrtf(du * du + dv * dv));
+                }
+            }
+            REQUIRE(nearest * sqrtf(n) > 0.5f);
+        }
+    }
+
+    SECTION("trees per triangle follow the density") {
+        Prng_xoshiro rng;
+        rng.init(0, 52);
+        float identity[3][3];
+        vegetation_scatter::descend(0, 18, 18, identity);
+        uint16_t picked[vegetation_scatter::SIZE];
+        glm::vec3 b[vegetation_scatter::SIZE];
+        const int count = 32;
+        for(float d : {0.25f, 0.5f, 1.0f}) {
+            float density[3] = {d, d, d};
+            uint64_t total = 0;
+            const int shifts = 4000;
+            for(int i = 0; i < shifts; i++) {
+                total += table.place(rng.get(), identity, count, density, picked, b);
+            }
+            REQUIRE(fabs(total / (double)shifts - d * count / 2) < 0.05 * d * count / 2);
+        }
+    }
+
+    SECTION("children split their parent's trees") {
+        Prng_xoshiro rng;
+        rng.init(0, 52);
+        const int count = 32;
+        for(int trial = 0; trial < 100; trial++) {
+            uint64_t shift = rng.get();
+            uint64_t path = rng.get() & ((1ULL << (1 + 2 * 18)) - 1);
+            float d = trial % 2 ? 1.0f : 0.6f;
+            float density[3] = {d, d, d};
+            float m[3][3];
+            uint16_t parent[vegetation_scatter::SIZE];
+            glm::vec3 b[vegetation_scatter::SIZE];
+            vegetation_scatter::descend(path, 18, 18, m);
+            int num_parent = table.place(shift, m, count, density, parent, b);
+            int seen[vegetation_scatter::SIZE] = {};
+            for(uint64_t grandchild = 0; grandchild < 16; grandchild++) {
+                uint64_t child_path = path | ((grandchild & 3) << (1 + 2 * 18)) | ((grandchild >> 2) << (1 + 2 * 19));
+                uint16_t picked[vegetation_scatter::SIZE];
+                vegetation_scatter::descend(child_path, 18, 20, m);
+                int n = table.place(shift, m, count, density, picked, b);
+                for(int i = 0; i < n; i++) {
+                    seen[picked[i]]++;
+                    REQUIRE(fabsf(b[i].x + b[i].y + b[i].z - 1.0f) < 1e-4f);
+                }
+            }
+            int num_seen = 0;
+            for(int i = 0; i < count; i++) {
+                REQUIRE(seen[i] <= 1);
+                num_seen += seen[i];
+            }
+            REQUIRE(num_seen == num_parent);
+            for(int i = 0; i < num_parent; i++) {
+                REQUIRE(seen[parent[i]] == 1);
+            }
+        }
+    }
+}
+
+TEST_CASE("Counter based PRNG", "[prng]") {
+    Prng_philox rng;
+
+    SECTION("known answers") {
+        // Philox4x32-10 test vectors, the first two words of the block
+        rng.init(0);
+        REQUIRE(rng.get(0, 0, 0) == 0xe169c58d6627e8d5ULL);
+        rng.init(~0ULL);
+        REQUIRE(rng.get(~0ULL, ~0U, ~0U) == 0x41c83b0e408f276dULL);
+    }
+
+    SECTION("batches match single draws") {
+        rng.init(52);
+        for(size_t n : {1, 3, 4, 7, 64, 1001}) {
+            nonstd::vector<uint64_t> bits;
+            nonstd::vector<double> uniforms;
+            bits.reserve(n);
+            uniforms.reserve(n);
+            rng.get_many(bits.data, 0x1234567890ULL, PRNG_STREAM_VEGETATION, 5, n);
+            rng.uniform_many(uniforms.data, 0x1234567890ULL, PRNG_STREAM_VEGETATION, 5, n);
+            for(size_t i = 0; i < n; i++) {
+                REQUIRE(bits.data[i] == rng.get(0x1234567890ULL, PRNG_STREAM_VEGETATION, 5 + i));
+                REQUIRE(uniforms.data[i] == rng.uniform(0x1234567890ULL, PRNG_STREAM_VEGETATION, 5 + i));
+                REQUIRE(uniforms.data[i] >= 0.0);
+                REQUIRE(uniforms.data[i] < 1.0);
+            }
+            bits.destroy();
+            uniforms.destroy();
+        }
+    }
+
+    SECTION("every input bit matters") {
+        rng.init(52);
+        uint64_t base = rng.get(0, 0, 0);
+        for(int bit = 0; bit < 64; bit++) {
+            REQUIRE(rng.get(1ULL << bit, 0, 0) != base);
+        }
+        for(int bit = 0; bit < 32; bit++) {
+            REQUIRE(rng.get(0, 1U << bit, 0) != base);
+            REQUIRE(rng.get(0, 0, 1U << bit) != base);
+        }
+        Prng_philox other;
+        other.init(53);
+        REQUIRE(other.get(0, 0, 0) != base);
+    }
+
+    SECTION("the same numbers in any order on any thread") {
+        rng.init(52);
+        const size_t n = 4096;
+        nonstd::vector<uint64_t> expected;
+        expected.reserve(n);
+        rng.get_many(expected.data, 7, 0, 0, n);
+        nonstd::vector<uint64_t> shuffled;
+        shuffled.reserve(n);
+        std::vector<std::thread> threads;
+        for(size_t t = 0; t < 4; t++) {
+            threads.emplace_back([&rng, &shuffled, t, n]() {
+                for(size_t i = n - 1 - t; i < n; i -= 4) {
+                    shuffled.data[i] = rng.get(7, 0, i);
+                }
+            });
+        }
+        for(auto &thread : threads) {
+            thread.join();
+        }
+        for(size_t i = 0; i < n; i++) {
+            REQUIRE(shuffled.data[i] == expected.data[i]);
+        }
+        expected.destroy();
+        shuffled.destroy();
+    }
+}
+
+TEST_CASE("Bulk PRNG output", "[prng]") {
+    SECTION("xoshiro fill") {
+        Prng_xoshiro a;
+        Prng_xoshiro b;
+        a.init(1, 2);
+        b.init(1, 2);
+        uint64_t small[20];
+        a.fill(small, 20);
+        for(int i = 0; i < 20; i++) {
+            REQUIRE(small[i] == b.get());
+        }
+        const size_t n = 1003;
+        nonstd::vector<uint64_t> bits;
+        bits.reserve(n);
+        a.init(1, 2);
+        a.fill(bits.data, n);
+        // lanes may not repeat each other
+        for(size_t i = 8; i < n; i++) {
+            REQUIRE(bits.data[i] != bits.data[i - 8]);
+            REQUIRE(bits.data[i] != bits.data[i - 1]);
+        }
+        // the same numbers with and without AVX2
+        uint64_t hash = 0;
+        for(size_t i = 0; i < n; i++) {
+            hash = hash * 31 + bits.data[i];
+        }
+        REQUIRE(hash == 0xc262711ef10e8bc6ULL);
+        bits.destroy();
+    }
+
+    SECTION("xoshiro fill_uniform") {
+        Prng_xoshiro rng;
+        rng.init(3, 4);
+        const size_t n = 10001;
+        nonstd::vector<double> doubles;
+        nonstd::vector<float> floats;
+        doubles.reserve(n);
+        floats.reserve(n);
+        rng.fill_uniform(doubles.data, n);
+        rng.fill_uniform(floats.data, n);
+        double sum_d = 0.0;
+        double sum_f = 0.0;
+        for(size_t i = 0; i < n; i++) {
+            REQUIRE(doubles.data[i] >= 0.0);
+            REQUIRE(doubles.data[i] < 1.0);
+            REQUIRE(floats.data[i] >= 0.0f);
+            REQUIRE(floats.data[i] < 1.0f);
+            sum_d += doubles.data[i];
+            sum_f += floats.data[i];
+        }
+        REQUIRE(fabs(sum_d / n - 0.5) < 0.01);
+        REQUIRE(fabs(sum_f / n - 0.5) < 0.01);
+        doubles.destroy();
+        floats.destroy();
+    }
+
+    SECTION("sha256") {
+        Prng_sha256 a;
+        Prng_sha256 b;
+        a.init(5, 6);
+        b.init(5, 6);
+        uint64_t bits[11];
+        a.fill(bits, 11);
+        for(int i = 0; i < 11; i++) {
+            REQUIRE(bits[i] == b.get());
+        }
+        const size_t n = 101;
+        uint64_t seed_a[n];
+        uint64_t seed_b[n];
+        uint64_t hashes[n];
+        for(size_t i = 0; i < n; i++) {
+            seed_a[i] = i * 0x9e3779b97f4a7c15ULL;
+            seed_b[i] = ~i;
+        }
+        sha256_hash_many(hashes, seed_a, seed_b, n);
+        for(size_t i = 0; i < n; i++) {
+            REQUIRE(hashes[i] == sha256_hash(seed_a[i], seed_b[i]));
+        }
+    }
+}
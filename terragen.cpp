@@ -4,6 +4,9 @@
 #include <cmath>
 #include <iostream>
 #include <cstring>
+#if defined(__AVX2__) || defined(__SHA__)
+#include <immintrin.h>
+#endif
 /*
 
 
@@ -101,6 +104,18 @@ uint64_t Prng_sha256::get() {
     return ((uint64_t*)state)[index];
 }
 
+void Prng_sha256::fill(uint64_t *out, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        out[i] = get();
+    }
+}
+
+void Prng_sha256::fill_uniform(double *out, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        out[i] = uniform();
+    }
+}
+
 double Prng_sha256::uniform() {
     constexpr uint64_t mask1 = 0x3FF0000000000000ULL;
     constexpr uint64_t mask2 = 0x3FFFFFFFFFFFFFFFULL;
@@ -108,6 +123,86 @@ double Prng_sha256::uniform() {
     return (*(double*)(&to_12))-1.0;
 }
 
+#if defined(__SHA__) && !defined(DEBUG)
+// sha256_process_x86 for one block of each of two messages. the sha rounds have long latencies, with a second
+// message to work on the cpu has something to do while it waits.
+static void sha256_process_x86_x2(uint32_t state_a[8], uint32_t state_b[8], const uint8_t data_a[64],
+        const uint8_t data_b[64]) {
+    static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+#if defined(__AVX__)
+    // the sha instructions only have legacy sse encodings, which stall on dirty upper halves of the avx registers
+    _mm256_zeroupper();
+#endif
+    const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    uint32_t *states[2] = {state_a, state_b};
+    const uint8_t *data[2] = {data_a, data_b};
+    __m128i state0[2], state1[2], abef[2], cdgh[2], msg[2][4];
+    for(int j = 0; j < 2; j++) {
+        __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&states[j][0]), 0xB1); // CDAB
+        state1[j] = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&states[j][4]), 0x1B); // EFGH
+        state0[j] = _mm_alignr_epi8(tmp, state1[j], 8); // ABEF
+        state1[j] = _mm_blend_epi16(state1[j], tmp, 0xF0); // CDGH
+        abef[j] = state0[j];
+        cdgh[j] = state1[j];
+    }
+    // unrolled all the way, so msg and the states are registers and not arrays on the stack
+#pragma GCC unroll 16
+    for(int i = 0; i < 16; i++) {
+        __m128i k = _mm_loadu_si128((const __m128i*)&K[4 * i]);
+#pragma GCC unroll 2
+        for(int j = 0; j < 2; j++) {
+            __m128i w;
+            if(i < 4) {
+                w = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&data[j][16 * i]), MASK);
+            } else {
+                // w[t] = s1(w[t-2]) + w[t-7] + s0(w[t-15]) + w[t-16], 4 words at a time
+                w = _mm_add_epi32(_mm_sha256msg1_epu32(msg[j][i & 3], msg[j][(i + 1) & 3]),
+                        _mm_alignr_epi8(msg[j][(i + 3) & 3], msg[j][(i + 2) & 3], 4));
+                w = _mm_sha256msg2_epu32(w, msg[j][(i + 3) & 3]);
+            }
+            msg[j][i & 3] = w;
+            __m128i wk = _mm_add_epi32(w, k);
+            state1[j] = _mm_sha256rnds2_epu32(state1[j], state0[j], wk);
+            state0[j] = _mm_sha256rnds2_epu32(state0[j], state1[j], _mm_shuffle_epi32(wk, 0x0E));
+        }
+    }
+    for(int j = 0; j < 2; j++) {
+        state0[j] = _mm_add_epi32(state0[j], abef[j]);
+        state1[j] = _mm_add_epi32(state1[j], cdgh[j]);
+        __m128i tmp = _mm_shuffle_epi32(state0[j], 0x1B); // FEBA
+        state1[j] = _mm_shuffle_epi32(state1[j], 0xB1); // DCHG
+        _mm_storeu_si128((__m128i*)&states[j][0], _mm_blend_epi16(tmp, state1[j], 0xF0)); // DCBA
+        _mm_storeu_si128((__m128i*)&states[j][4], _mm_alignr_epi8(state1[j], tmp, 8)); // ABEF
+    }
+}
+#endif
+
+void sha256_hash_many(uint64_t *out, const uint64_t *seed_a, const uint64_t *seed_b, size_t n) {
+    size_t i = 0;
+#if defined(__SHA__) && !defined(DEBUG)
+    for(; i + 2 <= n; i += 2) {
+        uint64_t message[2][8] = {{seed_a[i], seed_b[i]}, {seed_a[i + 1], seed_b[i + 1]}};
+        uint32_t state[2][8] = {
+            {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+            {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19}};
+        sha256_process_x86_x2(state[0], state[1], (uint8_t*)message[0], (uint8_t*)message[1]);
+        out[i] = ((uint64_t*)state[0])[0];
+        out[i + 1] = ((uint64_t*)state[1])[0];
+    }
+#endif
+    for(; i < n; i++) {
+        out[i] = sha256_hash(seed_a[i], seed_b[i]);
+    }
+}
+
 void Prng_xoshiro::init(uint64_t seed_a, uint64_t seed_b) {
 	s[0] = seed_a ^ 0x6a09e667bb67ae85;
 	s[1] = seed_b ^ 0x3c6ef372a54ff53a;
@@ -137,13 +232,235 @@ double Prng_xoshiro::uniform() {
     return (*(double*)(&to_12))-1.0;
 }
 
+#define XOSHIRO_LANES 8
+
+static inline uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// blocks * XOSHIRO_LANES numbers, out[i] from lane i % XOSHIRO_LANES. lanes[w][l] is word w of lane l's state.
+static void xoshiro_lanes(uint64_t lanes[4][XOSHIRO_LANES], uint64_t *out, size_t blocks) {
+#if defined(__AVX2__)
+    // two groups of 4 lanes so one group's dependency chain can run while the other's waits
+    __m256i s[2][4];
+    for(int g = 0; g < 2; g++) {
+        for(int w = 0; w < 4; w++) {
+            s[g][w] = _mm256_loadu_si256((const __m256i*)&lanes[w][4 * g]);
+        }
+    }
+    for(size_t b = 0; b < blocks; b++) {
+        for(int g = 0; g < 2; g++) {
+            __m256i sum = _mm256_add_epi64(s[g][0], s[g][3]);
+            __m256i result = _mm256_add_epi64(_mm256_or_si256(_mm256_slli_epi64(sum, 23), _mm256_srli_epi64(sum, 41)), s[g][0]);
+            __m256i t = _mm256_slli_epi64(s[g][1], 17);
+            s[g][2] = _mm256_xor_si256(s[g][2], s[g][0]);
+            s[g][3] = _mm256_xor_si256(s[g][3], s[g][1]);
+            s[g][1] = _mm256_xor_si256(s[g][1], s[g][2]);
+            s[g][0] = _mm256_xor_si256(s[g][0], s[g][3]);
+            s[g][2] = _mm256_xor_si256(s[g][2], t);
+            s[g][3] = _mm256_or_si256(_mm256_slli_epi64(s[g][3], 45), _mm256_srli_epi64(s[g][3], 19));
+            _mm256_storeu_si256((__m256i*)&out[b * XOSHIRO_LANES + 4 * g], result);
+        }
+    }
+    for(int g = 0; g < 2; g++) {
+        for(int w = 0; w < 4; w++) {
+            _mm256_storeu_si256((__m256i*)&lanes[w][4 * g], s[g][w]);
+        }
+    }
+#else
+    for(size_t b = 0; b < blocks; b++) {
+        for(int l = 0; l < XOSHIRO_LANES; l++) {
+            Prng_xoshiro lane = {{lanes[0][l], lanes[1][l], lanes[2][l], lanes[3][l]}};
+            out[b * XOSHIRO_LANES + l] = lane.get();
+            for(int w = 0; w < 4; w++) {
+                lanes[w][l] = lane.s[w];
+            }
+        }
+    }
+#endif
+}
+
+void Prng_xoshiro::fill(uint64_t *out, size_t n) {
+    // splitting off the lanes costs about as much as this many draws
+    if(n < 4 * XOSHIRO_LANES) {
+        for(size_t i = 0; i < n; i++) {
+            out[i] = get();
+        }
+        return;
+    }
+    uint64_t lanes[4][XOSHIRO_LANES];
+    for(int l = 0; l < XOSHIRO_LANES; l++) {
+        uint64_t x = get();
+        for(int w = 0; w < 4; w++) {
+            lanes[w][l] = splitmix64(&x);
+        }
+    }
+    size_t blocks = n / XOSHIRO_LANES;
+    xoshiro_lanes(lanes, out, blocks);
+    if(n % XOSHIRO_LANES) {
+        uint64_t tail[XOSHIRO_LANES];
+        xoshiro_lanes(lanes, tail, 1);
+        memcpy(&out[blocks * XOSHIRO_LANES], tail, (n % XOSHIRO_LANES) * sizeof(uint64_t));
+    }
+}
+
+void Prng_xoshiro::fill_uniform(double *out, size_t n) {
+    static_assert(sizeof(double) == sizeof(uint64_t));
+    fill((uint64_t*)out, n);
+    for(size_t i = 0; i < n; i++) {
+        uint64_t to_12;
+        memcpy(&to_12, &out[i], sizeof(to_12));
+        to_12 = to_12 >> 12 | 0x3FFULL << 52;
+        memcpy(&out[i], &to_12, sizeof(to_12));
+        out[i] -= 1.0;
+    }
+}
+
+// every 64 bit draw makes two floats
+void Prng_xoshiro::fill_uniform(float *out, size_t n) {
+    static_assert(sizeof(float) == sizeof(uint32_t));
+    fill((uint64_t*)out, n / 2);
+    if(n & 1) {
+        uint32_t last = (uint32_t)get();
+        memcpy(&out[n - 1], &last, sizeof(last));
+    }
+    for(size_t i = 0; i < n; i++) {
+        uint32_t to_12;
+        memcpy(&to_12, &out[i], sizeof(to_12));
+        to_12 = to_12 >> 9 | 0x7FU << 23;
+        memcpy(&out[i], &to_12, sizeof(to_12));
+        out[i] -= 1.0f;
+    }
+}
+
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+
+void Prng_philox::init(uint64_t seed) {
+    key[0] = (uint32_t)seed;
+    key[1] = (uint32_t)(seed >> 32);
+}
+
+static inline uint64_t philox_uniform_bits(uint64_t bits) {
+    constexpr uint64_t mask1 = 0x3FFULL << 52;
+    const uint64_t to_12 = (bits >> 12 | mask1);
+    return to_12;
+}
+
+// one block of 4 words, the first 2 are returned
+static inline uint64_t philox_block(const uint32_t key[2], uint64_t path, uint32_t stream, uint32_t index) {
+    uint32_t c[4] = {index, stream, (uint32_t)path, (uint32_t)(path >> 32)};
+    uint32_t k0 = key[0];
+    uint32_t k1 = key[1];
+    for(int round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c[0];
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c[2];
+        uint32_t c0 = (uint32_t)(p1 >> 32) ^ c[1] ^ k0;
+        uint32_t c2 = (uint32_t)(p0 >> 32) ^ c[3] ^ k1;
+        c[1] = (uint32_t)p1;
+        c[3] = (uint32_t)p0;
+        c[0] = c0;
+        c[2] = c2;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    return (uint64_t)c[1] << 32 | c[0];
+}
+
+uint64_t Prng_philox::get(uint64_t path, uint32_t stream, uint32_t index) const {
+    return philox_block(key, path, stream, index);
+}
+
+double Prng_philox::uniform(uint64_t path, uint32_t stream, uint32_t index) const {
+    const uint64_t to_12 = philox_uniform_bits(get(path, stream, index));
+    return (*(double*)(&to_12))-1.0;
+}
+
+void Prng_philox::get_many(uint64_t *out, uint64_t path, uint32_t stream, uint32_t index, size_t n) const {
+    size_t i = 0;
+#if defined(__AVX2__)
+    // 4 blocks side by side, each word of a block in the low half of a 64 bit lane so _mm256_mul_epu32 can make
+    // the full 64 bit products
+    const __m256i m0 = _mm256_set1_epi64x(PHILOX_M0);
+    const __m256i m1 = _mm256_set1_epi64x(PHILOX_M1);
+    const __m256i low = _mm256_set1_epi64x(0xFFFFFFFFULL);
+    const __m256i c1_init = _mm256_set1_epi64x(stream);
+    const __m256i c2_init = _mm256_set1_epi64x((uint32_t)path);
+    const __m256i c3_init = _mm256_set1_epi64x((uint32_t)(path >> 32));
+    for(; i + 4 <= n; i += 4) {
+        uint32_t first = index + (uint32_t)i;
+        __m256i c0 = _mm256_set_epi64x((uint32_t)(first + 3), (uint32_t)(first + 2), (uint32_t)(first + 1), first);
+        __m256i c1 = c1_init;
+        __m256i c2 = c2_init;
+        __m256i c3 = c3_init;
+        uint32_t k0 = key[0];
+        uint32_t k1 = key[1];
+        for(int round = 0; round < 10; round++) {
+            __m256i p0 = _mm256_mul_epu32(m0, c0);
+            __m256i p1 = _mm256_mul_epu32(m1, c2);
+            c0 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p1, 32), c1), _mm256_set1_epi64x(k0));
+            c2 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p0, 32), c3), _mm256_set1_epi64x(k1));
+            c1 = _mm256_and_si256(p1, low);
+            c3 = _mm256_and_si256(p0, low);
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        _mm256_storeu_si256((__m256i*)&out[i], _mm256_or_si256(_mm256_slli_epi64(c1, 32), c0));
+    }
+#endif
+    for(; i < n; i++) {
+        out[i] = philox_block(key, path, stream, index + (uint32_t)i);
+    }
+}
+
+void Prng_philox::uniform_many(double *out, uint64_t path, uint32_t stream, uint32_t index, size_t n) const {
+    static_assert(sizeof(double) == sizeof(uint64_t));
+    get_many((uint64_t*)out, path, stream, index, n);
+    for(size_t i = 0; i < n; i++) {
+        uint64_t to_12;
+        memcpy(&to_12, &out[i], sizeof(to_12));
+        to_12 = philox_uniform_bits(to_12);
+        memcpy(&out[i], &to_12, sizeof(to_12));
+        out[i] -= 1.0;
+    }
+}
+
 TerrainGenerator::TerrainGenerator(int pseed, float proughness) {
     fnSimplex = FastNoise::New<FastNoise::Simplex>();
     fnFractal = FastNoise::New<FastNoise::FractalFBm>();
     seed = pseed;
     roughness = proughness;
     fnFractal->SetSource( fnSimplex );
-    fnFractal->SetOctaveCount( 13 );
+    fnFractal->SetOctaveCount( MAX_OCTAVES );
+    // each octave has half the amplitude of the one before it, fbm's default gain
+    float amplitude = 1.0f;
+    octave_weights[0] = 0.0f;
+    for(int i = 0; i < MAX_OCTAVES; i++) {
+        fnOctaves[i] = FastNoise::New<FastNoise::FractalFBm>();
+        fnOctaves[i]->SetSource( fnSimplex );
+        fnOctaves[i]->SetOctaveCount( i + 1 );
+        octave_weights[i + 1] = octave_weights[i] + amplitude;
+        amplitude *= 0.5f;
+    }
+    for(int i = 1; i <= MAX_OCTAVES; i++) {
+        octave_weights[i] /= octave_weights[MAX_OCTAVES];
+    }
+}
+
+int TerrainGenerator::resolvable_octaves(double width) {
+    // the features of simplex noise are about 1 across and every octave halves them. the children's corners are
+    // half a node apart, so they still sample the octaves down to width / 2. the first octave carries the continents
+    // and is always evaluated, however coarsely it is sampled.
+    double spacing = width * 0.5;
+    if(spacing >= 1.0) {
+        return 1;
+    }
+    return glm::min((int)floor(-log2(spacing)) + 1, MAX_OCTAVES);
 }
 
 float TerrainGenerator::getElevation(dvec3 pos) {
@@ -152,8 +469,28 @@ float TerrainGenerator::getElevation(dvec3 pos) {
     return elevation * (glm::max(local_roughness, -roughness) + roughness);
 }
 
-void TerrainGenerator::getMultiple(float *elevations, float *out_roughnesses, vec3 *scaled_verts, int num, float typeslider) {
+// fbm normalizes its output to the same range whatever the octave count, scaling it back makes a truncated sum the
+// coarse part of the full noise instead of an amplified copy of it
+static void gen_octaves(TerrainGenerator *generator, float *out, int n, const float *xs, const float *ys,
+        const float *zs, int seed, int octaves) {
+    if( ! octaves) {
+        for(int i = 0; i < n; i++) {
+            out[i] = 0.0f;
+        }
+        return;
+    }
+    generator->fnOctaves[octaves - 1]->GenPositionArray3D(out, n, xs, ys, zs, 0, 0, 0, seed);
+    if(octaves < TerrainGenerator::MAX_OCTAVES) {
+        for(int i = 0; i < n; i++) {
+            out[i] *= generator->octave_weights[octaves];
+        }
+    }
+}
+
+void TerrainGenerator::getMultiple(float *elevations, float *out_roughnesses, vec3 *scaled_verts, int num, float typeslider,
+        const int octaves[2]) {
     assert(num == 12);
+    assert(octaves[0] >= 0 && octaves[0] <= MAX_OCTAVES && octaves[1] >= 0 && octaves[1] <= MAX_OCTAVES);
     float xs[12] = {  
         scaled_verts[0].x, scaled_verts[1].x, scaled_verts[2].x,
         scaled_verts[3].x, scaled_verts[4].x, scaled_verts[5].x,
@@ -171,10 +508,10 @@ void TerrainGenerator::getMultiple(float *elevations, float *out_roughnesses, ve
         scaled_verts[9].z, scaled_verts[10].z, scaled_verts[11].z};
 
     float roughnesses[12];
-    fnFractal->GenPositionArray3D(elevations, 6, xs, ys, zs, 0, 0, 0, seed);
-    fnFractal->GenPositionArray3D(&elevations[6], 6, &xs[6], &ys[6], &zs[6], 0, 0, 0, ~seed);
-    fnFractal->GenPositionArray3D(roughnesses, 6, zs, xs, ys, 0, 0, 0, seed ^ 0xF0F0F0F0F0F0);
-    fnFractal->GenPositionArray3D(&roughnesses[6], 6, &zs[6], &xs[6], &ys[6], 0, 0, 0, ~seed ^ 0xF0F0F0F0F0F0);
+    gen_octaves(this, elevations, 6, xs, ys, zs, seed, octaves[0]);
+    gen_octaves(this, &elevations[6], 6, &xs[6], &ys[6], &zs[6], ~seed, octaves[1]);
+    gen_octaves(this, roughnesses, 6, zs, xs, ys, seed ^ 0xF0F0F0F0F0F0, octaves[0]);
+    gen_octaves(this, &roughnesses[6], 6, &zs[6], &xs[6], &ys[6], ~seed ^ 0xF0F0F0F0F0F0, octaves[1]);
     for(int i = 0; i < 12; i++) {
         out_roughnesses[i] = (glm::max(roughnesses[i], -roughness) + roughness) * (1.0 - typeslider) +
             + (glm::max(roughnesses[(i + 6) % 12], -roughness) + roughness) * typeslider;
@@ -11,6 +11,8 @@ using glm::dvec3;
 using glm::vec3;
 
 uint64_t sha256_hash(uint64_t seed_a, uint64_t seed_b);
+// sha256_hash(seed_a[i], seed_b[i]) for every i < n, two at a time with SHA-NI
+void sha256_hash_many(uint64_t *out, const uint64_t *seed_a, const uint64_t *seed_b, size_t n);
 
 // The sha256 generator produces very high quality pseudorandom numbers that are difficult to predict based
 // on previous output
@@ -22,6 +24,10 @@ struct Prng_sha256 {
     void init(uint64_t seed_a, uint64_t seed_b);
     uint64_t get();
     double uniform();
+    // the same numbers as n calls to get() or uniform(). every block depends on the one before it, so this can't
+    // be spread over lanes like sha256_hash_many.
+    void fill(uint64_t *out, size_t n);
+    void fill_uniform(double *out, size_t n);
 };
 
 // The xoshiro generator is very fast but trivially predictable. That's usually an acceptable tradeoff.
@@ -31,19 +37,50 @@ struct Prng_xoshiro {
     void init(uint64_t seed_a, uint64_t seed_b);
     uint64_t get();
     double uniform();
+    // bulk versions of get() and uniform(). short fills are the same numbers get() would return, longer ones are
+    // drawn from 8 generators split off this one and run side by side in AVX2 registers, the same numbers with or
+    // without AVX2. a fill advances this generator by at most 8 draws.
+    void fill(uint64_t *out, size_t n);
+    void fill_uniform(double *out, size_t n);
+    void fill_uniform(float *out, size_t n);
+};
+
+// Philox4x32-10, a counter based generator: the bits for (seed, path, stream, index) are computed directly instead of
+// by stepping a state, so any thread can generate any node's content in any order and get the same numbers.
+// path is a terrain node's path, stream tells apart the things generated for the same node (see prng_stream).
+struct Prng_philox {
+    uint32_t key[2];
+
+    void init(uint64_t seed);
+    uint64_t get(uint64_t path, uint32_t stream, uint32_t index) const;
+    double uniform(uint64_t path, uint32_t stream, uint32_t index) const;
+    // get() and uniform() for index, index + 1, .. index + n - 1, 4 at a time with AVX2
+    void get_many(uint64_t *out, uint64_t path, uint32_t stream, uint32_t index, size_t n) const;
+    void uniform_many(double *out, uint64_t path, uint32_t stream, uint32_t index, size_t n) const;
+};
+
+enum prng_stream : uint32_t {
+    PRNG_STREAM_VEGETATION = 1,
 };
 
 class TerrainGenerator {
 public:
+    static constexpr int MAX_OCTAVES = 13;
     int seed;
     double radius;
     float roughness;
     FastNoise::SmartNode<FastNoise::Simplex> fnSimplex;
     FastNoise::SmartNode<FastNoise::FractalFBm> fnFractal;
+    FastNoise::SmartNode<FastNoise::FractalFBm> fnOctaves[MAX_OCTAVES]; // fnOctaves[i] sums the first i + 1 octaves
+    float octave_weights[MAX_OCTAVES + 1]; // share of the full noise's amplitude in its first n octaves
 
     TerrainGenerator(int pseed, float proughness);
     float getElevation(dvec3 pos);
-    void getMultiple(float *elevations, float *roughnesses, vec3 *positions, int num, float typeslider);
+    // octaves[0] is how many octaves to evaluate at positions 0-5 and octaves[1] at positions 6-11
+    void getMultiple(float *elevations, float *roughnesses, vec3 *positions, int num, float typeslider,
+            const int octaves[2]);
+    // how many octaves the children of a node width across can sample, at least 1. width in noise space
+    static int resolvable_octaves(double width);
 };
 
 
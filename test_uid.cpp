@@ -1,11 +1,21 @@
 #include "uid.cpp"
 #include "terragen.h"
 #include <iomanip>
+#include <thread>
 
-int main() {        
+struct UIDHashTableIncremental : UIDHashTable {
+    void init(size_t initial_capacity) {
+        UIDHashTable::init(initial_capacity);
+        set_incremental(true);
+    }
+};
+
+template <typename Table>
+int test_table(const char *name) {
     uint64_t errors = 0;
 
-    UIDHashTable large_table;
+    std::cout << name << ":\n";
+    Table large_table;
     large_table.init(1024);
     for(uint64_t epoch = 1; epoch < 11; epoch++) {
         //const uint64_t seed_a = 1 ^ epoch;
@@ -89,3 +99,157 @@ int main() {
     return 0;
 }
 
+// compares looping over operator[] against lookup_many. the biggest table is far larger than L3 so most lookups miss
+// all the caches and the difference is mostly how well the cache misses overlap.
+template <typename Table>
+int bench_lookup(const char *name, uint64_t num_keys) {
+    uint64_t errors = 0;
+    const uint64_t num_lookups = 1 << 22;
+    Table table;
+    table.init(1024);
+    Prng_xoshiro rng;
+    rng.init(num_keys, 0x5EED);
+    for(uint64_t i = 0; i < num_keys; i++) {
+        UID uid;
+        uid.setPID(1 + (i >> 32));
+        uid.setOID(i);
+        uid.setIdx(i);
+        table.insert(uid);
+    }
+    UID *queries = (UID*)malloc(num_lookups * sizeof(UID));
+    uint32_t *results = (uint32_t*)malloc(num_lookups * sizeof(uint32_t));
+    for(uint64_t i = 0; i < num_lookups; i++) {
+        uint64_t k = rng.get() % num_keys;
+        queries[i].setPID(1 + (k >> 32));
+        queries[i].setOID(k);
+        queries[i].setIdx(0);
+    }
+
+    auto begin = now();
+    for(uint64_t i = 0; i < num_lookups; i++) {
+        results[i] = table[queries[i]];
+    }
+    double single_ms = std::chrono::duration_cast<std::chrono::microseconds>(now() - begin).count() / 1000.0;
+    for(uint64_t i = 0; i < num_lookups; i++) {
+        if(results[i] != queries[i].getOID())
+            errors++;
+    }
+
+    bzero(results, num_lookups * sizeof(uint32_t));
+    begin = now();
+    table.lookup_many(queries, num_lookups, results);
+    double batch_ms = std::chrono::duration_cast<std::chrono::microseconds>(now() - begin).count() / 1000.0;
+    for(uint64_t i = 0; i < num_lookups; i++) {
+        if(results[i] != queries[i].getOID())
+            errors++;
+    }
+
+    std::cout << name << " " << num_keys << " keys (" << table.slots.capacity * sizeof(UID) / (1024 * 1024) << " MB): "
+        << "operator[] " << num_lookups / (single_ms * 1000.0) << " M lookups/s, "
+        << "lookup_many " << num_lookups / (batch_ms * 1000.0) << " M lookups/s\n";
+    free(queries);
+    free(results);
+    table.destroy();
+    if(errors) {
+        std::cerr << "Errors found: " << std::dec << errors << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// the slowest single insert is the one that triggers a resize, unless the table resizes incrementally
+template <typename Table>
+void bench_insert_latency(const char *name, uint64_t num_keys) {
+    Table table;
+    table.init(1024);
+    double worst_us = 0.0;
+    auto begin = now();
+    for(uint64_t i = 0; i < num_keys; i++) {
+        UID uid;
+        uid.setPID(1);
+        uid.setOID(i);
+        uid.setIdx(i);
+        auto before = now();
+        table.insert(uid);
+        double us = std::chrono::duration_cast<std::chrono::nanoseconds>(now() - before).count() / 1000.0;
+        worst_us = glm::max(worst_us, us);
+    }
+    double total_ms = std::chrono::duration_cast<std::chrono::microseconds>(now() - begin).count() / 1000.0;
+    std::cout << name << " " << num_keys << " inserts in " << total_ms << " ms, slowest insert " << worst_us << " us\n";
+    table.destroy();
+}
+
+// read throughput of the sharded table with 1 to N threads. readers don't share any cache lines except the slots
+// themselves so this should scale close to linearly until we run out of cores or memory bandwidth.
+int bench_concurrent_lookup(uint64_t num_keys) {
+    std::atomic<uint64_t> errors = 0;
+    const uint64_t lookups_per_thread = 1 << 22;
+    UIDConcurrentTable table;
+    table.init(num_keys);
+    for(uint64_t i = 0; i < num_keys; i++) {
+        UID uid;
+        uid.setPID(1);
+        uid.setOID(i);
+        uid.setIdx(i);
+        table.insert(uid);
+    }
+    int max_threads = max(1, std::thread::hardware_concurrency());
+    double single_thread_rate = 0.0;
+    for(int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        std::vector<std::thread> threads;
+        auto begin = now();
+        for(int t = 0; t < num_threads; t++) {
+            threads.emplace_back([&table, &errors, t, num_keys, lookups_per_thread]() {
+                Prng_xoshiro rng;
+                rng.init(t, 0x5EED);
+                for(uint64_t i = 0; i < lookups_per_thread; i++) {
+                    UID uid;
+                    uint64_t k = rng.get() % num_keys;
+                    uid.setPID(1);
+                    uid.setOID(k);
+                    uint32_t idx;
+                    if( ! table.find(uid, &idx) || idx != k)
+                        errors++;
+                }
+            });
+        }
+        for(auto& t : threads) {
+            t.join();
+        }
+        double ms = std::chrono::duration_cast<std::chrono::microseconds>(now() - begin).count() / 1000.0;
+        double rate = num_threads * lookups_per_thread / (ms * 1000.0);
+        if(num_threads == 1)
+            single_thread_rate = rate;
+        std::cout << "UIDConcurrentTable " << num_keys << " keys, " << num_threads << " threads: " << rate
+            << " M lookups/s (" << rate / (single_thread_rate * num_threads) * 100.0 << "% of linear)\n";
+    }
+    table.destroy();
+    if(errors) {
+        std::cerr << "Errors found: " << std::dec << errors << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main() {
+    if(test_table<UIDHashTable>("UIDHashTable"))
+        return 1;
+    if(test_table<UIDHashTableIncremental>("UIDHashTable (incremental resizing)"))
+        return 1;
+    if(test_table<UIDSwissTable>("UIDSwissTable"))
+        return 1;
+    for(uint64_t num_keys : {1ULL << 16, 1ULL << 20, 1ULL << 23}) {
+        if(bench_lookup<UIDHashTable>("UIDHashTable", num_keys))
+            return 1;
+        if(bench_lookup<UIDSwissTable>("UIDSwissTable", num_keys))
+            return 1;
+    }
+    for(uint64_t num_keys : {1ULL << 16, 1ULL << 23}) {
+        if(bench_concurrent_lookup(num_keys))
+            return 1;
+    }
+    bench_insert_latency<UIDHashTable>("UIDHashTable", 1 << 23);
+    bench_insert_latency<UIDHashTableIncremental>("UIDHashTable (incremental resizing)", 1 << 23);
+    return 0;
+}
+
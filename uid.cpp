@@ -1,6 +1,9 @@
 #include "uid.h"
 #include <stdexcept>
 #include <iomanip>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 
@@ -50,14 +53,82 @@ void UIDHashTable::init(size_t initial_capacity) {
 
 void UIDHashTable::destroy() {
     slots.destroy();
+    migrating_slots.destroy();
     size = 0;
 }
 
 void UIDHashTable::wipe() {
     slots.wipe();
+    migrating_slots.destroy();
     size = 0;
 }
 
+// migrated and removed entries in the old slot array are replaced by a tombstone instead of being backward shifted so
+// that entries we haven't migrated yet stay where the cursor will find them. no real key looks like this because the
+// zero key never goes in the slot array.
+static const UID uid_tombstone = UID{0ULL, 0xFFFFFFFF00000000ULL};
+
+static inline bool uid_slot_empty(const UID& slot) {
+    return slot.data[0] == 0 && slot.data[1] == 0;
+}
+
+static inline bool uid_slot_tombstone(const UID& slot) {
+    return slot.data[0] == 0 && slot.data[1] == uid_tombstone.data[1];
+}
+
+void UIDHashTable::set_incremental(bool incremental) {
+    if(incremental) {
+        flags |= 2;
+    } else {
+        finish_migration();
+        flags &= (~2);
+    }
+}
+
+// returns the index of key in migrating_slots or migrating_slots.capacity if it isn't there
+size_t UIDHashTable::find_migrating(const UID& key) const {
+    if( ! migrating_slots.capacity) {
+        return migrating_slots.capacity;
+    }
+    size_t idx = key.hash() % migrating_slots.capacity;
+    for(size_t probe_count = 0; probe_count < migrating_slots.capacity; probe_count++) {
+        const UID& slot = migrating_slots.data[idx];
+        if(uid_slot_empty(slot)) {
+            break;
+        }
+        if(slot.data[0] == key.data[0] && slot.data32[2] == key.data32[2] && ! uid_slot_tombstone(slot)) {
+            return idx;
+        }
+        idx = (idx + 1) % migrating_slots.capacity;
+    }
+    return migrating_slots.capacity;
+}
+
+void UIDHashTable::migrate(size_t num_buckets) {
+    size_t limit = min(migrating_slots.capacity, migrate_idx + num_buckets);
+    for(; migrate_idx < limit; migrate_idx++) {
+        UID& old_slot = migrating_slots.data[migrate_idx];
+        if(uid_slot_empty(old_slot) || uid_slot_tombstone(old_slot)) {
+            continue;
+        }
+        // the key can't be in the new array already, inserts and removes take it out of the old one first
+        size_t idx = old_slot.hash() % slots.capacity;
+        while( ! uid_slot_empty(slots.data[idx])) {
+            idx = (idx + 1) % slots.capacity;
+        }
+        slots.data[idx] = old_slot;
+        old_slot = uid_tombstone;
+    }
+    if(migrating_slots.capacity && migrate_idx == migrating_slots.capacity) {
+        migrating_slots.destroy();
+        migrate_idx = 0;
+    }
+}
+
+void UIDHashTable::finish_migration() {
+    migrate(migrating_slots.capacity);
+}
+
 void UIDHashTable::insert(const UID& key) {
     if(key.data[0] == 0 && key.data32[2] == 0) {
         zero_value = key.getIdx();
@@ -67,8 +138,30 @@ void UIDHashTable::insert(const UID& key) {
         return;
     }
 
+    if (migrating_slots.capacity) {
+        migrate(UID_MIGRATE_STEP);
+        size_t old_idx = find_migrating(key);
+        if (old_idx != migrating_slots.capacity) {
+            migrating_slots.data[old_idx] = uid_tombstone;
+            size--;
+        }
+    }
+
     if (((size + 1) * 2) >= slots.capacity) { // Load factor < 0.5
-        reserve(max(16, slots.capacity * 2));
+        if (flags & 2) {
+            // we should never get here with a migration in progress but if we do the old one has to finish first
+            finish_migration();
+            migrating_slots = slots;
+            migrate_idx = 0;
+            // calloc instead of reserve + bzero so the kernel hands us zero pages lazily instead of us touching all
+            // of them up front
+            slots = nonstd::vector<UID>();
+            slots.capacity = max(16, migrating_slots.capacity * 2);
+            slots.data = (UID*)calloc(slots.capacity, sizeof(UID));
+            migrate(UID_MIGRATE_STEP);
+        } else {
+            reserve(max(16, slots.capacity * 2));
+        }
     }
 
     assert(slots.capacity > 0);
@@ -103,6 +196,16 @@ void UIDHashTable::remove(const UID& key)
         return;
     }
 
+    if (migrating_slots.capacity) {
+        migrate(UID_MIGRATE_STEP);
+        size_t old_idx = find_migrating(key);
+        if (old_idx != migrating_slots.capacity) {
+            migrating_slots.data[old_idx] = uid_tombstone;
+            size--;
+            return;
+        }
+    }
+
     size_t idx = key.hash() % slots.capacity;
     size_t probe_count = 0;
     while(probe_count < slots.capacity) {
@@ -143,6 +246,7 @@ void UIDHashTable::remove(const UID& key)
 
 void UIDHashTable::reserve(size_t new_capacity) {
     assert(new_capacity > size);
+    finish_migration();
     nonstd::vector<UID> old_slots = slots;
     nonstd::vector<UID> new_slots;
     new_slots.reserve(new_capacity);
@@ -168,6 +272,14 @@ uint32_t& UIDHashTable::operator[](const UID& key) {
         //throw std::out_of_range(constfstr("Key not found: %llX %llX", key.getPID(), key.getOID() ));
     }
 
+    if (migrating_slots.capacity) {
+        migrate(UID_MIGRATE_STEP);
+        size_t old_idx = find_migrating(key);
+        if (old_idx != migrating_slots.capacity) {
+            return (uint32_t&)(migrating_slots.data[old_idx].data32[3]);
+        }
+    }
+
     size_t idx = key.hash() % slots.capacity;
     size_t probe_count = 0;
     while (probe_count < slots.capacity) {
@@ -186,6 +298,43 @@ uint32_t& UIDHashTable::operator[](const UID& key) {
     assert(false);
 }
 
+// resolves n keys at once. all keys in a batch are hashed and their home slots prefetched before any of them is probed,
+// so the cache misses overlap instead of being paid one after another.
+void UIDHashTable::lookup_many(const UID* keys, size_t n, uint32_t* out_idx) {
+    // keys can be in either array in the middle of a resize, take the slow path
+    if(migrating_slots.capacity) {
+        for(size_t i = 0; i < n; i++) {
+            out_idx[i] = (*this)[keys[i]];
+        }
+        return;
+    }
+    size_t home[UID_LOOKUP_BATCH];
+    for(size_t base = 0; base < n; base += UID_LOOKUP_BATCH) {
+        size_t batch = min(n - base, (size_t)UID_LOOKUP_BATCH);
+        for(size_t j = 0; j < batch; j++) {
+            home[j] = keys[base + j].hash() % slots.capacity;
+            __builtin_prefetch(&slots.data[home[j]]);
+        }
+        for(size_t j = 0; j < batch; j++) {
+            const UID& key = keys[base + j];
+            if(key.data[0] == 0 && key.data32[2] == 0) {
+                out_idx[base + j] = (*this)[key];
+                continue;
+            }
+            size_t idx = home[j];
+            while(true) {
+                const UID& slot = slots.data[idx];
+                assert(slot.data[0] != 0 || slot.data[1] != 0);
+                if (slot.data[0] == key.data[0] && slot.data32[2] == key.data32[2]) {
+                    out_idx[base + j] = slot.data32[3];
+                    break;
+                }
+                idx = (idx + 1) % slots.capacity;
+            }
+        }
+    }
+}
+
 nonstd::vector<int> UIDHashTable::count_probe_distances() const {
     nonstd::vector<int> counts = nonstd::vector<int>();
     counts.reserve(16);
@@ -222,4 +371,497 @@ nonstd::vector<int> UIDHashTable::count_probe_distances() const {
     return counts;
 }
 
+// control byte helpers for UIDSwissTable. each returns a bitmask with one bit per slot in the group.
+static inline uint32_t uid_group_match(const uint8_t *group, uint8_t tag) {
+#if defined(__AVX2__)
+    __m256i g = _mm256_loadu_si256((const __m256i*)group);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(g, _mm256_set1_epi8((char)tag)));
+#elif defined(__SSE2__)
+    __m128i g = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    for(int i = 0; i < UID_GROUP_WIDTH; i++) {
+        mask |= (uint32_t)(group[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline uint32_t uid_group_match_empty(const uint8_t *group) {
+    return uid_group_match(group, 0);
+}
+
+// empty or deleted, i.e. the high bit is clear
+static inline uint32_t uid_group_match_free(const uint8_t *group) {
+#if defined(__AVX2__)
+    return ~(uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)group));
+#elif defined(__SSE2__)
+    return ~(uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group)) & 0xFFFF;
+#else
+    uint32_t mask = 0;
+    for(int i = 0; i < UID_GROUP_WIDTH; i++) {
+        mask |= (uint32_t)(!(group[i] & 0x80)) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline size_t uid_swiss_max_load(size_t capacity) {
+    return capacity - capacity / 8;
+}
+
+void UIDSwissTable::init(size_t initial_capacity) {
+    bzero((void*)this, sizeof(UIDSwissTable));
+    assert(initial_capacity > 0);
+    size_t capacity = UID_GROUP_WIDTH;
+    while(capacity < initial_capacity) {
+        capacity *= 2;
+    }
+    ctrl = nonstd::vector<uint8_t>();
+    ctrl.reserve(capacity);
+    ctrl.wipe();
+    slots = nonstd::vector<UID>();
+    slots.reserve(capacity);
+    slots.wipe();
+    growth_left = uid_swiss_max_load(capacity);
+}
+
+void UIDSwissTable::destroy() {
+    ctrl.destroy();
+    slots.destroy();
+    size = 0;
+    growth_left = 0;
+}
+
+void UIDSwissTable::wipe() {
+    ctrl.wipe();
+    slots.wipe();
+    size = 0;
+    zero_value = 0;
+    flags &= (~1);
+    growth_left = uid_swiss_max_load(slots.capacity);
+}
+
+// returns the slot index of key or slots.capacity if it's not in the table
+size_t UIDSwissTable::find(const UID& key, uint64_t h) const {
+    const size_t group_mask = slots.capacity / UID_GROUP_WIDTH - 1;
+    const uint8_t tag = 0x80 | (h & 0x7F);
+    size_t group = (h >> 7) & group_mask;
+    // triangular probing visits every group exactly once when the number of groups is a power of two
+    for(size_t step = 0; step <= group_mask; ) {
+        const uint8_t *c = &ctrl.data[group * UID_GROUP_WIDTH];
+        uint32_t candidates = uid_group_match(c, tag);
+        while(candidates) {
+            size_t idx = group * UID_GROUP_WIDTH + __builtin_ctz(candidates);
+            const UID& slot = slots.data[idx];
+            if(slot.data[0] == key.data[0] && slot.data32[2] == key.data32[2]) {
+                return idx;
+            }
+            candidates &= candidates - 1;
+        }
+        if(uid_group_match_empty(c)) {
+            return slots.capacity;
+        }
+        group = (group + ++step) & group_mask;
+    }
+    return slots.capacity;
+}
+
+void UIDSwissTable::insert(const UID& key) {
+    if(key.data[0] == 0 && key.data32[2] == 0) {
+        zero_value = key.getIdx();
+        if(!(flags & 1))
+            size++;
+        flags |= 1;
+        return;
+    }
+
+    uint64_t h = key.hash();
+    size_t existing = find(key, h);
+    if(existing != slots.capacity) {
+        slots.data[existing] = key;
+        std::cout << "double insert\n";
+        return;
+    }
+
+    if(growth_left == 0) {
+        // if most of the used slots are tombstones we can reclaim them without growing
+        size_t live = size - (flags & 1);
+        reserve(live * 2 >= uid_swiss_max_load(slots.capacity) ? slots.capacity * 2 : slots.capacity);
+    }
+
+    const size_t group_mask = slots.capacity / UID_GROUP_WIDTH - 1;
+    size_t group = (h >> 7) & group_mask;
+    for(size_t step = 0; step <= group_mask; ) {
+        uint8_t *c = &ctrl.data[group * UID_GROUP_WIDTH];
+        uint32_t free_slots = uid_group_match_free(c);
+        if(free_slots) {
+            size_t idx = group * UID_GROUP_WIDTH + __builtin_ctz(free_slots);
+            if(ctrl.data[idx] == 0) {
+                growth_left--;
+            }
+            ctrl.data[idx] = 0x80 | (h & 0x7F);
+            slots.data[idx] = key;
+            size++;
+            return;
+        }
+        group = (group + ++step) & group_mask;
+    }
+    assert(false);
+}
+
+void UIDSwissTable::remove(const UID& key) {
+    if (key.data[0] == 0 && key.data32[2] == 0) {
+        assert(flags & 1);
+        zero_value = 0;
+        size--;
+        flags &= (~1);
+        return;
+    }
+
+    size_t idx = find(key, key.hash());
+    if(idx == slots.capacity) {
+        return;
+    }
+    size--;
+    slots.data[idx] = UID{0ULL, 0ULL};
+    // a group that still has an empty slot terminates every probe sequence that reaches it, so nobody can be relying
+    // on this slot being occupied and it can go straight back to empty. otherwise leave a tombstone.
+    const uint8_t *group = &ctrl.data[idx & ~(size_t)(UID_GROUP_WIDTH - 1)];
+    if(uid_group_match_empty(group)) {
+        ctrl.data[idx] = 0;
+        growth_left++;
+    } else {
+        ctrl.data[idx] = 0x7F;
+    }
+}
+
+void UIDSwissTable::reserve(size_t new_capacity) {
+    size_t capacity = UID_GROUP_WIDTH;
+    while(capacity < new_capacity || uid_swiss_max_load(capacity) < size) {
+        capacity *= 2;
+    }
+    nonstd::vector<uint8_t> old_ctrl = ctrl;
+    nonstd::vector<UID> old_slots = slots;
+    ctrl = nonstd::vector<uint8_t>();
+    ctrl.reserve(capacity);
+    ctrl.wipe();
+    slots = nonstd::vector<UID>();
+    slots.reserve(capacity);
+    slots.wipe();
+    size = 0 + (flags & 1);
+    growth_left = uid_swiss_max_load(capacity);
+
+    for (size_t i = 0; i < old_slots.capacity; i++) {
+        if (old_ctrl.data[i] & 0x80) {
+            insert(old_slots.data[i]);
+        }
+    }
+
+    old_ctrl.destroy();
+    old_slots.destroy();
+}
+
+uint32_t& UIDSwissTable::operator[](const UID& key) {
+    if(key.data[0] == 0 && key.data32[2] == 0) {
+        assert(flags & 1);
+        return zero_value;
+    }
+    size_t idx = find(key, key.hash());
+    assert(idx != slots.capacity);
+    return (uint32_t&)(slots.data[idx].data32[3]);
+}
+
+// same idea as UIDHashTable::lookup_many but in three stages: prefetch the control groups, match tags and prefetch the
+// candidate slots, then compare keys.
+void UIDSwissTable::lookup_many(const UID* keys, size_t n, uint32_t* out_idx) {
+    uint64_t hashes[UID_LOOKUP_BATCH];
+    size_t candidate[UID_LOOKUP_BATCH];
+    const size_t group_mask = slots.capacity / UID_GROUP_WIDTH - 1;
+    for(size_t base = 0; base < n; base += UID_LOOKUP_BATCH) {
+        size_t batch = min(n - base, (size_t)UID_LOOKUP_BATCH);
+        for(size_t j = 0; j < batch; j++) {
+            hashes[j] = keys[base + j].hash();
+            __builtin_prefetch(&ctrl.data[((hashes[j] >> 7) & group_mask) * UID_GROUP_WIDTH]);
+        }
+        for(size_t j = 0; j < batch; j++) {
+            size_t group = (hashes[j] >> 7) & group_mask;
+            uint32_t candidates = uid_group_match(&ctrl.data[group * UID_GROUP_WIDTH], 0x80 | (hashes[j] & 0x7F));
+            candidate[j] = candidates ? group * UID_GROUP_WIDTH + __builtin_ctz(candidates) : slots.capacity;
+            if(candidates) {
+                __builtin_prefetch(&slots.data[candidate[j]]);
+            }
+        }
+        for(size_t j = 0; j < batch; j++) {
+            const UID& key = keys[base + j];
+            if(key.data[0] == 0 && key.data32[2] == 0) {
+                out_idx[base + j] = (*this)[key];
+                continue;
+            }
+            size_t idx = candidate[j];
+            // the first tag match in the home group is almost always the key, anything else takes the slow path
+            if(idx == slots.capacity || slots.data[idx].data[0] != key.data[0] ||
+                    slots.data[idx].data32[2] != key.data32[2]) {
+                idx = find(key, hashes[j]);
+                assert(idx != slots.capacity);
+            }
+            out_idx[base + j] = slots.data[idx].data32[3];
+        }
+    }
+}
+
+// distances are counted in groups, not slots
+nonstd::vector<int> UIDSwissTable::count_probe_distances() const {
+    nonstd::vector<int> counts = nonstd::vector<int>();
+    counts.reserve(16);
+    bzero(counts.data, counts.capacity * sizeof(int));
+    counts.count = 16;
+
+    assert(slots.capacity > 0);
+    const size_t group_mask = slots.capacity / UID_GROUP_WIDTH - 1;
+    for (size_t i = 0; i < slots.capacity; i++) {
+        if ( ! (ctrl.data[i] & 0x80)) {
+            continue;
+        }
+        size_t group = (slots.data[i].hash() >> 7) & group_mask;
+        size_t distance = 0;
+        while (group != i / UID_GROUP_WIDTH) {
+            group = (group + ++distance) & group_mask;
+        }
+        if (distance < counts.count) {
+            counts[distance]++;
+        } else {
+            counts[counts.count - 1]++;
+        }
+    }
+
+    return counts;
+}
+
+static UIDShardArray* uid_shard_array_new(size_t capacity) {
+    UIDShardArray *array = (UIDShardArray*)malloc(sizeof(UIDShardArray));
+    array->capacity = capacity;
+    array->slots = (UID*)calloc(capacity, sizeof(UID));
+    return array;
+}
+
+static void uid_shard_array_free(UIDShardArray *array) {
+    free(array->slots);
+    free(array);
+}
+
+// slots are read by lock-free readers while writers may be changing them, so every access goes through relaxed
+// atomics. the seqlock tells the reader afterwards if what it read can be trusted.
+static inline UID uid_atomic_load(const UID *slot) {
+    UID tmp;
+    tmp.data[0] = __atomic_load_n(&slot->data[0], __ATOMIC_RELAXED);
+    tmp.data[1] = __atomic_load_n(&slot->data[1], __ATOMIC_RELAXED);
+    return tmp;
+}
+
+static inline void uid_atomic_store(UID *slot, const UID& val) {
+    __atomic_store_n(&slot->data[0], val.data[0], __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->data[1], val.data[1], __ATOMIC_RELAXED);
+}
+
+static inline size_t uid_shard_index(uint64_t h) {
+    return h >> (64 - UID_SHARD_BITS);
+}
+
+static inline void uid_shard_write_begin(UIDShard& shard) {
+    shard.seq.store(shard.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+static inline void uid_shard_write_end(UIDShard& shard) {
+    shard.seq.store(shard.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void UIDConcurrentTable::init(size_t initial_capacity) {
+    size_t capacity = 16;
+    while(capacity * UID_NUM_SHARDS < initial_capacity) {
+        capacity *= 2;
+    }
+    for(int i = 0; i < UID_NUM_SHARDS; i++) {
+        shards[i].seq.store(0);
+        shards[i].array.store(uid_shard_array_new(capacity));
+        shards[i].size = 0;
+        shards[i].retired = nonstd::vector<UIDShardArray*>();
+    }
+    zero_entry.store(0);
+}
+
+void UIDConcurrentTable::destroy() {
+    reclaim();
+    for(int i = 0; i < UID_NUM_SHARDS; i++) {
+        uid_shard_array_free(shards[i].array.load());
+        shards[i].array.store(nil);
+        shards[i].size = 0;
+        shards[i].retired.destroy();
+    }
+    zero_entry.store(0);
+}
+
+// frees the slot arrays that were replaced by resizes. no reader may be inside find() while this runs.
+void UIDConcurrentTable::reclaim() {
+    for(int i = 0; i < UID_NUM_SHARDS; i++) {
+        shards[i].write_lock.lock();
+        for(size_t j = 0; j < shards[i].retired.size(); j++) {
+            uid_shard_array_free(shards[i].retired[j]);
+        }
+        shards[i].retired.count = 0;
+        shards[i].write_lock.unlock();
+    }
+}
+
+void UIDConcurrentTable::insert(const UID& key) {
+    if(key.data[0] == 0 && key.data32[2] == 0) {
+        zero_entry.store((1ULL << 32) | key.getIdx(), std::memory_order_release);
+        return;
+    }
+    uint64_t h = key.hash();
+    UIDShard& shard = shards[uid_shard_index(h)];
+    shard.write_lock.lock();
+    UIDShardArray *array = shard.array.load(std::memory_order_relaxed);
+
+    if (((shard.size.load(std::memory_order_relaxed) + 1) * 2) >= array->capacity) { // Load factor < 0.5
+        // readers can carry on with the old array while we fill the new one
+        UIDShardArray *bigger = uid_shard_array_new(array->capacity * 2);
+        for(size_t i = 0; i < array->capacity; i++) {
+            const UID& slot = array->slots[i];
+            if(slot.data[0] == 0 && slot.data[1] == 0) {
+                continue;
+            }
+            size_t idx = slot.hash() & (bigger->capacity - 1);
+            while( ! (bigger->slots[idx].data[0] == 0 && bigger->slots[idx].data[1] == 0)) {
+                idx = (idx + 1) & (bigger->capacity - 1);
+            }
+            bigger->slots[idx] = slot;
+        }
+        uid_shard_write_begin(shard);
+        shard.array.store(bigger, std::memory_order_relaxed);
+        uid_shard_write_end(shard);
+        shard.retired.push_back(array);
+        array = bigger;
+    }
+
+    size_t mask = array->capacity - 1;
+    size_t idx = h & mask;
+    while(true) {
+        UID& slot = array->slots[idx];
+        if (slot.data[0] == 0 && slot.data[1] == 0) {
+            uid_shard_write_begin(shard);
+            uid_atomic_store(&slot, key);
+            uid_shard_write_end(shard);
+            shard.size++;
+            break;
+        }
+        if (slot.data[0] == key.data[0] && slot.data32[2] == key.data32[2]) {
+            uid_shard_write_begin(shard);
+            uid_atomic_store(&slot, key);
+            uid_shard_write_end(shard);
+            break;
+        }
+        idx = (idx + 1) & mask;
+    }
+    shard.write_lock.unlock();
+}
+
+void UIDConcurrentTable::remove(const UID& key) {
+    if(key.data[0] == 0 && key.data32[2] == 0) {
+        zero_entry.store(0, std::memory_order_release);
+        return;
+    }
+    uint64_t h = key.hash();
+    UIDShard& shard = shards[uid_shard_index(h)];
+    shard.write_lock.lock();
+    UIDShardArray *array = shard.array.load(std::memory_order_relaxed);
+    size_t mask = array->capacity - 1;
+    size_t idx = h & mask;
+    for(size_t probe_count = 0; probe_count < array->capacity; probe_count++) {
+        UID& slot = array->slots[idx];
+        if(slot.data[0] == 0 && slot.data[1] == 0) {
+            break;
+        }
+        if(slot.data[0] == key.data[0] && slot.data32[2] == key.data32[2]) {
+            // same backward shift deletion as UIDHashTable, all inside one write section so readers never see a
+            // probe chain with a hole in it
+            uid_shard_write_begin(shard);
+            uid_atomic_store(&slot, UID{0ULL, 0ULL});
+            size_t current_idx = idx;
+            size_t next_idx = (current_idx + 1) & mask;
+            while (!(array->slots[next_idx].data[0] == 0 && array->slots[next_idx].data[1] == 0)) {
+                size_t ideal_idx = array->slots[next_idx].hash() & mask;
+                bool should_move = false;
+                if (current_idx < next_idx) {
+                    should_move = (ideal_idx <= current_idx) || (ideal_idx > next_idx);
+                } else {
+                    should_move = (ideal_idx <= current_idx) && (ideal_idx > next_idx);
+                }
+                if (should_move) {
+                    uid_atomic_store(&array->slots[current_idx], array->slots[next_idx]);
+                    uid_atomic_store(&array->slots[next_idx], UID{0ULL, 0ULL});
+                    current_idx = next_idx;
+                }
+                next_idx = (next_idx + 1) & mask;
+            }
+            uid_shard_write_end(shard);
+            shard.size--;
+            break;
+        }
+        idx = (idx + 1) & mask;
+    }
+    shard.write_lock.unlock();
+}
+
+bool UIDConcurrentTable::find(const UID& key, uint32_t *out_idx) const {
+    if(key.data[0] == 0 && key.data32[2] == 0) {
+        uint64_t entry = zero_entry.load(std::memory_order_acquire);
+        *out_idx = (uint32_t)entry;
+        return entry >> 32;
+    }
+    uint64_t h = key.hash();
+    const UIDShard& shard = shards[uid_shard_index(h)];
+    while(true) {
+        uint64_t seq = shard.seq.load(std::memory_order_acquire);
+        if(seq & 1) {
+#if defined(__SSE2__)
+            _mm_pause();
+#endif
+            continue;
+        }
+        const UIDShardArray *array = shard.array.load(std::memory_order_acquire);
+        size_t mask = array->capacity - 1;
+        size_t idx = h & mask;
+        bool found = false;
+        uint32_t result = 0;
+        for(size_t probe_count = 0; probe_count < array->capacity; probe_count++) {
+            UID slot = uid_atomic_load(&array->slots[idx]);
+            if(slot.data[0] == 0 && slot.data[1] == 0) {
+                break;
+            }
+            if(slot.data[0] == key.data[0] && slot.data32[2] == key.data32[2]) {
+                found = true;
+                result = slot.data32[3];
+                break;
+            }
+            idx = (idx + 1) & mask;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(shard.seq.load(std::memory_order_relaxed) == seq) {
+            *out_idx = result;
+            return found;
+        }
+    }
+}
+
+size_t UIDConcurrentTable::size() const {
+    size_t sum = (zero_entry.load() >> 32) & 1;
+    for(int i = 0; i < UID_NUM_SHARDS; i++) {
+        sum += shards[i].size.load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
 #endif // __BYTE_ORDER == __LITTLE_ENDIAN
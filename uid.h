@@ -4,6 +4,7 @@
 #include <endian.h>
 #include <stdint.h>
 #include <cassert>
+#include <atomic>
 #include "physics.h"
 
 struct UID {
@@ -22,22 +23,215 @@ struct UID {
     uint64_t hash() const;
 };
 
+// with incremental resizing turned on, a table that needs to grow allocates the bigger slot array and then moves
+// this many buckets from the old array on every subsequent operation, so no single operation has to rehash everything.
+// has to be at least 2 for the migration to finish before the new array reaches the 0.5 load factor.
+#define UID_MIGRATE_STEP 16
+
 struct UIDHashTable {
     nonstd::vector<UID> slots;
     size_t size = 0;
     uint32_t zero_value = 0;
-    uint32_t flags = 0;
+    uint32_t flags = 0; // 1: the zero key is present, 2: incremental resizing
+    nonstd::vector<UID> migrating_slots; // the old slot array while an incremental resize is in progress
+    size_t migrate_idx = 0;
 
     void init(size_t initial_capacity = 16);
     void reserve(size_t new_capacity);
     void destroy();
     void wipe();
 
+    void set_incremental(bool incremental);
+    void migrate(size_t num_buckets);
+    void finish_migration();
+    size_t find_migrating(const UID& key) const;
+
     void insert(const UID& key);
     void remove(const UID& key);
     uint32_t& operator[](const UID& key);
+    void lookup_many(const UID* keys, size_t n, uint32_t* out_idx);
     
     nonstd::vector<int> count_probe_distances() const;
 };
 
+// lookup_many resolves keys in batches of this size: hash and prefetch the whole batch, then probe it
+#define UID_LOOKUP_BATCH 16
+
+// Swiss table variant of UIDHashTable. Every slot has a 1-byte control tag holding 7 bits of the key's hash (or
+// empty/deleted) and lookups compare a whole group of tags at once with SIMD, so most probes never touch the 16-byte
+// slots. Capacity is a power of two, the home group is found by masking and the load factor can go up to 7/8.
+#if defined(__AVX2__)
+#define UID_GROUP_WIDTH 32
+#else
+#define UID_GROUP_WIDTH 16
+#endif
+
+struct UIDSwissTable {
+    nonstd::vector<uint8_t> ctrl; // 0 = empty, 0x7F = deleted, 0x80 | (hash & 0x7F) = full
+    nonstd::vector<UID> slots;
+    size_t size = 0;
+    size_t growth_left = 0; // how many empty slots we can fill before the load factor hits 7/8
+    uint32_t zero_value = 0;
+    uint32_t flags = 0;
+
+    void init(size_t initial_capacity = UID_GROUP_WIDTH);
+    void reserve(size_t new_capacity);
+    void destroy();
+    void wipe();
+
+    void insert(const UID& key);
+    void remove(const UID& key);
+    uint32_t& operator[](const UID& key);
+    void lookup_many(const UID* keys, size_t n, uint32_t* out_idx);
+
+    size_t find(const UID& key, uint64_t h) const;
+    nonstd::vector<int> count_probe_distances() const;
+};
+
+// UID -> idx map that worker threads can share during a parallel tick. Keys are spread over shards by the high bits of
+// UID::hash() and each shard is a linear probing table with its own writer mutex and seqlock. Readers never take a lock,
+// they just retry if a writer touched the shard while they were looking. A growing shard builds its new slot array off
+// to the side and swaps it in, so readers keep working on the old array while the resize is going on. Old arrays are
+// kept until reclaim() is called at a point where nobody can be reading, e.g. between ticks.
+#define UID_SHARD_BITS 6
+#define UID_NUM_SHARDS (1 << UID_SHARD_BITS)
+
+struct UIDShardArray {
+    size_t capacity; // power of two
+    UID *slots;
+};
+
+struct alignas(64) UIDShard {
+    std::atomic<uint64_t> seq; // odd while a writer is changing the shard
+    std::atomic<UIDShardArray*> array;
+    std::atomic<size_t> size;
+    mutex write_lock;
+    nonstd::vector<UIDShardArray*> retired;
+};
+
+struct UIDConcurrentTable {
+    UIDShard shards[UID_NUM_SHARDS];
+    std::atomic<uint64_t> zero_entry; // bit 32 set if the zero key is present, low 32 bits are its value
+
+    void init(size_t initial_capacity = 16 * UID_NUM_SHARDS);
+    void destroy();
+    void reclaim();
+
+    void insert(const UID& key);
+    void remove(const UID& key);
+    bool find(const UID& key, uint32_t *out_idx) const;
+    size_t size() const;
+};
+
+// Handle to an entity in an EntityRegistry. The generation is bumped every time a slot is freed, so a handle that
+// outlives its entity is detected instead of silently pointing at whatever got the slot next.
+struct EntityHandle {
+    uint32_t slot;
+    uint32_t generation;
+};
+
+// Owns the components of one kind (units, physics objects..) in a dense array so systems can iterate over them with
+// a linear scan. Entities are addressed by UID or EntityHandle. The handle's slot is stable for the entity's whole
+// life and is what goes in the UID's idx field, the dense index behind it changes when other entities are removed.
+// Components are relocated with memcpy, same as nonstd::vector, so don't keep pointers to them across create/remove.
+template <typename T> struct EntityRegistry {
+    nonstd::vector<T> dense;
+    nonstd::vector<UID> dense_uids; // uid of each component in dense, with idx = slot
+    nonstd::vector<uint32_t> dense_slots; // slot of each component in dense
+    nonstd::vector<uint32_t> slot_dense; // dense index of each slot, or the next free slot if the slot is free
+    nonstd::vector<uint32_t> slot_generation;
+    uint32_t free_head; // UINT32_MAX when there are no free slots
+    UIDHashTable uid_to_slot;
+
+    void init(size_t initial_capacity = 16) {
+        bzero((void*)this, sizeof(EntityRegistry<T>));
+        dense.reserve(initial_capacity);
+        dense_uids.reserve(initial_capacity);
+        dense_slots.reserve(initial_capacity);
+        slot_dense.reserve(initial_capacity);
+        slot_generation.reserve(initial_capacity);
+        free_head = UINT32_MAX;
+        uid_to_slot.init(initial_capacity * 2);
+    }
+
+    void destroy() {
+        dense.destroy();
+        dense_uids.destroy();
+        dense_slots.destroy();
+        slot_dense.destroy();
+        slot_generation.destroy();
+        uid_to_slot.destroy();
+        free_head = UINT32_MAX;
+    }
+
+    template <typename... Args> EntityHandle create(UID uid, Args&&... args) {
+        uint32_t slot;
+        if(free_head != UINT32_MAX) {
+            slot = free_head;
+            free_head = slot_dense[slot];
+        } else {
+            slot = slot_dense.size();
+            slot_dense.push_back(0);
+            slot_generation.push_back(0);
+        }
+        uid.setIdx(slot);
+        slot_dense[slot] = dense.size();
+        dense.emplace_back(std::forward<Args>(args)...);
+        dense_uids.push_back(uid);
+        dense_slots.push_back(slot);
+        uid_to_slot.insert(uid);
+        return EntityHandle{slot, slot_generation[slot]};
+    }
+
+    bool alive(EntityHandle h) {
+        return h.slot < slot_generation.size() && slot_generation[h.slot] == h.generation;
+    }
+
+    EntityHandle handle(const UID& uid) {
+        uint32_t slot = uid_to_slot[uid];
+        return EntityHandle{slot, slot_generation[slot]};
+    }
+
+    // returns nil for stale handles
+    T* get(EntityHandle h) {
+        if( ! alive(h)) {
+            return nil;
+        }
+        return &dense[slot_dense[h.slot]];
+    }
+
+    T& operator[](const UID& uid) {
+        return dense[slot_dense[uid_to_slot[uid]]];
+    }
+
+    // swap-remove: the last component is moved into the hole so dense stays packed
+    void remove(EntityHandle h) {
+        assert(alive(h));
+        uint32_t idx = slot_dense[h.slot];
+        uint32_t last = dense.size() - 1;
+        uid_to_slot.remove(dense_uids[idx]);
+        dense[idx].~T();
+        if(idx != last) {
+            takeoff_memcpy(&dense[idx], &dense[last], sizeof(T));
+            dense_uids[idx] = dense_uids[last];
+            dense_slots[idx] = dense_slots[last];
+            slot_dense[dense_slots[idx]] = idx;
+        }
+        dense.count--;
+        dense_uids.count--;
+        dense_slots.count--;
+        slot_generation[h.slot]++;
+        slot_dense[h.slot] = free_head;
+        free_head = h.slot;
+    }
+
+    void remove(const UID& uid) {
+        remove(handle(uid));
+    }
+
+    size_t size() { return dense.size(); }
+    T* begin() { return dense.begin(); }
+    T* end() { return dense.end(); }
+};
+
 #endif // UID_H
@@ -0,0 +1,51 @@
+#version 430
+
+// template tree geometry, drawn once per vegetation_instance (see physics.h)
+layout(location = 0) in vec4 vertexPosition;
+layout(location = 1) in vec3 vertexTexCoord;
+layout(location = 2) in vec3 instancePosition;
+layout(location = 3) in vec2 instanceUp; // octahedral encoded
+layout(location = 4) in uvec4 instanceParams; // type, yaw, scale, shade
+
+uniform mat4 current;
+uniform mat4 previous;
+
+out vec3 texCoord;
+out vec2 velocity;
+out float z;
+flat out int typeid;
+
+const int VERTEX_TYPE_TREETRUNK = 3;
+const int VERTEX_TYPE_LEAF = 4;
+
+vec3 oct_decode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
+void main() {
+    vec3 up = oct_decode(instanceUp);
+    // any frame around up will do, the yaw is random anyway
+    vec3 side = normalize(cross(up, abs(up.x) < 0.9 ? vec3(1.0, 0.0, 0.0) : vec3(0.0, 0.0, 1.0)));
+    vec3 forward = cross(side, up);
+    float yaw = float(instanceParams.y) * (6.28318530718 / 256.0);
+    vec3 x = side * cos(yaw) + forward * sin(yaw);
+    vec3 zaxis = cross(x, up);
+    vec3 local = vertexPosition.xyz * (float(instanceParams.z) / 128.0);
+    vec3 position = instancePosition + x * local.x + up * local.y + zaxis * local.z;
+
+    vec4 curPos = current * vec4(position, 1.0);
+    vec4 prevPos = previous * vec4(position, 1.0);
+    typeid = floatBitsToInt(vertexPosition.w);
+
+    float shade = float(instanceParams.w) / 255.0;
+    vec3 color = typeid == VERTEX_TYPE_TREETRUNK ? vec3(0.4, 0.3, 0.2) : vec3(0.15, 0.4, 0.15);
+
+    velocity = (curPos.xy - prevPos.xy) / max(1.0, max(curPos.w, prevPos.w));
+    gl_Position = curPos;
+    texCoord = mix(color, vec3(0.0), 1.0 - shade);
+    z = gl_Position.z;
+}